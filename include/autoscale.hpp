@@ -0,0 +1,358 @@
+#ifndef U_CONCURRENT_AUTOSCALE_HPP
+#define U_CONCURRENT_AUTOSCALE_HPP
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+namespace concurrent {
+
+// Moves workers between stages within a budget of threads. A controller
+// thread samples the input depth of every registered stage: a stage whose
+// queue keeps growing, or is more than a quarter full, gets one more worker;
+// a stage whose queue stayed empty gives one back. Workers are pool tasks:
+// once the budget is used up, a worker of a stage that keeps up leaves its
+// loop and carries on in the backed up stage on the same pool thread. Stages
+// are dropped from the controller once their output is closed.
+class Autoscaler {
+public:
+	typedef std::shared_ptr<Autoscaler> Ptr;
+
+	// Worker bookkeeping of one stage, shared by the controller and the
+	// stage workers. The last worker to exit runs the finish callback.
+	class Stage {
+	public:
+		typedef std::shared_ptr<Stage> Ptr;
+
+		Stage(const std::string& name, size_t capacity, const std::function<size_t()>& depth, const std::function<void()>& finish) :
+			_name(name), _capacity(capacity), _depth(depth), _finish(finish) {}
+
+		const std::string& Name() const { return _name; }
+
+		// Accounts for one more worker, false once the stage is finished.
+		bool Enter() {
+			std::unique_lock<std::mutex> lock(_mutex);
+			if (_done) {
+				return false;
+			}
+			_peak = std::max(_peak, ++_workers);
+			return true;
+		}
+
+		// Called by a worker once its input is drained. Returns the stage the
+		// worker should move to, if one asked for it.
+		Ptr Exit() {
+			std::function<void()> finish;
+			Ptr next;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				if (!_moves.empty()) {
+					next = _moves.back();
+					_moves.pop_back();
+				}
+				if (--_workers || _done) {
+					return next;
+				}
+				_done = true;
+				_retire = 0;
+				_moves.clear();
+				finish.swap(_finish);
+				_send = nullptr;
+				_run = nullptr;
+			}
+			finish();
+			return next;
+		}
+
+		// True when the calling worker should stop; the last one never does.
+		bool Retire() {
+			std::unique_lock<std::mutex> lock(_mutex);
+			if ((_retire == 0 && _moves.empty()) || _workers < 2) {
+				return false;
+			}
+			if (_moves.empty()) {
+				_retire--;
+				_leaving.push_back(nullptr);
+			} else {
+				_leaving.push_back(_moves.back());
+				_moves.pop_back();
+			}
+			_workers--;
+			return true;
+		}
+
+		void Processed() { _processed.fetch_add(1, std::memory_order_relaxed); }
+
+		size_t Workers() const { std::unique_lock<std::mutex> lock(_mutex); return _workers; }
+		size_t Peak() const { std::unique_lock<std::mutex> lock(_mutex); return _peak; }
+		bool Done() const { std::unique_lock<std::mutex> lock(_mutex); return _done; }
+
+	private:
+		friend class Autoscaler;
+
+		std::string _name;
+		size_t _capacity;
+		std::function<size_t()> _depth;
+		std::function<void()> _finish;
+		std::function<void(const std::function<void()>&)> _send;
+		std::function<bool(Stage&)> _run;
+
+		mutable std::mutex _mutex;
+		size_t _workers = 0;
+		size_t _peak = 0;
+		size_t _retire = 0;
+		bool _done = false;
+		std::vector<Ptr> _moves;   // stages waiting for one of our workers
+		std::vector<Ptr> _leaving; // where retired workers go, null to stop
+
+		std::atomic<size_t> _processed{ 0 };
+
+		// Controller state.
+		size_t _id = 0;
+		size_t _last = 0;
+		size_t _growing = 0;
+		size_t _idle = 0;
+		size_t _seen = 0;
+		double _rate = 0;
+	};
+
+	struct StageStats {
+		std::string name;
+		size_t workers;
+		size_t peak;
+		size_t depth;
+		size_t processed;
+		double rate; // elements per second over the last interval
+	};
+
+	Autoscaler(size_t threads = std::thread::hardware_concurrency(), uint64_t interval = 20) : _threads(std::max<size_t>(threads, 1)), _interval(interval) {}
+
+	~Autoscaler() {
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_running = false;
+		}
+		_wake.notify_all();
+		if (_controller.joinable()) {
+			_controller.join();
+		}
+	}
+
+	size_t Threads() const { return _threads; }
+
+	// Adds a stage whose input holds depth() out of capacity elements, and
+	// starts s of its workers, fewer when the budget is used up. send hands
+	// a worker task to the stage's pool; loop is the worker body, which polls
+	// Retire() and returns true when it did, false once out of input.
+	Stage::Ptr Register(const std::string& name, size_t capacity, const std::function<size_t()>& depth, const std::function<void(const std::function<void()>&)>& send, const std::function<bool(Stage&)>& loop, const std::function<void()>& finish, size_t s) {
+		Stage::Ptr stage(new Stage(name, capacity, depth, finish));
+		stage->_send = send;
+		stage->_run = loop;
+
+		std::unique_lock<std::mutex> lock(_mutex);
+		// Every stage keeps at least one worker, even past the budget.
+		size_t room = _threads > used() ? _threads - used() : 0;
+		s = std::max<size_t>(std::min(s, room), 1);
+		for (size_t i = 0; i < s; i++) {
+			stage->Enter();
+		}
+
+		stage->_id = _registered++;
+		_stages.push_back(stage);
+		if (!_controller.joinable()) {
+			_controller = std::thread([this] { run(); });
+		}
+		lock.unlock();
+		_wake.notify_all();
+
+		for (size_t i = 0; i < s; i++) {
+			send([stage] { work(stage); });
+		}
+		return stage;
+	}
+
+	// Workers per stage as last observed, in registration order, including
+	// the stages that already finished.
+	std::vector<StageStats> Stats() const {
+		std::unique_lock<std::mutex> lock(_mutex);
+
+		std::vector<std::pair<size_t, StageStats>> stats(_finished);
+		for (const auto& s : _stages) {
+			stats.emplace_back(s->_id, stats_of(s));
+		}
+		std::sort(stats.begin(), stats.end(), [](const std::pair<size_t, StageStats>& a, const std::pair<size_t, StageStats>& b) {
+			return a.first < b.first;
+		});
+
+		std::vector<StageStats> result;
+		for (auto& s : stats) {
+			result.push_back(std::move(s.second));
+		}
+		return result;
+	}
+
+	size_t Workers() const {
+		std::unique_lock<std::mutex> lock(_mutex);
+		return used();
+	}
+
+private:
+	size_t used() const {
+		size_t n = 0;
+		for (const auto& s : _stages) {
+			n += s->Workers();
+		}
+		return n;
+	}
+
+	static StageStats stats_of(const Stage::Ptr& s) {
+		return { s->_name, s->Workers(), s->Peak(), s->_depth ? s->_depth() : 0, s->_processed.load(), s->_rate };
+	}
+
+	// Body of every worker task: runs stages until one is drained or the
+	// worker retires without a stage to move to.
+	static void work(Stage::Ptr stage) {
+		while (stage) {
+			bool retired;
+			try {
+				retired = stage->_run(*stage);
+			} catch (...) {
+				stage->Exit();
+				throw;
+			}
+
+			Stage::Ptr next;
+			if (retired) {
+				std::unique_lock<std::mutex> lock(stage->_mutex);
+				next = stage->_leaving.back();
+				stage->_leaving.pop_back();
+			} else {
+				next = stage->Exit();
+			}
+			stage = next && next->Enter() ? next : nullptr;
+		}
+	}
+
+	// Drops the finished stages, keeping their last stats.
+	void sweep() {
+		auto done = std::stable_partition(_stages.begin(), _stages.end(), [](const Stage::Ptr& s) {
+			return !s->Done();
+		});
+		for (auto it = done; it != _stages.end(); ++it) {
+			_finished.emplace_back((*it)->_id, stats_of(*it));
+		}
+		_stages.erase(done, _stages.end());
+	}
+
+	// A stage that keeps up and can spare a worker for stage, if any.
+	Stage::Ptr donor(const Stage::Ptr& stage) {
+		Stage::Ptr best;
+		for (auto& s : _stages) {
+			if (s == stage || s->_growing || s->_last > s->_capacity / 4) {
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(s->_mutex);
+			if (s->_done || s->_workers < s->_retire + s->_moves.size() + 2) {
+				continue;
+			}
+			if (!best || s->_last * best->_capacity < best->_last * s->_capacity) {
+				best = s;
+			}
+		}
+		return best;
+	}
+
+	void run() {
+		auto last = std::chrono::steady_clock::now();
+
+		std::unique_lock<std::mutex> lock(_mutex);
+		while (_running) {
+			_wake.wait(lock, [this] { return !_running || !_stages.empty(); });
+			_wake.wait_for(lock, std::chrono::milliseconds(_interval));
+			if (!_running) {
+				break;
+			}
+			sweep();
+
+			auto now = std::chrono::steady_clock::now();
+			double seconds = std::chrono::duration<double>(now - last).count();
+			last = now;
+
+			std::vector<std::pair<std::function<void(const std::function<void()>&)>, Stage::Ptr>> spawns;
+			size_t total = used();
+
+			for (auto& s : _stages) {
+				if (s->Done()) {
+					continue;
+				}
+
+				size_t processed = s->_processed.load();
+				s->_rate = seconds > 0 ? (processed - s->_seen) / seconds : 0;
+				s->_seen = processed;
+
+				size_t depth = s->_depth();
+				s->_growing = depth > s->_last ? s->_growing + 1 : 0;
+				s->_idle = depth == 0 ? s->_idle + 1 : 0;
+				s->_last = depth;
+
+				bool backed = depth > s->_capacity / 4 || s->_growing >= 2;
+				if (backed && total < _threads) {
+					std::unique_lock<std::mutex> stage(s->_mutex);
+					if (s->_send && !s->_done) {
+						s->_peak = std::max(s->_peak, ++s->_workers);
+						s->_growing = 0;
+						spawns.emplace_back(s->_send, s);
+						total++;
+					}
+				} else if (backed) {
+					// Out of threads: take a worker from a stage that keeps up.
+					auto from = donor(s);
+					if (from) {
+						std::unique_lock<std::mutex> stage(from->_mutex);
+						from->_moves.push_back(s);
+						s->_growing = 0;
+					}
+				} else if (s->_idle >= 3) {
+					std::unique_lock<std::mutex> stage(s->_mutex);
+					if (s->_workers > s->_retire + 1) {
+						s->_retire++;
+					}
+					s->_idle = 0;
+				}
+			}
+
+			lock.unlock();
+			for (auto& spawn : spawns) {
+				auto s = spawn.second;
+				spawn.first([s] { work(s); });
+			}
+			lock.lock();
+		}
+	}
+
+	const size_t _threads;
+	const uint64_t _interval;
+
+	mutable std::mutex _mutex;
+	std::condition_variable _wake;
+	bool _running = true;
+
+	std::vector<Stage::Ptr> _stages;
+	std::vector<std::pair<size_t, StageStats>> _finished;
+	size_t _registered = 0;
+	std::thread _controller;
+
+	Autoscaler(Autoscaler const&) = delete;
+	Autoscaler& operator=(Autoscaler const&) = delete;
+};
+
+}
+
+#endif
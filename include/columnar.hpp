@@ -0,0 +1,427 @@
+#ifndef U_CONCURRENT_COLUMNAR_HPP
+#define U_CONCURRENT_COLUMNAR_HPP
+
+#include <atomic>
+#include <limits>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <iterator>
+#include <type_traits>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define U_CONCURRENT_X86
+#endif
+
+namespace concurrent {
+
+enum class Cmp { Less, LessEqual, Greater, GreaterEqual, Equal, NotEqual };
+
+// Kernels over contiguous numeric columns. double and int64_t run on AVX2 or
+// SSE2 when the CPU has them, picked at run time; every other arithmetic
+// type, and every CPU without them, runs the scalar loops.
+namespace simd {
+
+	enum class Level { Scalar, SSE2, AVX2 };
+
+	// Shared by every translation unit, so Use applies to the whole program.
+	namespace detail {
+
+		inline Level detect() {
+#ifdef U_CONCURRENT_X86
+			__builtin_cpu_init();
+			if (__builtin_cpu_supports("avx2")) {
+				return Level::AVX2;
+			}
+			if (__builtin_cpu_supports("sse2")) {
+				return Level::SSE2;
+			}
+#endif
+			return Level::Scalar;
+		}
+
+		inline std::atomic<Level>& level() {
+			static std::atomic<Level> current{ detect() };
+			return current;
+		}
+
+	}
+
+	namespace {
+
+		template <typename T>
+		inline bool _test(Cmp op, T x, T v) {
+			switch (op) {
+			case Cmp::Less: return x < v;
+			case Cmp::LessEqual: return x <= v;
+			case Cmp::Greater: return x > v;
+			case Cmp::GreaterEqual: return x >= v;
+			case Cmp::Equal: return x == v;
+			default: return x != v;
+			}
+		}
+
+#ifdef U_CONCURRENT_X86
+
+		// Appends the indexes of the bits set in mask, offset by base.
+		inline size_t _bits(unsigned mask, uint32_t base, uint32_t* sel) {
+			size_t k = 0;
+			while (mask) {
+				sel[k++] = base + __builtin_ctz(mask);
+				mask &= mask - 1;
+			}
+			return k;
+		}
+
+		template <int P>
+		__attribute__((target("avx2"))) size_t _selectAvx2(const double* d, size_t n, double v, uint32_t* sel) {
+			size_t i = 0, k = 0;
+			const __m256d vv = _mm256_set1_pd(v);
+			for (; i + 4 <= n; i += 4) {
+				__m256d m = _mm256_cmp_pd(_mm256_loadu_pd(d + i), vv, P);
+				k += _bits(_mm256_movemask_pd(m), uint32_t(i), sel + k);
+			}
+			return k;
+		}
+
+		__attribute__((target("avx2"))) inline size_t _selectAvx2(const int64_t* d, size_t n, Cmp op, int64_t v, uint32_t* sel) {
+			size_t i = 0, k = 0;
+			const __m256i vv = _mm256_set1_epi64x(v);
+			for (; i + 4 <= n; i += 4) {
+				__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(d + i));
+				__m256i m;
+				switch (op) {
+				case Cmp::Less: m = _mm256_cmpgt_epi64(vv, x); break;
+				case Cmp::GreaterEqual: m = _mm256_xor_si256(_mm256_cmpgt_epi64(vv, x), _mm256_set1_epi64x(-1)); break;
+				case Cmp::Greater: m = _mm256_cmpgt_epi64(x, vv); break;
+				case Cmp::LessEqual: m = _mm256_xor_si256(_mm256_cmpgt_epi64(x, vv), _mm256_set1_epi64x(-1)); break;
+				case Cmp::Equal: m = _mm256_cmpeq_epi64(x, vv); break;
+				default: m = _mm256_xor_si256(_mm256_cmpeq_epi64(x, vv), _mm256_set1_epi64x(-1)); break;
+				}
+				k += _bits(_mm256_movemask_pd(_mm256_castsi256_pd(m)), uint32_t(i), sel + k);
+			}
+			return k;
+		}
+
+		__attribute__((target("sse2"))) inline size_t _selectSse2(const double* d, size_t n, Cmp op, double v, uint32_t* sel) {
+			size_t i = 0, k = 0;
+			const __m128d vv = _mm_set1_pd(v);
+			for (; i + 2 <= n; i += 2) {
+				__m128d x = _mm_loadu_pd(d + i);
+				__m128d m;
+				switch (op) {
+				case Cmp::Less: m = _mm_cmplt_pd(x, vv); break;
+				case Cmp::LessEqual: m = _mm_cmple_pd(x, vv); break;
+				case Cmp::Greater: m = _mm_cmpgt_pd(x, vv); break;
+				case Cmp::GreaterEqual: m = _mm_cmpge_pd(x, vv); break;
+				case Cmp::Equal: m = _mm_cmpeq_pd(x, vv); break;
+				default: m = _mm_cmpneq_pd(x, vv); break;
+				}
+				k += _bits(_mm_movemask_pd(m), uint32_t(i), sel + k);
+			}
+			return k;
+		}
+
+		__attribute__((target("avx2"))) inline void _affineAvx2(const double* in, size_t n, double a, double b, double* out) {
+			const __m256d va = _mm256_set1_pd(a), vb = _mm256_set1_pd(b);
+			size_t i = 0;
+			for (; i + 4 <= n; i += 4) {
+				_mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(in + i), va), vb));
+			}
+			for (; i < n; i++) {
+				out[i] = in[i] * a + b;
+			}
+		}
+
+		__attribute__((target("sse2"))) inline void _affineSse2(const double* in, size_t n, double a, double b, double* out) {
+			const __m128d va = _mm_set1_pd(a), vb = _mm_set1_pd(b);
+			size_t i = 0;
+			for (; i + 2 <= n; i += 2) {
+				_mm_storeu_pd(out + i, _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(in + i), va), vb));
+			}
+			for (; i < n; i++) {
+				out[i] = in[i] * a + b;
+			}
+		}
+
+		// Sum, min and max of doubles at once; the scalar tail is left to the caller.
+		__attribute__((target("avx2"))) inline size_t _foldAvx2(const double* d, size_t n, double& sum, double& lo, double& hi) {
+			if (n < 4) {
+				return 0;
+			}
+			__m256d s = _mm256_setzero_pd(), mn = _mm256_loadu_pd(d), mx = mn;
+			size_t i = 0;
+			for (; i + 4 <= n; i += 4) {
+				__m256d x = _mm256_loadu_pd(d + i);
+				s = _mm256_add_pd(s, x);
+				mn = _mm256_min_pd(mn, x);
+				mx = _mm256_max_pd(mx, x);
+			}
+
+			alignas(32) double ls[4], ln[4], lx[4];
+			_mm256_store_pd(ls, s);
+			_mm256_store_pd(ln, mn);
+			_mm256_store_pd(lx, mx);
+			for (int j = 0; j < 4; j++) {
+				sum += ls[j];
+				lo = std::min(lo, ln[j]);
+				hi = std::max(hi, lx[j]);
+			}
+			return i;
+		}
+
+		__attribute__((target("sse2"))) inline size_t _foldSse2(const double* d, size_t n, double& sum, double& lo, double& hi) {
+			if (n < 2) {
+				return 0;
+			}
+			__m128d s = _mm_setzero_pd(), mn = _mm_loadu_pd(d), mx = mn;
+			size_t i = 0;
+			for (; i + 2 <= n; i += 2) {
+				__m128d x = _mm_loadu_pd(d + i);
+				s = _mm_add_pd(s, x);
+				mn = _mm_min_pd(mn, x);
+				mx = _mm_max_pd(mx, x);
+			}
+
+			alignas(16) double ls[2], ln[2], lx[2];
+			_mm_store_pd(ls, s);
+			_mm_store_pd(ln, mn);
+			_mm_store_pd(lx, mx);
+			for (int j = 0; j < 2; j++) {
+				sum += ls[j];
+				lo = std::min(lo, ln[j]);
+				hi = std::max(hi, lx[j]);
+			}
+			return i;
+		}
+
+		__attribute__((target("avx2"))) inline size_t _foldAvx2(const int64_t* d, size_t n, int64_t& sum, int64_t& lo, int64_t& hi) {
+			if (n < 4) {
+				return 0;
+			}
+			const __m256i* p = reinterpret_cast<const __m256i*>(d);
+			__m256i s = _mm256_setzero_si256(), mn = _mm256_loadu_si256(p), mx = mn;
+			size_t i = 0;
+			for (; i + 4 <= n; i += 4) {
+				__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(d + i));
+				s = _mm256_add_epi64(s, x);
+				mn = _mm256_blendv_epi8(mn, x, _mm256_cmpgt_epi64(mn, x));
+				mx = _mm256_blendv_epi8(mx, x, _mm256_cmpgt_epi64(x, mx));
+			}
+
+			alignas(32) int64_t ls[4], ln[4], lx[4];
+			_mm256_store_si256(reinterpret_cast<__m256i*>(ls), s);
+			_mm256_store_si256(reinterpret_cast<__m256i*>(ln), mn);
+			_mm256_store_si256(reinterpret_cast<__m256i*>(lx), mx);
+			for (int j = 0; j < 4; j++) {
+				sum += ls[j];
+				lo = std::min(lo, ln[j]);
+				hi = std::max(hi, lx[j]);
+			}
+			return i;
+		}
+
+#endif
+
+		template <typename T>
+		size_t _fold(const T* d, size_t n, T& sum, T& lo, T& hi, std::false_type) {
+			return 0;
+		}
+
+		template <typename T>
+		size_t _fold(const T* d, size_t n, T& sum, T& lo, T& hi, std::true_type) {
+#ifdef U_CONCURRENT_X86
+			Level l = detail::level().load(std::memory_order_relaxed);
+			if (l == Level::AVX2) {
+				return _foldAvx2(d, n, sum, lo, hi);
+			}
+			if (l == Level::SSE2 && std::is_same<T, double>::value) {
+				return _foldSse2(reinterpret_cast<const double*>(d), n, reinterpret_cast<double&>(sum), reinterpret_cast<double&>(lo), reinterpret_cast<double&>(hi));
+			}
+#endif
+			return 0;
+		}
+
+		template <typename T>
+		using _vector = std::integral_constant<bool, std::is_same<T, double>::value || std::is_same<T, int64_t>::value>;
+
+	}
+
+	inline Level Detected() { return detail::detect(); }
+	inline Level Current() { return detail::level().load(); }
+
+	// Caps the kernels to l, at most what the CPU supports. For testing and
+	// comparing the code paths.
+	inline void Use(Level l) { detail::level().store(std::min(l, detail::detect())); }
+
+	// Writes to sel the indexes i in [0, n) where d[i] op v holds, in order,
+	// and returns how many. sel needs room for n indexes.
+	template <typename T>
+	size_t Select(const T* d, size_t n, Cmp op, T v, uint32_t* sel) {
+		size_t i = 0, k = 0;
+#ifdef U_CONCURRENT_X86
+		Level l = detail::level().load(std::memory_order_relaxed);
+		if (std::is_same<T, double>::value && l == Level::AVX2) {
+			const double* dd = reinterpret_cast<const double*>(d);
+			double dv = double(v);
+			switch (op) {
+			case Cmp::Less: k = _selectAvx2<_CMP_LT_OQ>(dd, n, dv, sel); break;
+			case Cmp::LessEqual: k = _selectAvx2<_CMP_LE_OQ>(dd, n, dv, sel); break;
+			case Cmp::Greater: k = _selectAvx2<_CMP_GT_OQ>(dd, n, dv, sel); break;
+			case Cmp::GreaterEqual: k = _selectAvx2<_CMP_GE_OQ>(dd, n, dv, sel); break;
+			case Cmp::Equal: k = _selectAvx2<_CMP_EQ_OQ>(dd, n, dv, sel); break;
+			default: k = _selectAvx2<_CMP_NEQ_UQ>(dd, n, dv, sel); break;
+			}
+			i = n & ~size_t(3);
+		} else if (std::is_same<T, double>::value && l == Level::SSE2) {
+			k = _selectSse2(reinterpret_cast<const double*>(d), n, op, double(v), sel);
+			i = n & ~size_t(1);
+		} else if (std::is_same<T, int64_t>::value && l == Level::AVX2) {
+			k = _selectAvx2(reinterpret_cast<const int64_t*>(d), n, op, int64_t(v), sel);
+			i = n & ~size_t(3);
+		}
+#endif
+		for (; i < n; i++) {
+			if (_test(op, d[i], v)) {
+				sel[k++] = uint32_t(i);
+			}
+		}
+		return k;
+	}
+
+	// out[i] = in[i] * a + b; in and out may be the same column.
+	template <typename T>
+	void Affine(const T* in, size_t n, T a, T b, T* out) {
+#ifdef U_CONCURRENT_X86
+		Level l = detail::level().load(std::memory_order_relaxed);
+		if (std::is_same<T, double>::value && l == Level::AVX2) {
+			_affineAvx2(reinterpret_cast<const double*>(in), n, double(a), double(b), reinterpret_cast<double*>(out));
+			return;
+		}
+		if (std::is_same<T, double>::value && l == Level::SSE2) {
+			_affineSse2(reinterpret_cast<const double*>(in), n, double(a), double(b), reinterpret_cast<double*>(out));
+			return;
+		}
+#endif
+		for (size_t i = 0; i < n; i++) {
+			out[i] = in[i] * a + b;
+		}
+	}
+
+	// Sum, minimum and maximum of n > 0 values in one pass. Vector sums add
+	// doubles in another order than a plain loop, rounding may differ.
+	template <typename T>
+	void Fold(const T* d, size_t n, T& sum, T& lo, T& hi) {
+		sum = T();
+		lo = std::numeric_limits<T>::max();
+		hi = std::numeric_limits<T>::lowest();
+
+		size_t i = _fold(d, n, sum, lo, hi, _vector<T>());
+		for (; i < n; i++) {
+			sum += d[i];
+			lo = std::min(lo, d[i]);
+			hi = std::max(hi, d[i]);
+		}
+	}
+
+	template <typename T>
+	void Gather(const T* in, const uint32_t* sel, size_t n, T* out) {
+		for (size_t i = 0; i < n; i++) {
+			out[i] = in[sel[i]];
+		}
+	}
+
+}
+
+// Column of numbers passed between stages as one element, so Filter and
+// Transform callbacks run once per batch and the work itself in the simd
+// kernels. Where() narrows a selection vector instead of moving values;
+// Compact() gathers the selected values once they are needed contiguous.
+template <typename T>
+class Batch {
+public:
+	static_assert(std::is_arithmetic<T>::value, "Batch: arithmetic types only");
+
+	Batch() {}
+	explicit Batch(std::vector<T> values) : _values(std::move(values)) {}
+
+	template <typename Iter>
+	Batch(Iter begin, Iter end) : _values(begin, end) {}
+
+	// [begin, end) cut in batches of up to n values.
+	template <typename Iter>
+	static std::vector<Batch<T>> Split(Iter begin, Iter end, size_t n) {
+		std::vector<Batch<T>> batches;
+		n = std::max<size_t>(n, 1);
+		while (begin != end) {
+			Iter e = begin;
+			std::advance(e, std::min<size_t>(n, std::distance(begin, end)));
+			batches.emplace_back(begin, e);
+			begin = e;
+		}
+		return batches;
+	}
+
+	// Selected values.
+	size_t Size() const { return _selected ? _selection.size() : _values.size(); }
+	bool Empty() const { return Size() == 0; }
+
+	Batch& Where(Cmp op, T v) {
+		Compact();
+		_selection.resize(_values.size());
+		_selection.resize(simd::Select(_values.data(), _values.size(), op, v, _selection.data()));
+		_selected = true;
+		return *this;
+	}
+
+	// Every selected x becomes x * a + b.
+	Batch& Affine(T a, T b) {
+		Compact();
+		simd::Affine(_values.data(), _values.size(), a, b, _values.data());
+		return *this;
+	}
+
+	Batch& Compact() {
+		if (_selected) {
+			simd::Gather(_values.data(), _selection.data(), _selection.size(), _values.data());
+			_values.resize(_selection.size());
+			_selection.clear();
+			_selected = false;
+		}
+		return *this;
+	}
+
+	// Zero, max() and lowest() when empty.
+	T Sum() const { T s, lo, hi; fold(s, lo, hi); return s; }
+	T Min() const { T s, lo, hi; fold(s, lo, hi); return lo; }
+	T Max() const { T s, lo, hi; fold(s, lo, hi); return hi; }
+
+	const std::vector<T>& Values() {
+		Compact();
+		return _values;
+	}
+
+	const std::vector<uint32_t>& Selection() const { return _selection; }
+	bool Selected() const { return _selected; }
+
+private:
+	void fold(T& s, T& lo, T& hi) const {
+		if (!_selected) {
+			simd::Fold(_values.data(), _values.size(), s, lo, hi);
+			return;
+		}
+
+		std::vector<T> picked(_selection.size());
+		simd::Gather(_values.data(), _selection.data(), _selection.size(), picked.data());
+		simd::Fold(picked.data(), picked.size(), s, lo, hi);
+	}
+
+	std::vector<T> _values;
+	std::vector<uint32_t> _selection;
+	bool _selected = false;
+};
+
+}
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef U_CONCURRENT_EPOCH_HPP
+#define U_CONCURRENT_EPOCH_HPP
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <functional>
+
+namespace concurrent {
+
+// Epoch based reclamation. Readers enter the current epoch, counted on one
+// of several padded counters picked by thread, and leave it when done;
+// they never block. Retired objects are freed once no reader that entered
+// before their removal can still be inside: the epoch only advances when
+// every reader of the previous one has left.
+class EpochDomain {
+public:
+	typedef std::shared_ptr<EpochDomain> Ptr;
+
+	// Keeps the calling thread inside an epoch while alive.
+	class Guard {
+	public:
+		Guard(Guard&& g) : _counter(g._counter) { g._counter = nullptr; }
+		~Guard() {
+			if (_counter) {
+				_counter->fetch_sub(1);
+			}
+		}
+
+	private:
+		friend class EpochDomain;
+
+		explicit Guard(std::atomic<size_t>* c) : _counter(c) {}
+
+		std::atomic<size_t>* _counter;
+
+		Guard(Guard const&) = delete;
+		Guard& operator=(Guard const&) = delete;
+	};
+
+	EpochDomain(size_t threshold = 64) : _threshold(threshold) {}
+
+	~EpochDomain() {
+		for (auto& bag : _bags) {
+			for (auto& fn : bag) {
+				fn();
+			}
+		}
+	}
+
+	Guard Enter() {
+		size_t stripe = std::hash<std::thread::id>()(std::this_thread::get_id()) % Stripes;
+		for (;;) {
+			uint64_t e = _epoch.load();
+			auto& c = _readers[e & 1][stripe].count;
+			c.fetch_add(1);
+			// Raced with an advance: the previous epoch may be drained already.
+			if (_epoch.load() == e) {
+				return Guard(&c);
+			}
+			c.fetch_sub(1);
+		}
+	}
+
+	// Runs fn once no reader can reach what it frees, from a later Retire
+	// or Collect call, or from the destructor.
+	void Retire(const std::function<void()>& fn) {
+		std::unique_lock<std::mutex> lock(_mutex);
+		_bags[_epoch.load() & 1].push_back(fn);
+		if (++_pending >= _threshold) {
+			advance(lock);
+		}
+	}
+
+	template <typename T>
+	void Retire(T* p) {
+		Retire([p] { delete p; });
+	}
+
+	// Frees what it can without waiting.
+	void Collect() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		advance(lock);
+	}
+
+	uint64_t Epoch() const { return _epoch.load(); }
+
+private:
+	static constexpr size_t Stripes = 16;
+
+	// One cache line per counter; padded, as C++14 new ignores alignas(64).
+	struct Counter {
+		std::atomic<size_t> count{ 0 };
+		char pad[64 - sizeof(std::atomic<size_t>)];
+	};
+
+	bool drained(uint64_t parity) const {
+		for (const auto& c : _readers[parity]) {
+			if (c.count.load()) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Objects retired in epoch e - 1 are unreachable to readers of e, so
+	// they go once the readers of e - 1 left. The epoch then moves on and
+	// reuses their counters.
+	void advance(std::unique_lock<std::mutex>& lock) {
+		uint64_t e = _epoch.load();
+		uint64_t prev = (e + 1) & 1;
+		if (!drained(prev)) {
+			return;
+		}
+
+		std::vector<std::function<void()>> bag;
+		bag.swap(_bags[prev]);
+		_pending -= bag.size();
+		_epoch.store(e + 1);
+
+		lock.unlock();
+		for (auto& fn : bag) {
+			fn();
+		}
+		lock.lock();
+	}
+
+	std::atomic<uint64_t> _epoch{ 1 };
+	Counter _readers[2][Stripes];
+
+	std::mutex _mutex;
+	std::vector<std::function<void()>> _bags[2];
+	size_t _pending = 0;
+	const size_t _threshold;
+
+	EpochDomain(EpochDomain const&) = delete;
+	EpochDomain& operator=(EpochDomain const&) = delete;
+};
+
+}
+
+#endif
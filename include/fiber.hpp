@@ -10,11 +10,32 @@ namespace concurrent {
 	using namespace boost::this_fiber;
 	using ChannelStatus = boost::fibers::channel_op_status;
 
+#if BOOST_VERSION < 106400
 	template<typename T> 
 	using Channel = boost::fibers::unbounded_channel<T>;
+#else
+	// Holds at least capacity elements. buffered_channel wants a power of
+	// two and keeps one slot free, so the buffer is the smallest power of two
+	// above capacity.
+	template<typename T>
+	class Channel : public boost::fibers::buffered_channel<T> {
+	public:
+		Channel(size_t capacity = 1 << 10) : boost::fibers::buffered_channel<T>(buffer(capacity)) {}
+
+	private:
+		static size_t buffer(size_t capacity) {
+			size_t n = 2;
+			while (n <= capacity) {
+				n <<= 1;
+			}
+			return n;
+		}
+	};
+#endif
 
 class FiberScheduler {
 public:
+	typedef std::shared_ptr<FiberScheduler> Ptr;
 
 	FiberScheduler(size_t num = 1) {
 		boost::fibers::use_scheduling_algorithm<boost::fibers::algo::shared_work>(); 
@@ -42,7 +63,10 @@ public:
 	void Run(const std::function<void()>& fun) {
 		_counter.fetch_add(1);
 		typename Task<void>::Ptr ptr(new Task<void>(fun, [this] {
-			_counter.fetch_sub(1);
+			{
+				lock_t lock(_mutex);
+				_counter.fetch_sub(1);
+			}
 			_cnd.notify_all();
 		}));
 			
@@ -52,7 +76,10 @@ public:
 	}
 
 	void Close() {
-		_running.store(false);
+		{
+			lock_t lock(_mutex);
+			_running.store(false);
+		}
 		if (_pool->IsRunning()) {
 			_cnd.notify_all();
 
@@ -82,6 +109,119 @@ private:
 	FiberScheduler& operator=(FiberScheduler const&) = delete;
 };
 
+// Stream whose stages run as fibers of a FiberScheduler, linked by fiber
+// aware channels: a stage waiting for input or room parks its fiber, not a
+// thread, so many mostly idle stages share the scheduler threads. Elements
+// are popped into a default constructed T. Capacities are the number of
+// elements a channel holds, see Channel.
+//
+// This is a builder of its own with Filter, Transform, ForEach and Reduce,
+// not a fiber backend for Streamer, whose stages block in SyncQueue, on a
+// std::condition_variable, and run as Pool tasks. Running them as fibers
+// needs both made pluggable, a queue waiting on boost::fibers primitives and
+// a FiberScheduler in place of the pool, before the other stages can follow.
+template <typename T>
+class FiberStream {
+public:
+	typedef std::shared_ptr<FiberStream<T>> Ptr;
+	typedef std::shared_ptr<Channel<T>> ChannelPtr;
+
+	// Elements pushed into Input() by hand; close it when done.
+	FiberStream(FiberScheduler::Ptr s, size_t capacity = 1 << 10) : _scheduler(s), _out(new Channel<T>(capacity)) {}
+
+	// Streams [begin, end) from a feeder fiber.
+	template <typename Iter>
+	FiberStream(Iter begin, Iter end, FiberScheduler::Ptr s, size_t capacity = 1 << 10) : FiberStream(s, capacity) {
+		auto out = _out;
+		_scheduler->Run([out, begin, end] {
+			for (Iter it = begin; it != end; ++it) {
+				if (out->push(*it) != ChannelStatus::success) {
+					break;
+				}
+			}
+			out->close();
+		});
+	}
+
+	FiberStream(FiberScheduler::Ptr s, ChannelPtr out) : _scheduler(s), _out(out) {}
+
+	ChannelPtr Input() { return _out; }
+	ChannelPtr Output() { return _out; }
+
+	typename FiberStream<T>::Ptr Filter(const std::function<bool(const T&)>& fn, size_t s = 1, size_t capacity = 1 << 10) {
+		typename FiberStream<T>::Ptr item(new FiberStream<T>(_scheduler, ChannelPtr(new Channel<T>(capacity))));
+
+		stage(item->Output(), s, [fn](T&& v, Channel<T>& out) {
+			if (fn(v)) {
+				return out.push(std::move(v)) == ChannelStatus::success;
+			}
+			return true;
+		});
+		return item;
+	}
+
+	template <typename _O>
+	typename FiberStream<_O>::Ptr Transform(const std::function<_O(T&&)>& fn, size_t s = 1, size_t capacity = 1 << 10) {
+		typename FiberStream<_O>::Ptr item(new FiberStream<_O>(_scheduler, typename FiberStream<_O>::ChannelPtr(new Channel<_O>(capacity))));
+
+		stage(item->Output(), s, [fn](T&& v, Channel<_O>& out) {
+			return out.push(fn(std::move(v))) == ChannelStatus::success;
+		});
+		return item;
+	}
+
+	// Terminal operations run in the calling thread, parking it as a fiber
+	// while the channel is empty.
+	void ForEach(const std::function<void(const T&)>& fn) {
+		T v;
+		while (_out->pop(v) == ChannelStatus::success) {
+			fn(v);
+		}
+	}
+
+	template <typename _O>
+	_O Reduce(const std::function<void(const T&, _O&)>& fn) {
+		_O o = _O();
+		T v;
+		while (_out->pop(v) == ChannelStatus::success) {
+			fn(v, o);
+		}
+		return o;
+	}
+
+private:
+	// Runs s fibers applying fn to every element; the last one to finish
+	// closes out. fn returns false once out is closed.
+	template <typename C, typename F>
+	void stage(std::shared_ptr<C> out, size_t s, F fn) {
+		auto in = _out;
+
+		s = std::max<size_t>(s, 1);
+		std::shared_ptr<std::atomic<size_t>> left(new std::atomic<size_t>(s));
+
+		for (size_t i = 0; i < s; i++) {
+			_scheduler->Run([in, out, fn, left] {
+				T v;
+				while (in->pop(v) == ChannelStatus::success) {
+					if (!fn(std::move(v), *out)) {
+						break;
+					}
+				}
+
+				if (left->fetch_sub(1) == 1) {
+					out->close();
+				}
+			});
+		}
+	}
+
+	FiberScheduler::Ptr _scheduler;
+	ChannelPtr _out;
+
+	FiberStream(FiberStream const&) = delete;
+	FiberStream& operator=(FiberStream const&) = delete;
+};
+
 }
 
 #endif
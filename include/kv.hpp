@@ -2,17 +2,178 @@
 #define U_CONCURRENT_KV_HPP
 
 #include <map>
+#include <array>
+#include <algorithm>
+#include <iterator>
+#include <functional>
+#include <memory>
+#include <type_traits>
 #include <unordered_map>
+#include <shared_mutex>
 #include <condition_variable>
 
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cstdint>
+
+#include "rwlock.hpp"
 
 namespace concurrent {
 
-template <typename _M>
+namespace {
+
+	template <typename...>
+	struct _voider { typedef void type; };
+
+	// Lock taken by read only operations: shared when the lock has a shared
+	// mode, exclusive otherwise.
+	template <typename L, typename = void>
+	struct _ReadLock {
+		typedef std::unique_lock<L> type;
+	};
+
+	template <typename L>
+	struct _ReadLock<L, typename _voider<decltype(std::declval<L&>().lock_shared())>::type> {
+		typedef std::shared_lock<L> type;
+	};
+
+	// Iterator to the value of k and whether v was just inserted there: one
+	// probe for maps with unique keys, find then insert for multimaps.
+	template <typename M>
+	auto _insertOrFind(M& m, const typename M::key_type& k, const typename M::mapped_type& v, int)
+		-> decltype(m.insert(std::make_pair(k, v)).second, std::pair<typename M::iterator, bool>()) {
+		return m.insert(std::make_pair(k, v));
+	}
+
+	template <typename M>
+	std::pair<typename M::iterator, bool> _insertOrFind(M& m, const typename M::key_type& k, const typename M::mapped_type& v, long) {
+		auto it = m.find(k);
+		if (it != m.end()) {
+			return std::make_pair(it, false);
+		}
+		return std::make_pair(m.insert(std::make_pair(k, v)), true);
+	}
+
+	// Whether two keys of m belong to the same group.
+	template <typename M>
+	auto _sameKey(const M& m, const typename M::key_type& a, const typename M::key_type& b, int) -> decltype(m.key_eq()(a, b)) {
+		return m.key_eq()(a, b);
+	}
+
+	template <typename M>
+	bool _sameKey(const M& m, const typename M::key_type& a, const typename M::key_type& b, long) {
+		return !m.key_comp()(a, b) && !m.key_comp()(b, a);
+	}
+
+	// Equal keys are adjacent in sorted and hashed maps alike, so each group
+	// is one run of the iteration order, found in a single pass. take copies
+	// or moves a value into its group.
+	template <typename Storage, typename _M, typename Take>
+	void _group(_M& map, const std::function<void(const typename _M::key_type&, std::shared_ptr<Storage>)>& fn, Take take) {
+		using StoragePtr = std::shared_ptr<Storage>;
+
+		auto it = map.begin();
+		while (it != map.end()) {
+			auto end = std::next(it);
+			size_t n = 1;
+			while (end != map.end() && _sameKey(map, it->first, end->first, 0)) {
+				++end;
+				++n;
+			}
+
+			StoragePtr storage(new Storage());
+			storage->reserve(n);
+			for (auto v = it; v != end; ++v) {
+				storage->push_back(take(v->second));
+			}
+
+			fn(it->first, storage);
+			it = end;
+		}
+	}
+
+	template <typename Storage, typename _M>
+	void _aggregate(const _M& map, const std::function<void(const typename _M::key_type&, std::shared_ptr<Storage>)>& fn) {
+		_group<Storage>(map, fn, [](const typename _M::mapped_type& v) -> const typename _M::mapped_type& { return v; });
+	}
+
+	// Hashed maps, whose keys can be spread with their own hasher.
+	template <typename M, typename = void>
+	struct _hashed : std::false_type {};
+
+	template <typename M>
+	struct _hashed<M, typename _voider<typename M::hasher>::type> : std::true_type {};
+
+	// Walks the ranges of several maps one after the other.
+	template <typename It>
+	class _Chained {
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef typename std::iterator_traits<It>::value_type value_type;
+		typedef typename std::iterator_traits<It>::difference_type difference_type;
+		typedef typename std::iterator_traits<It>::pointer pointer;
+		typedef typename std::iterator_traits<It>::reference reference;
+
+		_Chained() {}
+		explicit _Chained(std::vector<std::pair<It, It>>&& ranges) : _ranges(std::move(ranges)), _cur(0) {
+			skip();
+		}
+
+		reference operator*() const { return *_ranges[_cur].first; }
+		pointer operator->() const { return &*_ranges[_cur].first; }
+
+		_Chained& operator++() {
+			++_ranges[_cur].first;
+			skip();
+			return *this;
+		}
+
+		_Chained operator++(int) {
+			_Chained old(*this);
+			++*this;
+			return old;
+		}
+
+		bool operator==(const _Chained& o) const {
+			return _cur == o._cur && (_cur == End || _ranges[_cur].first == o._ranges[_cur].first);
+		}
+
+		bool operator!=(const _Chained& o) const { return !(*this == o); }
+
+	private:
+		static constexpr size_t End = size_t(-1);
+
+		void skip() {
+			while (_cur < _ranges.size() && _ranges[_cur].first == _ranges[_cur].second) {
+				_cur++;
+			}
+			if (_cur == _ranges.size()) {
+				_cur = End;
+			}
+		}
+
+		std::vector<std::pair<It, It>> _ranges;
+		size_t _cur = End;
+	};
+
+	template <typename It>
+	constexpr size_t _Chained<It>::End;
+
+}
+
+// Map behind one lock of type _Lock. With a shared mutex, such as
+// ReaderBiasedMutex or std::shared_timed_mutex, Find, Contains, Size,
+// ForEach and Aggregate only take it shared and run alongside each other.
+// The content is kept in copy-on-write shards: a snapshot pins the shards,
+// and a writer then copies only the shard it changes. Hashed maps are spread
+// with their own hasher; sorted maps stay in one shard, the only split that
+// agrees with any comparator and keeps the walks in key order.
+template <typename _M, typename _Lock = std::mutex>
 class _SyncMap {
 public:
-	typedef std::shared_ptr<_SyncMap<_M>> Ptr;
+	typedef std::shared_ptr<_SyncMap<_M, _Lock>> Ptr;
 
 	typedef typename _M::key_type KeyType;
 	typedef typename _M::mapped_type ValueType;
@@ -20,118 +181,800 @@ public:
 	typedef typename _M::value_type PairType;
 	typedef typename std::pair<KeyType, ValueType> Type;
 
-	_SyncMap() {}
+	static constexpr size_t Shards = _hashed<_M>::value ? 16 : 1;
+
+	// Immutable content of the map at one point in time, see Snapshot.
+	class View {
+	public:
+		typedef _Chained<typename _M::const_iterator> const_iterator;
+		typedef const_iterator iterator;
+
+		size_t size() const {
+			size_t n = 0;
+			for (const auto& s : _shards) {
+				n += s->size();
+			}
+			return n;
+		}
+
+		bool empty() const { return size() == 0; }
+
+		size_t count(const KeyType& k) const { return _shards[ShardOf(k)]->count(k); }
+
+		const_iterator begin() const {
+			std::vector<std::pair<typename _M::const_iterator, typename _M::const_iterator>> ranges;
+			for (const auto& s : _shards) {
+				ranges.emplace_back(s->begin(), s->end());
+			}
+			return const_iterator(std::move(ranges));
+		}
+
+		const_iterator end() const { return const_iterator(); }
+
+	private:
+		friend class _SyncMap;
+
+		std::array<std::shared_ptr<const _M>, Shards> _shards;
+	};
+
+	typedef std::shared_ptr<const View> SnapshotPtr;
+
+	// Entry Find returns. It holds the version of the shard it points into,
+	// so it stays valid while writers move on; equal to End() when the key
+	// was missing.
+	class Found {
+	public:
+		const PairType& operator*() const { return *_it; }
+		const PairType* operator->() const { return &*_it; }
+
+		bool operator==(const Found& o) const { return _version == o._version && (!_version || _it == o._it); }
+		bool operator!=(const Found& o) const { return !(*this == o); }
+
+	private:
+		friend class _SyncMap;
+
+		std::shared_ptr<const _M> _version;
+		typename _M::const_iterator _it;
+	};
+
+	_SyncMap() {
+		for (auto& s : _shards) {
+			s = std::make_shared<_M>();
+		}
+	}
 	~_SyncMap() { Close(); }
 
+	static size_t ShardOf(const KeyType& k) { return shardOf(k, _hashed<_M>()); }
+
     void Insert(const KeyType& k, const ValueType& v) {
-        std::unique_lock<std::mutex> lock(_mutex);
-        _map.insert(std::make_pair(k, v));
+        std::unique_lock<_Lock> lock(_mutex);
+        own(k).insert(std::make_pair(k, v));
     }
 
 	void Insert(const Type& t) {
-		std::unique_lock<std::mutex> lock(_mutex);
-		_map.insert(t);
+		std::unique_lock<_Lock> lock(_mutex);
+		own(t.first).insert(t);
+	}
+
+	void Insert(Type&& t) {
+		std::unique_lock<_Lock> lock(_mutex);
+		own(t.first).insert(std::move(t));
+	}
+
+	void Insert(PairType&& t) {
+		std::unique_lock<_Lock> lock(_mutex);
+		own(t.first).insert(std::move(t));
 	}
 
     bool Remove(const KeyType& k) {
-        std::unique_lock<std::mutex> lock(_mutex);
-        auto it = _map.find(k);
-        if (it == _map.end()) {
+        std::unique_lock<_Lock> lock(_mutex);
+        auto& m = own(k);
+        auto it = m.find(k);
+        if (it == m.end()) {
             return false;
         }
 
-        _map.erase(it);
+        m.erase(it);
         return true;
     }
 
-    auto Find(const KeyType& k) {
-        std::unique_lock<std::mutex> lock(_mutex);
-        return _map.find(k);
-    }
-
-	auto End() {
-		std::unique_lock<std::mutex> lock(_mutex);
-		return _map.end();
+	// Pins a version of one shard, so the next write there copies it;
+	// Contains, GetOr and Visit do not.
+	Found Find(const KeyType& k) const {
+		read_t lock(_mutex);
+		const auto& s = _shards[ShardOf(k)];
+		Found f;
+		auto it = s->find(k);
+		if (it != s->end()) {
+			f._version = s;
+			f._it = it;
+		}
+		return f;
 	}
 
+	Found End() const { return Found(); }
+
 	bool Contains(const KeyType& k) {
-		std::unique_lock<std::mutex> lock(_mutex);
-		auto it = _map.find(k);
-		if (it == _map.end()) {
+		read_t lock(_mutex);
+		const auto& s = _shards[ShardOf(k)];
+		return s->find(k) != s->end();
+	}
+
+	// Inserts v, or merges it into the stored value with merge(stored, v).
+	// True when inserted. Read-modify-write in one lookup under the lock.
+	template <typename F>
+	bool Upsert(const KeyType& k, const ValueType& v, F merge) {
+		std::unique_lock<_Lock> lock(_mutex);
+		auto r = _insertOrFind(own(k), k, v, 0);
+		if (!r.second) {
+			merge(r.first->second, v);
+		}
+		return r.second;
+	}
+
+	// Runs fn on the value of k, default constructed if missing, and
+	// returns the result.
+	template <typename F>
+	ValueType Compute(const KeyType& k, F fn) {
+		std::unique_lock<_Lock> lock(_mutex);
+		auto& v = _insertOrFind(own(k), k, ValueType(), 0).first->second;
+		fn(v);
+		return v;
+	}
+
+	ValueType GetOr(const KeyType& k, const ValueType& def) const {
+		read_t lock(_mutex);
+		const auto& s = _shards[ShardOf(k)];
+		auto it = s->find(k);
+		return it == s->end() ? def : it->second;
+	}
+
+	// Calls fn with the value of k under the lock, false when missing.
+	template <typename F>
+	bool Visit(const KeyType& k, F fn) const {
+		read_t lock(_mutex);
+		const auto& s = _shards[ShardOf(k)];
+		auto it = s->find(k);
+		if (it == s->end()) {
 			return false;
 		}
+		fn(it->second);
 		return true;
 	}
 
     void Clear() {
-        std::unique_lock<std::mutex> lock(_mutex);
-        _map.clear();
+        std::unique_lock<_Lock> lock(_mutex);
+        for (auto& s : _shards) {
+            if (s.use_count() > 1) {
+                s = std::make_shared<_M>();
+            } else {
+                s->clear();
+            }
+        }
     }
 
     size_t Size () const {
-        std::unique_lock<std::mutex> lock(_mutex);
-        return _map.size();
+        read_t lock(_mutex);
+        return size();
     }
 
 	void ForEach(const std::function<void(const Type&)>& fn) const {
-		std::unique_lock<std::mutex> lock(_mutex);
-		std::for_each(_map.begin(), _map.end(), fn);
+		read_t lock(_mutex);
+		for (const auto& s : _shards) {
+			std::for_each(s->begin(), s->end(), fn);
+		}
+	}
+
+	// Immutable view of the content at the time of the call, iterated
+	// without the lock. Taking one only pins the current shards; while it
+	// is alive, the first change to a shard copies that shard alone. Each
+	// version is freed with its last reader.
+	SnapshotPtr Snapshot() const {
+		static_assert(std::is_copy_constructible<ValueType>::value, "Snapshot needs copyable values");
+		std::shared_ptr<View> view(new View());
+		read_t lock(_mutex);
+		std::copy(_shards.begin(), _shards.end(), view->_shards.begin());
+		return view;
 	}
 
 	template <typename Storage>
 	void Aggregate(const std::function<void(const KeyType&, std::shared_ptr<Storage>)>& fn) const {
+		read_t lock(_mutex);
+		for (const auto& s : _shards) {
+			_aggregate<Storage>(*s, fn);
+		}
+	}
 
-		using StoragePtr = std::shared_ptr<Storage>;
-
-		std::set<KeyType> keys;
-
-		std::unique_lock<std::mutex> lock(_mutex);
-
-		std::for_each(_map.begin(), _map.end(), [&keys](auto t) { keys.insert(t.first); });
-		for (const KeyType& t : keys) {
-			auto it = _map.equal_range(t); 
-			StoragePtr storage(new Storage());
-			storage->reserve(std::distance(it.first, it.second));
-			std::transform(it.first, it.second, std::back_inserter(*storage), [](auto element) { return element.second; });
-
-			fn(t, storage);
+	// Groups the content like Aggregate, moving the values out: the lock is
+	// only held to swap the shards for empty ones.
+	template <typename Storage>
+	void Extract(const std::function<void(const KeyType&, std::shared_ptr<Storage>)>& fn) {
+		Shelf taken;
+		{
+			std::unique_lock<_Lock> lock(_mutex);
+			for (size_t i = 0; i < Shards; i++) {
+				taken[i] = std::make_shared<_M>();
+				std::swap(taken[i], _shards[i]);
+			}
+		}
+		for (const auto& s : taken) {
+			// A snapshot still reads it: copy instead.
+			if (s.use_count() > 1) {
+				_aggregate<Storage>(*s, fn);
+				continue;
+			}
+			_group<Storage>(*s, fn, [](ValueType& v) -> ValueType&& { return std::move(v); });
 		}
 	}
 
     void Close() {
 		{
-			std::unique_lock<std::mutex> lock(_mutex);
+			std::unique_lock<_Lock> lock(_mutex);
 			_opened = false;
 		}
 		_waiter.notify_all();
     }
 
     void Wait() {
-        std::unique_lock<std::mutex> lock(_mutex);
+        std::unique_lock<_Lock> lock(_mutex);
 		while (_opened) {
 			_waiter.wait(lock);
 		}
     }
 
 	void WaitForEmpty() {
-		std::unique_lock<std::mutex> lock(_mutex);
-		while (_opened || _map.size()) {
+		std::unique_lock<_Lock> lock(_mutex);
+		while (_opened || size()) {
 			_waiter.wait(lock);
 		}
 	}
 
 protected:
+	typedef typename _ReadLock<_Lock>::type read_t;
+	typedef std::array<std::shared_ptr<_M>, Shards> Shelf;
+
+	static size_t shardOf(const KeyType& k, std::true_type) {
+		// Spread the hash so shards do not mirror the buckets of the shard maps.
+		uint64_t h = static_cast<uint64_t>(typename _M::hasher()(k)) * 0x9E3779B97F4A7C15ull;
+		return (h >> 32) % Shards;
+	}
+
+	static size_t shardOf(const KeyType&, std::false_type) { return 0; }
+
+	size_t size() const {
+		size_t n = 0;
+		for (const auto& s : _shards) {
+			n += s->size();
+		}
+		return n;
+	}
+
+
 	bool _opened = true;
 	
-    mutable std::mutex _mutex;
-    std::condition_variable _waiter;
+    mutable _Lock _mutex;
+    std::condition_variable_any _waiter;
+
+	// Shard of k the writers may change in place, under the write lock.
+	// Maps of move-only values cannot be snapshot, so they are never shared.
+	_M& own(const KeyType& k) { return own(_shards[ShardOf(k)], std::is_copy_constructible<ValueType>()); }
+
+	static _M& own(std::shared_ptr<_M>& s, std::true_type) {
+		if (s.use_count() > 1) {
+			s = std::make_shared<_M>(*s);
+		}
+		return *s;
+	}
 
-    _M _map;
+	static _M& own(std::shared_ptr<_M>& s, std::false_type) { return *s; }
+
+    Shelf _shards;
 
 	_SyncMap(_SyncMap const&) = delete;
 	_SyncMap& operator=(_SyncMap const&) = delete;
 };
 
+template <typename _M, typename _Lock>
+constexpr size_t _SyncMap<_M, _Lock>::Shards;
+
+// Map split in independent shards by key hash. Shards are not locked:
+// each one must be written by a single owner until the map is closed,
+// afterwards they can be read and aggregated concurrently.
+template <typename _M>
+class _ShardedMap {
+public:
+	typedef std::shared_ptr<_ShardedMap<_M>> Ptr;
+
+	typedef typename _M::key_type KeyType;
+	typedef typename _M::mapped_type ValueType;
+
+	typedef typename _M::value_type PairType;
+	typedef typename std::pair<KeyType, ValueType> Type;
+
+	_ShardedMap(size_t s = std::thread::hardware_concurrency()) : _shards(std::max<size_t>(s, 1)) {}
+	~_ShardedMap() { Close(); }
+
+	size_t Shards() const { return _shards.size(); }
+
+	size_t ShardOf(const KeyType& k) const {
+		// Spread the hash so shards do not mirror the buckets of the shard maps.
+		uint64_t h = static_cast<uint64_t>(_hash(k)) * 0x9E3779B97F4A7C15ull;
+		return (h >> 32) % _shards.size();
+	}
+
+	_M& Shard(size_t i) { return _shards[i]; }
+	const _M& Shard(size_t i) const { return _shards[i]; }
+
+	size_t Size() const {
+		size_t s = 0;
+		for (const auto& m : _shards) {
+			s += m.size();
+		}
+		return s;
+	}
+
+	void ForEach(const std::function<void(const Type&)>& fn) const {
+		for (const auto& m : _shards) {
+			std::for_each(m.begin(), m.end(), fn);
+		}
+	}
+
+	template <typename Storage>
+	void Aggregate(const std::function<void(const KeyType&, std::shared_ptr<Storage>)>& fn) const {
+		for (const auto& m : _shards) {
+			_aggregate<Storage>(m, fn);
+		}
+	}
+
+	template <typename Storage>
+	void Aggregate(size_t shard, const std::function<void(const KeyType&, std::shared_ptr<Storage>)>& fn) const {
+		_aggregate<Storage>(_shards[shard], fn);
+	}
+
+	void Close() {
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_opened = false;
+		}
+		_waiter.notify_all();
+	}
+
+	void Wait() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		while (_opened) {
+			_waiter.wait(lock);
+		}
+	}
+
+	void WaitForEmpty() {
+		Wait();
+	}
+
+private:
+	bool _opened = true;
+
+	mutable std::mutex _mutex;
+	std::condition_variable _waiter;
+
+	std::vector<_M> _shards;
+	std::hash<KeyType> _hash;
+
+	_ShardedMap(_ShardedMap const&) = delete;
+	_ShardedMap& operator=(_ShardedMap const&) = delete;
+};
+
+// Hash map striped over Shards independently locked maps, each on its own
+// cache lines, so writers of different keys rarely wait on each other.
+// Same interface as _SyncMap, except Find copies the value out: a shard
+// iterator would outlive the shard lock.
+template <typename _K, typename _V, size_t _Shards = 16>
+class SyncShardedHashMap {
+public:
+	typedef std::shared_ptr<SyncShardedHashMap> Ptr;
+
+	typedef std::unordered_map<_K, _V> Map;
+
+	typedef _K KeyType;
+	typedef _V ValueType;
+
+	typedef typename Map::value_type PairType;
+	typedef typename std::pair<KeyType, ValueType> Type;
+
+	static_assert(_Shards > 0, "SyncShardedHashMap: at least one shard");
+
+	SyncShardedHashMap() {}
+	~SyncShardedHashMap() { Close(); }
+
+	size_t Shards() const { return _Shards; }
+
+	size_t ShardOf(const KeyType& k) const {
+		uint64_t h = static_cast<uint64_t>(_hash(k)) * 0x9E3779B97F4A7C15ull;
+		return (h >> 32) % _Shards;
+	}
+
+	void Insert(const KeyType& k, const ValueType& v) {
+		Shard& s = shard(k);
+		std::unique_lock<std::mutex> lock(s.mutex);
+		s.map.insert(std::make_pair(k, v));
+	}
+
+	void Insert(const Type& t) {
+		Shard& s = shard(t.first);
+		std::unique_lock<std::mutex> lock(s.mutex);
+		s.map.insert(t);
+	}
+
+	void Insert(Type&& t) {
+		Shard& s = shard(t.first);
+		std::unique_lock<std::mutex> lock(s.mutex);
+		s.map.insert(std::move(t));
+	}
+
+	void Insert(PairType&& t) {
+		Shard& s = shard(t.first);
+		std::unique_lock<std::mutex> lock(s.mutex);
+		s.map.insert(std::move(t));
+	}
+
+	bool Remove(const KeyType& k) {
+		Shard& s = shard(k);
+		std::unique_lock<std::mutex> lock(s.mutex);
+		return s.map.erase(k) > 0;
+	}
+
+	bool Find(const KeyType& k, ValueType& v) const {
+		const Shard& s = shard(k);
+		std::unique_lock<std::mutex> lock(s.mutex);
+		auto it = s.map.find(k);
+		if (it == s.map.end()) {
+			return false;
+		}
+		v = it->second;
+		return true;
+	}
+
+	bool Contains(const KeyType& k) const {
+		const Shard& s = shard(k);
+		std::unique_lock<std::mutex> lock(s.mutex);
+		return s.map.find(k) != s.map.end();
+	}
+
+	// Same as _SyncMap, locking only the shard of k.
+	template <typename F>
+	bool Upsert(const KeyType& k, const ValueType& v, F merge) {
+		Shard& s = shard(k);
+		std::unique_lock<std::mutex> lock(s.mutex);
+		auto r = s.map.insert(std::make_pair(k, v));
+		if (!r.second) {
+			merge(r.first->second, v);
+		}
+		return r.second;
+	}
+
+	template <typename F>
+	ValueType Compute(const KeyType& k, F fn) {
+		Shard& s = shard(k);
+		std::unique_lock<std::mutex> lock(s.mutex);
+		auto& v = s.map[k];
+		fn(v);
+		return v;
+	}
+
+	ValueType GetOr(const KeyType& k, const ValueType& def) const {
+		const Shard& s = shard(k);
+		std::unique_lock<std::mutex> lock(s.mutex);
+		auto it = s.map.find(k);
+		return it == s.map.end() ? def : it->second;
+	}
+
+	template <typename F>
+	bool Visit(const KeyType& k, F fn) const {
+		const Shard& s = shard(k);
+		std::unique_lock<std::mutex> lock(s.mutex);
+		auto it = s.map.find(k);
+		if (it == s.map.end()) {
+			return false;
+		}
+		fn(it->second);
+		return true;
+	}
+
+	void Clear() {
+		for (auto& s : _shards) {
+			std::unique_lock<std::mutex> lock(s.mutex);
+			s.map.clear();
+		}
+	}
+
+	size_t Size() const {
+		size_t n = 0;
+		for (const auto& s : _shards) {
+			std::unique_lock<std::mutex> lock(s.mutex);
+			n += s.map.size();
+		}
+		return n;
+	}
+
+	// Locks one shard at a time, writers to the others go on.
+	void ForEach(const std::function<void(const Type&)>& fn) const {
+		for (const auto& s : _shards) {
+			std::unique_lock<std::mutex> lock(s.mutex);
+			std::for_each(s.map.begin(), s.map.end(), fn);
+		}
+	}
+
+	template <typename Storage>
+	void Aggregate(const std::function<void(const KeyType&, std::shared_ptr<Storage>)>& fn) const {
+		for (size_t i = 0; i < _Shards; i++) {
+			Aggregate<Storage>(i, fn);
+		}
+	}
+
+	template <typename Storage>
+	void Aggregate(size_t shard, const std::function<void(const KeyType&, std::shared_ptr<Storage>)>& fn) const {
+		const Shard& s = _shards[shard];
+		std::unique_lock<std::mutex> lock(s.mutex);
+		_aggregate<Storage>(s.map, fn);
+	}
+
+	void Close() {
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_opened = false;
+		}
+		_waiter.notify_all();
+	}
+
+	void Wait() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		while (_opened) {
+			_waiter.wait(lock);
+		}
+	}
+
+	void WaitForEmpty() {
+		Wait();
+	}
+
+private:
+	// A cache line apart from the next shard, padded since plain new does
+	// not honour alignas(64) before C++17.
+	struct Shard {
+		mutable std::mutex mutex;
+		Map map;
+		char pad[64];
+	};
+
+	Shard& shard(const KeyType& k) { return _shards[ShardOf(k)]; }
+	const Shard& shard(const KeyType& k) const { return _shards[ShardOf(k)]; }
+
+	Shard _shards[_Shards];
+	std::hash<KeyType> _hash;
+
+	bool _opened = true;
+
+	mutable std::mutex _mutex;
+	std::condition_variable _waiter;
+
+	SyncShardedHashMap(SyncShardedHashMap const&) = delete;
+	SyncShardedHashMap& operator=(SyncShardedHashMap const&) = delete;
+};
+
+// Multimap keeping the values of a key in one contiguous vector, in hash
+// shards locked independently. An element costs its own size plus vector
+// slack instead of a tree node, and a group is handed out as its vector:
+// Extract moves it out whole when Storage is std::vector<_V>.
+template <typename _K, typename _V, size_t _Shards = 16>
+class SyncGroupMap {
+public:
+	typedef std::shared_ptr<SyncGroupMap> Ptr;
+
+	typedef std::vector<_V> Group;
+	typedef std::unordered_map<_K, Group> Map;
+
+	typedef _K KeyType;
+	typedef _V ValueType;
+
+	typedef std::pair<const _K, _V> PairType;
+	typedef std::pair<_K, _V> Type;
+
+	static_assert(_Shards > 0, "SyncGroupMap: at least one shard");
+
+	SyncGroupMap() {}
+	~SyncGroupMap() { Close(); }
+
+	size_t Shards() const { return _Shards; }
+
+	size_t ShardOf(const KeyType& k) const {
+		uint64_t h = static_cast<uint64_t>(_hash(k)) * 0x9E3779B97F4A7C15ull;
+		return (h >> 32) % _Shards;
+	}
+
+	void Insert(const KeyType& k, const ValueType& v) { append(k, ValueType(v)); }
+	void Insert(const Type& t) { append(t.first, ValueType(t.second)); }
+	void Insert(Type&& t) { append(t.first, std::move(t.second)); }
+	void Insert(PairType&& t) { append(t.first, std::move(t.second)); }
+
+	// Drops the whole group of k.
+	bool Remove(const KeyType& k) {
+		Shard& s = shard(k);
+		std::unique_lock<std::mutex> lock(s.mutex);
+		auto it = s.map.find(k);
+		if (it == s.map.end()) {
+			return false;
+		}
+		_size.fetch_sub(it->second.size());
+		s.map.erase(it);
+		return true;
+	}
+
+	bool Contains(const KeyType& k) const {
+		const Shard& s = shard(k);
+		std::unique_lock<std::mutex> lock(s.mutex);
+		return s.map.find(k) != s.map.end();
+	}
+
+	// Calls fn with the group of k under its shard lock, false when missing.
+	template <typename F>
+	bool Visit(const KeyType& k, F fn) const {
+		const Shard& s = shard(k);
+		std::unique_lock<std::mutex> lock(s.mutex);
+		auto it = s.map.find(k);
+		if (it == s.map.end()) {
+			return false;
+		}
+		fn(it->second);
+		return true;
+	}
+
+	void Clear() {
+		for (auto& s : _shards) {
+			std::unique_lock<std::mutex> lock(s.mutex);
+			for (const auto& g : s.map) {
+				_size.fetch_sub(g.second.size());
+			}
+			s.map.clear();
+		}
+	}
+
+	// Values, not groups.
+	size_t Size() const { return _size.load(); }
+
+	size_t Groups() const {
+		size_t n = 0;
+		for (const auto& s : _shards) {
+			std::unique_lock<std::mutex> lock(s.mutex);
+			n += s.map.size();
+		}
+		return n;
+	}
+
+	void ForEach(const std::function<void(const Type&)>& fn) const {
+		for (const auto& s : _shards) {
+			std::unique_lock<std::mutex> lock(s.mutex);
+			for (const auto& g : s.map) {
+				for (const auto& v : g.second) {
+					fn(Type(g.first, v));
+				}
+			}
+		}
+	}
+
+	template <typename Storage>
+	void Aggregate(const std::function<void(const KeyType&, std::shared_ptr<Storage>)>& fn) const {
+		for (size_t i = 0; i < _Shards; i++) {
+			Aggregate<Storage>(i, fn);
+		}
+	}
+
+	template <typename Storage>
+	void Aggregate(size_t shard, const std::function<void(const KeyType&, std::shared_ptr<Storage>)>& fn) const {
+		const Shard& s = _shards[shard];
+		std::unique_lock<std::mutex> lock(s.mutex);
+		for (const auto& g : s.map) {
+			fn(g.first, std::shared_ptr<Storage>(new Storage(g.second.begin(), g.second.end())));
+		}
+	}
+
+	// Hands the groups out and leaves the map empty.
+	template <typename Storage>
+	void Extract(const std::function<void(const KeyType&, std::shared_ptr<Storage>)>& fn) {
+		for (size_t i = 0; i < _Shards; i++) {
+			Extract<Storage>(i, fn);
+		}
+	}
+
+	template <typename Storage>
+	void Extract(size_t shard, const std::function<void(const KeyType&, std::shared_ptr<Storage>)>& fn) {
+		Map taken;
+		{
+			Shard& s = _shards[shard];
+			std::unique_lock<std::mutex> lock(s.mutex);
+			std::swap(taken, s.map);
+		}
+
+		for (auto& g : taken) {
+			_size.fetch_sub(g.second.size());
+			fn(g.first, adopt<Storage>(std::move(g.second)));
+		}
+	}
+
+	void Close() {
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_opened = false;
+		}
+		_waiter.notify_all();
+	}
+
+	void Wait() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		while (_opened) {
+			_waiter.wait(lock);
+		}
+	}
+
+	void WaitForEmpty() {
+		Wait();
+	}
+
+private:
+	// A cache line apart from the next shard, padded since plain new does
+	// not honour alignas(64) before C++17.
+	struct Shard {
+		mutable std::mutex mutex;
+		Map map;
+		char pad[64];
+	};
+
+	Shard& shard(const KeyType& k) { return _shards[ShardOf(k)]; }
+	const Shard& shard(const KeyType& k) const { return _shards[ShardOf(k)]; }
+
+	void append(const KeyType& k, ValueType&& v) {
+		Shard& s = shard(k);
+		std::unique_lock<std::mutex> lock(s.mutex);
+		s.map[k].push_back(std::move(v));
+		_size.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	template <typename Storage>
+	static typename std::enable_if<std::is_same<Storage, Group>::value, std::shared_ptr<Storage>>::type adopt(Group&& g) {
+		return std::make_shared<Storage>(std::move(g));
+	}
+
+	template <typename Storage>
+	static typename std::enable_if<!std::is_same<Storage, Group>::value, std::shared_ptr<Storage>>::type adopt(Group&& g) {
+		return std::shared_ptr<Storage>(new Storage(std::make_move_iterator(g.begin()), std::make_move_iterator(g.end())));
+	}
+
+	Shard _shards[_Shards];
+	std::hash<KeyType> _hash;
+	std::atomic<size_t> _size{ 0 };
+
+	bool _opened = true;
+
+	mutable std::mutex _mutex;
+	std::condition_variable _waiter;
+
+	SyncGroupMap(SyncGroupMap const&) = delete;
+	SyncGroupMap& operator=(SyncGroupMap const&) = delete;
+};
+
+// Map a KV<_M> stage fills: _M itself when it is one of the concurrent maps
+// above, a _SyncMap around it when it is a plain container.
+template <typename _M, typename = void>
+struct _SyncOf {
+	typedef _SyncMap<_M> type;
+};
+
+template <typename _M>
+struct _SyncOf<_M, typename _voider<typename _M::Ptr>::type> {
+	typedef _M type;
+};
+
+template <typename _M>
+using _sync_t = typename _SyncOf<_M>::type;
+
 template <typename _K, typename _V>
 using SyncMap = _SyncMap<std::map<_K, _V>>;
 
@@ -141,6 +984,19 @@ using SyncHashMap = _SyncMap<std::unordered_map<_K, _V>>;
 template <typename _K, typename _V>
 using SyncMultiMap = _SyncMap<std::multimap<_K, _V>>;
 
+// Read mostly maps, readers only share the lock.
+template <typename _K, typename _V>
+using SharedSyncMap = _SyncMap<std::map<_K, _V>, ReaderBiasedMutex>;
+
+template <typename _K, typename _V>
+using SharedSyncHashMap = _SyncMap<std::unordered_map<_K, _V>, ReaderBiasedMutex>;
+
+template <typename _K, typename _V>
+using ShardedHashMap = _ShardedMap<std::unordered_map<_K, _V>>;
+
+template <typename _K, typename _V>
+using ShardedMultiMap = _ShardedMap<std::unordered_multimap<_K, _V>>;
+
 }
 
 #endif // U_CONCURRENT_MAP_HPP
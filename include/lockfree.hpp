@@ -0,0 +1,556 @@
+#ifndef U_CONCURRENT_LOCKFREE_HPP
+#define U_CONCURRENT_LOCKFREE_HPP
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <cstdint>
+#include <functional>
+#include <condition_variable>
+
+#include "epoch.hpp"
+
+namespace concurrent {
+
+// Open addressing hash map for read-mostly lookups. Slots hold pointers to
+// immutable nodes: readers probe without locking or writing anything but
+// their epoch counter, writers swap nodes in with a CAS. Removed keys leave
+// a tombstone. Past half load the table is copied into a new one a few
+// chunks per write, while readers keep going through whichever table holds
+// a key. Replaced nodes and old tables are freed through an EpochDomain.
+template <typename _K, typename _V>
+class LockFreeHashMap {
+public:
+	typedef std::shared_ptr<LockFreeHashMap> Ptr;
+
+	typedef _K KeyType;
+	typedef _V ValueType;
+
+	typedef std::pair<const _K, _V> PairType;
+	typedef std::pair<_K, _V> Type;
+
+	LockFreeHashMap(size_t capacity = 16) : _table(new Table(slots(capacity))) {}
+
+	~LockFreeHashMap() {
+		Close();
+		finish();
+		delete _table.load();
+	}
+
+	// Keeps the value already there, as _SyncMap does.
+	void Insert(const KeyType& k, const ValueType& v) { put(new Node(k, v), false); }
+	void Insert(const Type& t) { put(new Node(t.first, t.second), false); }
+	void Insert(Type&& t) { put(new Node(std::move(t.first), std::move(t.second)), false); }
+	void Insert(PairType&& t) { put(new Node(t.first, std::move(t.second)), false); }
+
+	// Replaces the value already there.
+	void Put(const KeyType& k, const ValueType& v) { put(new Node(k, v), true); }
+
+	bool Remove(const KeyType& k) {
+		auto guard = _epoch.Enter();
+		help();
+
+		size_t h = hash(k);
+		Table* t = _table.load();
+		for (;;) {
+			size_t i = h & t->mask;
+			bool moved = false;
+			for (size_t n = 0; n <= t->mask && !moved; n++, i = (i + 1) & t->mask) {
+				auto& slot = t->slots[i];
+				uintptr_t p = slot.load();
+				for (;;) {
+					Node* cur = node(p);
+					if (!cur) {
+						if (!(p & Moved)) {
+							return false;
+						}
+						moved = true;
+						break;
+					}
+					if (!_eq(cur->pair.first, k)) {
+						break;
+					}
+					if (p & Moved) {
+						moved = true;
+						break;
+					}
+					if (p & Dead) {
+						return false;
+					}
+					if (slot.compare_exchange_strong(p, p | Dead)) {
+						_size.fetch_sub(1);
+						return true;
+					}
+				}
+			}
+			if (!moved) {
+				return false;
+			}
+			t = t->next.load();
+		}
+	}
+
+	// Inserts v, or replaces the stored value with a copy merged through
+	// merge(copy, v). merge may run again if another writer got in first.
+	template <typename F>
+	bool Upsert(const KeyType& k, const ValueType& v, F merge) {
+		auto guard = _epoch.Enter();
+		bool inserted = false;
+		apply(k, [&](const Node* cur) {
+			inserted = !cur;
+			if (inserted) {
+				return new Node(k, v);
+			}
+			ValueType c = cur->pair.second;
+			merge(c, v);
+			return new Node(k, std::move(c));
+		}, false);
+		return inserted;
+	}
+
+	// Replaces the value of k, default constructed if missing, with a copy
+	// fn ran on, and returns it. fn may run again on a lost race.
+	template <typename F>
+	ValueType Compute(const KeyType& k, F fn) {
+		auto guard = _epoch.Enter();
+		Node* n = apply(k, [&](const Node* cur) {
+			ValueType c = cur ? cur->pair.second : ValueType();
+			fn(c);
+			return new Node(k, std::move(c));
+		}, false);
+		return n->pair.second;
+	}
+
+	ValueType GetOr(const KeyType& k, const ValueType& def) const {
+		auto guard = _epoch.Enter();
+		const Node* n = lookup(k);
+		return n ? n->pair.second : def;
+	}
+
+	// Calls fn with the value of k, false when missing. The value is
+	// immutable, writers replace it.
+	template <typename F>
+	bool Visit(const KeyType& k, F fn) const {
+		auto guard = _epoch.Enter();
+		const Node* n = lookup(k);
+		if (!n) {
+			return false;
+		}
+		fn(n->pair.second);
+		return true;
+	}
+
+	// Copies the value out, false when k is missing.
+	bool Find(const KeyType& k, ValueType& v) const {
+		auto guard = _epoch.Enter();
+		const Node* n = lookup(k);
+		if (!n) {
+			return false;
+		}
+		v = n->pair.second;
+		return true;
+	}
+
+	bool Contains(const KeyType& k) const {
+		auto guard = _epoch.Enter();
+		return lookup(k) != nullptr;
+	}
+
+	// Not atomic with writers running at the same time.
+	void Clear() {
+		std::unique_lock<std::mutex> lock(_resize);
+		finish();
+		Table* old = _table.exchange(new Table(slots(0)));
+		_size.store(0);
+		_epoch.Retire(old);
+	}
+
+	size_t Size() const { return _size.load(); }
+
+	// Weakly consistent: sees every key present for the whole walk once,
+	// may or may not see keys changed meanwhile. While a copy runs, keys
+	// written since only live in the next tables, so the walk goes through
+	// all of them and keeps the nodes a lookup would find, minus the keys
+	// it already saw in an earlier table before they were copied.
+	void ForEach(const std::function<void(const Type&)>& fn) const {
+		auto guard = _epoch.Enter();
+		Walked walked;
+		for (Table* t = _table.load(); t; t = t->next.load()) {
+			std::vector<bool> seen(t->mask + 1);
+			for (size_t i = 0; i <= t->mask; i++) {
+				uintptr_t p = t->slots[i].load();
+				const Node* cur = node(p);
+				if (!cur || (p & (Moved | Dead))) {
+					continue;
+				}
+				if (!walked.empty() && (lookup(cur->pair.first, walked[0].first) != cur || visited(walked, cur->pair.first))) {
+					continue;
+				}
+				seen[i] = true;
+				fn(Type(cur->pair.first, cur->pair.second));
+			}
+			walked.emplace_back(t, std::move(seen));
+		}
+	}
+
+	// Keys are unique, each group holds one value.
+	template <typename Storage>
+	void Aggregate(const std::function<void(const KeyType&, std::shared_ptr<Storage>)>& fn) const {
+		ForEach([&fn](const Type& t) {
+			std::shared_ptr<Storage> s(new Storage());
+			s->push_back(t.second);
+			fn(t.first, s);
+		});
+	}
+
+	void Close() {
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_opened = false;
+		}
+		_waiter.notify_all();
+	}
+
+	void Wait() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		while (_opened) {
+			_waiter.wait(lock);
+		}
+	}
+
+	void WaitForEmpty() {
+		Wait();
+	}
+
+private:
+	// Low pointer bits of a slot; nodes come from new, so they are free.
+	static constexpr uintptr_t Moved = 1;
+	static constexpr uintptr_t Dead = 2;
+	static constexpr size_t Chunk = 64;
+
+	struct Node {
+		template <typename K, typename V>
+		Node(K&& k, V&& v) : pair(std::forward<K>(k), std::forward<V>(v)) {}
+
+		PairType pair;
+	};
+
+	// Nodes are owned by one table: migration copies them, so the old
+	// table frees whatever it still points to.
+	struct Table {
+		Table(size_t n) : mask(n - 1), slots(new std::atomic<uintptr_t>[n]) {
+			for (size_t i = 0; i < n; i++) {
+				slots[i].store(0, std::memory_order_relaxed);
+			}
+		}
+
+		~Table() {
+			for (size_t i = 0; i <= mask; i++) {
+				delete node(slots[i].load());
+			}
+		}
+
+		const size_t mask;
+		std::unique_ptr<std::atomic<uintptr_t>[]> slots;
+
+		std::atomic<size_t> used{ 0 };
+		std::atomic<Table*> next{ nullptr };
+
+		// Migration progress, in chunks of Chunk slots.
+		size_t chunks = 0;
+		std::atomic<size_t> cursor{ 0 };
+		std::atomic<size_t> done{ 0 };
+	};
+
+	// Tables a ForEach went through, with the slots it called fn on.
+	typedef std::vector<std::pair<Table*, std::vector<bool>>> Walked;
+
+	static Node* node(uintptr_t p) { return reinterpret_cast<Node*>(p & ~(Moved | Dead)); }
+
+	static size_t slots(size_t capacity) {
+		size_t n = 16;
+		while (n < capacity * 2) {
+			n <<= 1;
+		}
+		return n;
+	}
+
+	size_t hash(const KeyType& k) const {
+		uint64_t h = static_cast<uint64_t>(_hash(k)) * 0x9E3779B97F4A7C15ull;
+		return static_cast<size_t>(h ^ (h >> 32));
+	}
+
+	// Live node of k, following moved slots into the next tables.
+	const Node* lookup(const KeyType& k, Table* t = nullptr) const {
+		if (!t) {
+			t = _table.load();
+		}
+
+		size_t h = hash(k);
+		while (t) {
+			size_t i = h & t->mask;
+			Table* next = nullptr;
+			for (size_t n = 0; n <= t->mask; n++, i = (i + 1) & t->mask) {
+				uintptr_t p = t->slots[i].load();
+				const Node* cur = node(p);
+				if (!cur) {
+					if (p & Moved) {
+						next = t->next.load();
+					}
+					break;
+				}
+				if (_eq(cur->pair.first, k)) {
+					if (p & Moved) {
+						next = t->next.load();
+						break;
+					}
+					return (p & Dead) ? nullptr : cur;
+				}
+			}
+			t = next;
+		}
+		return nullptr;
+	}
+
+	// Whether the walk already called fn on k: a key keeps its slot in a
+	// table, so its copy in a later table maps back to that slot.
+	bool visited(const Walked& walked, const KeyType& k) const {
+		size_t h = hash(k);
+		for (const auto& w : walked) {
+			Table* t = w.first;
+			size_t i = h & t->mask;
+			for (size_t n = 0; n <= t->mask; n++, i = (i + 1) & t->mask) {
+				const Node* cur = node(t->slots[i].load());
+				if (!cur) {
+					break;
+				}
+				if (_eq(cur->pair.first, k)) {
+					if (w.second[i]) {
+						return true;
+					}
+					break;
+				}
+			}
+		}
+		return false;
+	}
+
+	void put(Node* fresh, bool overwrite) {
+		auto guard = _epoch.Enter();
+		Node* in = apply(fresh->pair.first, [fresh, overwrite](const Node* cur) {
+			return cur && !overwrite ? nullptr : fresh;
+		}, true);
+		if (!in) {
+			delete fresh;
+		}
+	}
+
+	// Swaps in make(live node of k or nullptr) and returns it, or nullptr
+	// when make does. On a lost CAS make runs again with the node that won;
+	// its previous result is deleted unless reuse says it hands out the
+	// same node every time. Runs inside an epoch guard.
+	template <typename Make>
+	Node* apply(const KeyType& k, Make make, bool reuse) {
+		help();
+
+		size_t h = hash(k);
+		Table* t = _table.load();
+		for (;;) {
+			size_t i = h & t->mask;
+			bool moved = false, wait = false;
+			for (size_t n = 0; n <= t->mask && !moved && !wait; n++, i = (i + 1) & t->mask) {
+				auto& slot = t->slots[i];
+				uintptr_t p = slot.load();
+				for (;;) {
+					Node* cur = node(p);
+					if (cur && !_eq(cur->pair.first, k)) {
+						break;
+					}
+					if (p & Moved) {
+						moved = true;
+						break;
+					}
+					if ((!cur || (p & Dead)) && crowded()) {
+						wait = true;
+						break;
+					}
+
+					Node* fresh = make(cur && !(p & Dead) ? cur : nullptr);
+					if (!fresh) {
+						return nullptr;
+					}
+					if (slot.compare_exchange_strong(p, reinterpret_cast<uintptr_t>(fresh))) {
+						if (!cur) {
+							_size.fetch_add(1);
+							if (t->used.fetch_add(1) + 1 > (t->mask + 1) / 2) {
+								grow(t);
+							}
+						} else {
+							if (p & Dead) {
+								_size.fetch_add(1);
+							}
+							_epoch.Retire(cur);
+						}
+						return fresh;
+					}
+					if (!reuse) {
+						delete fresh;
+					}
+				}
+			}
+
+			if (moved) {
+				t = t->next.load();
+				continue;
+			}
+			if (wait) {
+				finish();
+				t = _table.load();
+				continue;
+			}
+
+			// Every slot probed: only possible while a copy lags behind.
+			grow(t);
+			finish();
+			t = _table.load();
+		}
+	}
+
+	void grow(Table* t) {
+		if (t->next.load()) {
+			return;
+		}
+
+		std::unique_lock<std::mutex> lock(_resize);
+		if (t != _table.load() || t->next.load()) {
+			return;
+		}
+
+		// Sized on live keys, so tables full of tombstones shrink back.
+		t->chunks = (t->mask + Chunk) / Chunk;
+		t->next.store(new Table(slots(_size.load() * 2)));
+	}
+
+	// True once the next table is a quarter full. A helper stalled in the
+	// middle of a chunk holds the copy back, and the next table must keep
+	// room for the rest of it, so new keys then wait for the copy to end.
+	bool crowded() const {
+		Table* next = _table.load()->next.load();
+		return next && next->used.load() > (next->mask + 1) / 4;
+	}
+
+	// Copies up to two chunks into the next table, true while a copy is
+	// still running.
+	bool help() {
+		Table* t = _table.load();
+		Table* next = t->next.load();
+		if (!next) {
+			return false;
+		}
+
+		for (int k = 0; k < 2; k++) {
+			size_t c = t->cursor.fetch_add(1);
+			if (c >= t->chunks) {
+				break;
+			}
+
+			migrate(t, next, c);
+			if (t->done.fetch_add(1) + 1 == t->chunks) {
+				_table.store(next);
+				_epoch.Retire(t);
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void finish() {
+		auto guard = _epoch.Enter();
+		while (help()) {
+			std::this_thread::yield();
+		}
+	}
+
+	// Writers only go to the next table once a key's slot is marked moved,
+	// so until then the copy there is this chunk's alone to replace.
+	void migrate(Table* t, Table* next, size_t chunk) {
+		size_t end = std::min((chunk + 1) * Chunk, t->mask + 1);
+		for (size_t i = chunk * Chunk; i < end; i++) {
+			auto& slot = t->slots[i];
+			uintptr_t p = slot.load();
+			Node* copy = nullptr;
+			for (;;) {
+				Node* cur = node(p);
+				if (cur && (!(p & Dead) || copy)) {
+					Node* fresh = new Node(cur->pair.first, cur->pair.second);
+					place(next, fresh, p & Dead, copy);
+					if (copy) {
+						_epoch.Retire(copy);
+					}
+					copy = fresh;
+				}
+				if (slot.compare_exchange_strong(p, p | Moved)) {
+					break;
+				}
+			}
+		}
+	}
+
+	void place(Table* t, Node* fresh, uintptr_t dead, Node* copy) {
+		const KeyType& k = fresh->pair.first;
+		uintptr_t v = reinterpret_cast<uintptr_t>(fresh) | dead;
+
+		size_t i = hash(k) & t->mask;
+		for (size_t n = 0; n <= t->mask; n++, i = (i + 1) & t->mask) {
+			auto& slot = t->slots[i];
+			uintptr_t p = slot.load();
+			for (;;) {
+				Node* cur = node(p);
+				if (!cur) {
+					if (slot.compare_exchange_strong(p, v)) {
+						t->used.fetch_add(1);
+						return;
+					}
+					continue;
+				}
+				if (cur == copy) {
+					slot.store(v);
+					return;
+				}
+				break;
+			}
+		}
+	}
+
+	mutable EpochDomain _epoch;
+	std::atomic<Table*> _table;
+	std::atomic<size_t> _size{ 0 };
+
+	std::hash<KeyType> _hash;
+	std::equal_to<KeyType> _eq;
+
+	std::mutex _resize;
+
+	bool _opened = true;
+	mutable std::mutex _mutex;
+	std::condition_variable _waiter;
+
+	LockFreeHashMap(LockFreeHashMap const&) = delete;
+	LockFreeHashMap& operator=(LockFreeHashMap const&) = delete;
+};
+
+template <typename _K, typename _V>
+constexpr uintptr_t LockFreeHashMap<_K, _V>::Moved;
+
+template <typename _K, typename _V>
+constexpr uintptr_t LockFreeHashMap<_K, _V>::Dead;
+
+template <typename _K, typename _V>
+constexpr size_t LockFreeHashMap<_K, _V>::Chunk;
+
+}
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef U_CONCURRENT_MMAP_HPP
+#define U_CONCURRENT_MMAP_HPP
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+
+#include "pool.hpp"
+
+namespace concurrent {
+
+#if __cplusplus >= 201703L
+	using StringView = std::string_view;
+#else
+	class StringView {
+	public:
+		StringView() : _data(nullptr), _size(0) {}
+		StringView(const char* d, size_t s) : _data(d), _size(s) {}
+
+		const char* data() const { return _data; }
+		size_t size() const { return _size; }
+		bool empty() const { return _size == 0; }
+
+		const char* begin() const { return _data; }
+		const char* end() const { return _data + _size; }
+
+		char operator[](size_t i) const { return _data[i]; }
+
+		bool operator==(const StringView& o) const { return _size == o._size && std::memcmp(_data, o._data, _size) == 0; }
+		bool operator!=(const StringView& o) const { return !(*this == o); }
+
+	private:
+		const char* _data;
+		size_t _size;
+	};
+#endif
+
+// Read-only mapping of a file split in records by a delimiter. Records are
+// handed out as views into the mapping, valid as long as the source lives.
+class MmapSource : public std::enable_shared_from_this<MmapSource> {
+public:
+	typedef std::shared_ptr<MmapSource> Ptr;
+
+	MmapSource(const std::string& path, char delimiter = '\n') : _delimiter(delimiter) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw std::system_error(errno, std::generic_category(), "MmapSource: open " + path);
+		}
+
+		struct stat st;
+		if (::fstat(fd, &st) < 0) {
+			int err = errno;
+			::close(fd);
+			throw std::system_error(err, std::generic_category(), "MmapSource: stat " + path);
+		}
+
+		_size = st.st_size;
+		if (_size) {
+			void* data = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data == MAP_FAILED) {
+				int err = errno;
+				::close(fd);
+				throw std::system_error(err, std::generic_category(), "MmapSource: mmap " + path);
+			}
+
+			::madvise(data, _size, MADV_SEQUENTIAL);
+			_data = static_cast<const char*>(data);
+		}
+		::close(fd);
+	}
+
+	~MmapSource() {
+		if (_data) {
+			::munmap(const_cast<char*>(_data), _size);
+		}
+	}
+
+	const char* Data() const { return _data; }
+	size_t Size() const { return _size; }
+
+	// Up to n byte ranges, each starting at the beginning of a record.
+	std::vector<std::pair<size_t, size_t>> Ranges(size_t n) const {
+		std::vector<std::pair<size_t, size_t>> ranges;
+
+		n = std::max<size_t>(n, 1);
+		size_t begin = 0;
+		for (size_t i = 1; i <= n && begin < _size; i++) {
+			size_t end = i == n ? _size : recordAt(_size * i / n);
+			if (end > begin) {
+				ranges.emplace_back(begin, end);
+				begin = end;
+			}
+		}
+		return ranges;
+	}
+
+	// Calls fn with every record starting in [begin, end).
+	template <typename F>
+	void Scan(size_t begin, size_t end, F&& fn) const {
+		while (begin < end) {
+			const char* p = _data + begin;
+			const char* d = static_cast<const char*>(std::memchr(p, _delimiter, _size - begin));
+			size_t len = d ? d - p : _size - begin;
+
+			fn(StringView(p, len));
+			begin += len + 1;
+		}
+	}
+
+	// Scans the records with s pool tasks and closes in when all are pushed.
+	void Feed(SyncQueue<StringView>::Ptr in, Pool<void>::Ptr pool, size_t s) {
+		auto ranges = Ranges(s);
+		if (ranges.empty()) {
+			in->Close();
+			return;
+		}
+
+		auto self = shared_from_this();
+		WaitGroup::Ptr wg(new WaitGroup(ranges.size()));
+
+		for (const auto& r : ranges) {
+			pool->Send([self, in, r, wg] {
+				try {
+					self->Scan(r.first, r.second, [&in](StringView v) {
+						in->Push(v);
+					});
+					wg->Finish();
+				}
+				catch (const std::exception&) {
+					wg->Finish();
+					throw;
+				}
+			});
+		}
+
+		pool->Send([in, wg] {
+			wg->Wait();
+			in->Close();
+		});
+	}
+
+private:
+	size_t recordAt(size_t p) const {
+		if (p == 0) {
+			return 0;
+		}
+		while (p < _size && _data[p - 1] != _delimiter) {
+			p++;
+		}
+		return p;
+	}
+
+	const char* _data = nullptr;
+	size_t _size = 0;
+	const char _delimiter;
+
+	MmapSource(MmapSource const&) = delete;
+	MmapSource& operator=(MmapSource const&) = delete;
+};
+
+}
+
+#endif
+#endif
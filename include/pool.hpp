@@ -212,7 +212,12 @@ namespace concurrent {
 				}
 
 				for (auto& t : _threads) {
-					if (t.joinable()) {
+					if (t.get_id() == std::this_thread::get_id()) {
+						// Last reference dropped by one of our own tasks: that
+						// worker cannot join itself and must not touch the pool again.
+						orphaned() = true;
+						t.detach();
+					} else if (t.joinable()) {
 						t.join();
 					}
 				}
@@ -260,9 +265,15 @@ namespace concurrent {
 							}
 							h->Exec();
 						} catch (const std::exception& e) {
+							if (orphaned()) {
+								return;
+							}
 							std::unique_lock<std::mutex> lock(_mutex);
 							_ee(e);
 						}
+						if (orphaned()) {
+							return;
+						}
 						_counter--;
 					}
 				};
@@ -270,6 +281,11 @@ namespace concurrent {
 			}
 		}
 
+		static bool& orphaned() {
+			static thread_local bool o = false;
+			return o;
+		}
+
 		SyncQueue<std::shared_ptr<_Task<R>>> _msgQ;
 		std::vector<std::thread> _threads;
 
@@ -5,6 +5,12 @@
 #include <queue>
 #include <atomic>
 #include <chrono>
+#include <memory>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <functional>
 #include <condition_variable>
 
 namespace concurrent {
@@ -28,6 +34,136 @@ namespace concurrent {
 
 	}
 
+	// Byte budget shared by every queue of a pipeline. Each element is charged
+	// on Push and the charge is returned on Pop. Source queues wait (or shed)
+	// when the budget is exhausted. Queues inside the pipeline wait too, ahead
+	// of the sources, but a push into an empty queue always passes: a stage
+	// can then never wait on a consumer that has nothing to drain. Usage only
+	// goes past the limit by those pushes, one element per pushing worker. An
+	// element larger than the whole budget is admitted when nothing is queued.
+	//
+	// A blocked source push only ends when a consumer frees room, so filling
+	// a source before any stage consumes it waits forever. Give the budget a
+	// wait limit in ms to make such pushes throw TimeoutQueueException, and
+	// closing the queue makes them throw ClosedQueueException.
+	class MemoryBudget {
+	public:
+		typedef std::shared_ptr<MemoryBudget> Ptr;
+
+		enum class Policy { Block, Shed };
+
+		// wait: longest a source push waits for room, in ms, 0 for no limit.
+		MemoryBudget(size_t bytes, Policy p = Policy::Block, uint64_t wait = 0) : _limit(bytes), _policy(p), _wait(wait) { }
+
+		bool Acquire(size_t bytes) { return acquire(bytes, false, 0, nullptr); }
+		bool Acquire(size_t bytes, uint64_t ms) { return acquire(bytes, true, ms, nullptr); }
+
+		// Gives up, returning false, once closed() holds.
+		bool Acquire(size_t bytes, const std::function<bool()>& closed) { return acquire(bytes, false, 0, closed); }
+		bool Acquire(size_t bytes, uint64_t ms, const std::function<bool()>& closed) { return acquire(bytes, true, ms, closed); }
+
+		void Charge(size_t bytes) {
+			std::unique_lock<std::mutex> lock(_mutex);
+			add(bytes);
+		}
+
+		// Waits for room, ahead of the sources, until drained() tells the
+		// queue charged is empty: its consumer is idle, so it must pass.
+		void Charge(size_t bytes, const std::function<bool()>& drained) {
+			std::unique_lock<std::mutex> lock(_mutex);
+			if (!fits(bytes) && !drained()) {
+				_draining++;
+				_released.wait(lock, [this, bytes, &drained] { return fits(bytes) || drained(); });
+				if (--_draining == 0) {
+					_released.notify_all();
+				}
+			}
+			add(bytes);
+		}
+
+		void Release(size_t bytes) {
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_used -= std::min(bytes, _used);
+			}
+			_released.notify_all();
+		}
+
+		// Wakes the waiting pushes so they check their queue again.
+		void Wake() {
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+			}
+			_released.notify_all();
+		}
+
+		inline size_t Limit() const { return _limit; }
+		inline Policy Mode() const { return _policy; }
+		inline uint64_t WaitLimit() const { return _wait; }
+		inline size_t Used() const { std::unique_lock<std::mutex> lock(_mutex); return _used; }
+		inline size_t Peak() const { std::unique_lock<std::mutex> lock(_mutex); return _peak; }
+		inline size_t Dropped() const { return _dropped.load(); }
+
+	private:
+		bool fits(size_t bytes) const { return _used == 0 || _used + bytes <= _limit; }
+
+		bool acquire(size_t bytes, bool timed, uint64_t ms, const std::function<bool()>& closed) {
+			std::unique_lock<std::mutex> lock(_mutex);
+			if (_policy == Policy::Shed) {
+				return shed(bytes);
+			}
+
+			if (_wait && (!timed || _wait < ms)) {
+				timed = true;
+				ms = _wait;
+			}
+
+			auto ready = [this, bytes, &closed] { return (closed && closed()) || (!_draining && fits(bytes)); };
+			if (timed) {
+				if (!_released.wait_for(lock, std::chrono::milliseconds(ms), ready)) {
+					return false;
+				}
+			} else {
+				_released.wait(lock, ready);
+			}
+
+			if (closed && closed()) {
+				return false;
+			}
+			add(bytes);
+			return true;
+		}
+
+		void add(size_t bytes) {
+			_used += bytes;
+			_peak = std::max(_peak, _used);
+		}
+
+		bool shed(size_t bytes) {
+			if (_draining || !fits(bytes)) {
+				_dropped++;
+				return false;
+			}
+			add(bytes);
+			return true;
+		}
+
+		const size_t _limit;
+		const Policy _policy;
+		const uint64_t _wait;
+
+		size_t _used = 0;
+		size_t _peak = 0;
+		size_t _draining = 0;
+		std::atomic<size_t> _dropped{0};
+
+		mutable std::mutex _mutex;
+		std::condition_variable _released;
+
+		MemoryBudget(MemoryBudget const&) = delete;
+		MemoryBudget& operator=(MemoryBudget const&) = delete;
+	};
+
 	template <typename T>
 	class SyncQueue {
 	public:
@@ -37,9 +173,23 @@ namespace concurrent {
 		typedef T ValueType;
 		typedef T Type;
 
-		SyncQueue(size_t t = 1 << 16) : _maxSize(t), _closed(false) { }
+		typedef std::function<size_t(const T&)> SizeFunc;
+
+		static constexpr size_t DefaultCapacity = 1 << 16;
+
+		SyncQueue(size_t t = DefaultCapacity) : _maxSize(t), _closed(false) { }
 		~SyncQueue() { }
 
+		// Charges every element pushed from now on against b, sized by f
+		// (sizeof(T) when empty). Elements already queued are not charged.
+		// Pushes into a source queue wait for, or are shed by, the budget.
+		// Limiting again with the same budget only replaces the size function.
+		void Limit(MemoryBudget::Ptr b, const SizeFunc& f = SizeFunc(), bool source = true);
+
+		MemoryBudget::Ptr Budget() const { std::unique_lock<std::mutex> lock(_mutex); return _budget; }
+		SizeFunc Sizer() const { std::unique_lock<std::mutex> lock(_mutex); return _sizer; }
+		inline size_t Capacity() const { return _maxSize; }
+
 		T Pop();
 		T Pop(uint64_t ms);
 		T PopNoThrow(uint64_t ms);
@@ -50,6 +200,10 @@ namespace concurrent {
 		void Push(T&&);
 		bool Push(T&&, uint64_t ms);
 
+		// Moves every element of batch in, taking the lock once per stretch
+		// of free capacity instead of once per element. Leaves batch empty.
+		void PushAll(std::vector<T>& batch);
+
 		void WakeAndClose();
 
 		inline bool IsEmpty() const { std::unique_lock<std::mutex> lock(_mutex); return _queue.size() == 0; }
@@ -57,12 +211,17 @@ namespace concurrent {
 		inline size_t Size() const { std::unique_lock<std::mutex> lock(_mutex); return _queue.size(); }
 
 		inline void Close() {
+			MemoryBudget::Ptr budget;
 			{
 				std::unique_lock<std::mutex> lock(_mutex);
 				_closed = true;
+				budget = _budget;
 			}
 			_empty.notify_all();
 			_full.notify_all();
+			if (budget) {
+				budget->Wake();
+			}
 		}
 
 		void WaitForEmpty() {
@@ -87,8 +246,22 @@ namespace concurrent {
 		}
 
 		void ForEach(const std::function<void(const Type&)>& fn) {
-			while (CanReceive()) {
-				fn(Pop());
+			try {
+				while (CanReceive()) {
+					fn(Pop());
+				}
+			} catch (const ex::ClosedQueueException&) {
+			}
+		}
+
+		// Hands every element over by rvalue until the queue is closed and empty.
+		template <typename F>
+		void Drain(F&& fn) {
+			try {
+				while (CanReceive()) {
+					fn(Pop());
+				}
+			} catch (const ex::ClosedQueueException&) {
 			}
 		}
 
@@ -96,9 +269,9 @@ namespace concurrent {
 		void Aggregate(const std::function<void(const KeyType&, Storage&&)>& fn) {
 			Storage storage;
 			while (CanReceive()) {
-				storage.push_back(std::move(Pop()));
+				storage.push_back(Pop());
 			}
-			fn(0, storage);
+			fn(0, std::move(storage));
 		}
 
 		void Clear() {
@@ -113,9 +286,22 @@ namespace concurrent {
 		const T& Last() const { return _queue.back(); }
 
 	private:
+		MemoryBudget::Ptr charge(const T&, size_t&) const;
+		bool admit(const MemoryBudget::Ptr&, size_t) const;
+		bool admit(const MemoryBudget::Ptr&, size_t, uint64_t) const;
+		void refuse(const MemoryBudget::Ptr&) const;
+		size_t uncharge();
+		T take(std::unique_lock<std::mutex>&);
+
 		std::queue<T> _queue;
 		const size_t _maxSize;
 
+		MemoryBudget::Ptr _budget;
+		SizeFunc _sizer;
+		bool _source = true;
+		std::queue<size_t> _charges;
+		size_t _uncharged = 0;
+
 		bool _closed;
 
 		mutable std::mutex _mutex;
@@ -126,60 +312,65 @@ namespace concurrent {
 		SyncQueue& operator=(SyncQueue const&) = delete;
 	};
 
+	template <typename T>
+	constexpr size_t SyncQueue<T>::DefaultCapacity;
+
 	template <typename T>
 	T SyncQueue<T>::Pop() {
-		T t;
+		std::unique_lock<std::mutex> lock(_mutex);
+		while (_queue.size() == 0) {
+			if (_closed) {
+				_full.notify_all();
+				throw ex::ClosedQueueException("Pop: closed queue");
+			}
 
-		{
-			std::unique_lock<std::mutex> lock(_mutex);
-			while (_queue.size() == 0) {
+			_empty.wait(lock);
+		}
+
+		return take(lock);
+	}
+
+	template <typename T>
+	T SyncQueue<T>::Pop(uint64_t ms) {
+		std::unique_lock<std::mutex> lock(_mutex);
+		if (_queue.size() == 0) {
+			if (_empty.wait_for(lock, std::chrono::milliseconds(ms)) == std::cv_status::timeout) {
 				if (_closed) {
-					_full.notify_all();
 					throw ex::ClosedQueueException("Pop: closed queue");
 				}
-
-				_empty.wait(lock);
+				throw ex::TimeoutQueueException("Pop: timeout");
 			}
 
-			t = _queue.front();
-			_queue.pop();
+			if (_queue.size() == 0) {
+				throw ex::EmptyQueueException("Pop: empty");
+			}
 		}
 
-		_full.notify_all();
-		return std::move(t);
+		return take(lock);
 	}
 
+	// Moves the front element out, so move-only types can be queued.
 	template <typename T>
-	T SyncQueue<T>::Pop(uint64_t ms) {
-		T t;
+	T SyncQueue<T>::take(std::unique_lock<std::mutex>& lock) {
+		T t(std::move(_queue.front()));
+		_queue.pop();
 
-		{
-			std::unique_lock<std::mutex> lock(_mutex);
-			if (_queue.size() == 0) {
-				if (_empty.wait_for(lock, std::chrono::milliseconds(ms)) == std::cv_status::timeout) {
-					if (_closed) {
-						throw ex::ClosedQueueException("Pop: closed queue");
-					}
-					throw ex::TimeoutQueueException("Pop: timeout");
-				}
-
-				if (_queue.size() == 0) {
-					throw ex::EmptyQueueException("Pop: empty");
-				}
-			}
+		size_t bytes = uncharge();
+		MemoryBudget::Ptr budget = _budget;
+		lock.unlock();
 
-			t = _queue.front();
-			_queue.pop();
+		// Also wakes pushes waiting for this queue to drain.
+		if (budget) {
+			budget->Release(bytes);
 		}
-
 		_full.notify_all();
-		return std::move(t);
+		return t;
 	}
 
 	template <typename T>
 	T SyncQueue<T>::PopNoThrow(uint64_t ms) {
 		try {
-			return std::move(Pop(ms));
+			return Pop(ms);
 		}
 		catch (...) {
 			return T();
@@ -187,18 +378,144 @@ namespace concurrent {
 	}
 
 
+	template <typename T>
+	void SyncQueue<T>::PushAll(std::vector<T>& batch) {
+		// Budgeted elements are charged, and maybe shed, one by one.
+		if (Budget()) {
+			for (auto& p : batch) {
+				Push(std::move(p));
+			}
+			batch.clear();
+			return;
+		}
+
+		size_t i = 0;
+		while (i < batch.size()) {
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				while (_queue.size() == _maxSize) {
+					_full.wait(lock);
+				}
+
+				while (i < batch.size() && _queue.size() < _maxSize) {
+					_queue.push(std::move(batch[i++]));
+					if (_budget) {
+						_charges.push(0);
+					}
+				}
+			}
+			_empty.notify_all();
+		}
+		batch.clear();
+	}
+
 	template <typename T>
 	void SyncQueue<T>::WakeAndClose() {
+		MemoryBudget::Ptr budget;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			if (_closed) { return; }
+
+			_empty.notify_all();
+			_queue.push(T());
+			if (_budget) {
+				_charges.push(0);
+			}
+			_closed = true;
+			budget = _budget;
+		}
+		if (budget) {
+			budget->Wake();
+		}
+	}
+
+	template <typename T>
+	void SyncQueue<T>::Limit(MemoryBudget::Ptr b, const SizeFunc& f, bool source) {
 		std::unique_lock<std::mutex> lock(_mutex);
-		if (_closed) { return; }
+		if (_budget && _budget != b) {
+			throw std::logic_error("Limit: queue already charged to another budget");
+		}
 
-		_empty.notify_all();
-		_queue.push(T());
-		_closed = true;
+		if (!_budget) {
+			_uncharged = _queue.size();
+			_source = source;
+		}
+		_budget = b;
+		_sizer = f;
+	}
+
+	template <typename T>
+	MemoryBudget::Ptr SyncQueue<T>::charge(const T& p, size_t& bytes) const {
+		std::unique_lock<std::mutex> lock(_mutex);
+		if (_budget) {
+			bytes = _sizer ? _sizer(p) : sizeof(T);
+		}
+		return _budget;
+	}
+
+	template <typename T>
+	bool SyncQueue<T>::admit(const MemoryBudget::Ptr& budget, size_t bytes) const {
+		if (_source) {
+			return budget->Acquire(bytes, [this] { return IsClosed(); });
+		}
+
+		budget->Charge(bytes, [this] {
+			std::unique_lock<std::mutex> lock(_mutex);
+			return _closed || _queue.empty();
+		});
+		return true;
+	}
+
+	template <typename T>
+	bool SyncQueue<T>::admit(const MemoryBudget::Ptr& budget, size_t bytes, uint64_t ms) const {
+		if (_source) {
+			return budget->Acquire(bytes, ms, [this] { return IsClosed(); });
+		}
+
+		budget->Charge(bytes, [this] {
+			std::unique_lock<std::mutex> lock(_mutex);
+			return _closed || _queue.empty();
+		});
+		return true;
+	}
+
+	// A blocking push the budget turned down: shed elements just go, the
+	// others fail on a closed queue or past the wait limit.
+	template <typename T>
+	void SyncQueue<T>::refuse(const MemoryBudget::Ptr& budget) const {
+		if (budget->Mode() == MemoryBudget::Policy::Shed) {
+			return;
+		}
+		if (IsClosed()) {
+			throw ex::ClosedQueueException("Push: closed queue");
+		}
+		throw ex::TimeoutQueueException("Push: memory budget exhausted");
+	}
+
+	template <typename T>
+	size_t SyncQueue<T>::uncharge() {
+		if (_uncharged) {
+			_uncharged--;
+			return 0;
+		}
+		if (_charges.empty()) {
+			return 0;
+		}
+
+		size_t bytes = _charges.front();
+		_charges.pop();
+		return bytes;
 	}
 
 	template <typename T>
 	void SyncQueue<T>::Push(const T& p) {
+		size_t bytes = 0;
+		auto budget = charge(p, bytes);
+		if (budget && !admit(budget, bytes)) {
+			refuse(budget);
+			return;
+		}
+
 		{
 			std::unique_lock<std::mutex> lock(_mutex);
 			while (_queue.size() == _maxSize) {
@@ -206,21 +523,37 @@ namespace concurrent {
 			}
 
 			_queue.push(std::move(p));
+			if (_budget) {
+				_charges.push(budget ? bytes : 0);
+			}
 		}
 		_empty.notify_all();
 	}
 
 	template <typename T>
 	bool SyncQueue<T>::Push(const T& p, uint64_t ms) {
+		size_t bytes = 0;
+		auto budget = charge(p, bytes);
+		if (budget && !admit(budget, bytes, ms)) {
+			return false;
+		}
+
 		{
 			std::unique_lock<std::mutex> lock(_mutex);
 			if (_queue.size() == _maxSize) {
 				if (_full.wait_for(lock, std::chrono::milliseconds(ms)) == std::cv_status::timeout) {
+					lock.unlock();
+					if (budget) {
+						budget->Release(bytes);
+					}
 					return false;
 				}
 			}
 
 			_queue.push(std::move(p));
+			if (_budget) {
+				_charges.push(budget ? bytes : 0);
+			}
 		}
 		_empty.notify_all();
 		return true;
@@ -228,6 +561,13 @@ namespace concurrent {
 
 	template <typename T>
 	void SyncQueue<T>::Push(T&& p) {
+		size_t bytes = 0;
+		auto budget = charge(p, bytes);
+		if (budget && !admit(budget, bytes)) {
+			refuse(budget);
+			return;
+		}
+
 		{
 			std::unique_lock<std::mutex> lock(_mutex);
 			while (_queue.size() == _maxSize) {
@@ -235,25 +575,37 @@ namespace concurrent {
 			}
 
 			_queue.push(std::move(p));
+			if (_budget) {
+				_charges.push(budget ? bytes : 0);
+			}
 		}
 		_empty.notify_all();
 	}
 
 	template <typename T>
 	bool SyncQueue<T>::Push(T&& p, uint64_t ms) {
+		size_t bytes = 0;
+		auto budget = charge(p, bytes);
+		if (budget && !admit(budget, bytes, ms)) {
+			return false;
+		}
+
 		{
 			std::unique_lock<std::mutex> lock(_mutex);
 			if (_queue.size() == _maxSize) {
-				if (_full.wait_for(lock, std::chrono::milliseconds(ms)) == std::cv_status::timeout) {
-					return false;
-				}
-
-				if (_queue.size() == _maxSize) {
+				if (_full.wait_for(lock, std::chrono::milliseconds(ms)) == std::cv_status::timeout || _queue.size() == _maxSize) {
+					lock.unlock();
+					if (budget) {
+						budget->Release(bytes);
+					}
 					return false;
 				}
 			}
 
 			_queue.push(std::move(p));
+			if (_budget) {
+				_charges.push(budget ? bytes : 0);
+			}
 		}
 		_empty.notify_all();
 		return true;
@@ -0,0 +1,152 @@
+#ifndef U_CONCURRENT_RWLOCK_HPP
+#define U_CONCURRENT_RWLOCK_HPP
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+namespace concurrent {
+
+// Reader biased shared mutex. Every reader only touches the counter of its
+// own stripe, picked by thread, so readers on different cores do not share
+// a cache line. A writer raises a flag, which sends new readers back to
+// wait, then waits for every stripe to drain. Waiting writers and readers
+// yield a few times, then sleep on a condition variable; the side that lets
+// them go only takes its mutex when someone sleeps. Not recursive for
+// writers.
+class ReaderBiasedMutex {
+public:
+	ReaderBiasedMutex() {}
+
+	void lock() {
+		_writers.lock();
+		_writer.store(true);
+		for (int i = 0; !drained(); i++) {
+			if (i < Spins) {
+				std::this_thread::yield();
+			} else {
+				park([this] { return drained(); });
+			}
+		}
+	}
+
+	bool try_lock() {
+		if (!_writers.try_lock()) {
+			return false;
+		}
+		_writer.store(true);
+		if (!drained()) {
+			unlock();
+			return false;
+		}
+		return true;
+	}
+
+	void unlock() {
+		_writer.store(false);
+		_writers.unlock();
+		wake();
+	}
+
+	void lock_shared() {
+		auto& c = _readers[stripe()].count;
+		for (;;) {
+			c.fetch_add(1);
+			if (!_writer.load()) {
+				return;
+			}
+			leave(c);
+			for (int i = 0; _writer.load(); i++) {
+				if (i < Spins) {
+					std::this_thread::yield();
+				} else {
+					park([this] { return !_writer.load(); });
+				}
+			}
+		}
+	}
+
+	bool try_lock_shared() {
+		auto& c = _readers[stripe()].count;
+		c.fetch_add(1);
+		if (!_writer.load()) {
+			return true;
+		}
+		leave(c);
+		return false;
+	}
+
+	void unlock_shared() {
+		leave(_readers[stripe()].count);
+	}
+
+private:
+	static constexpr size_t Stripes = 16;
+	static constexpr int Spins = 64;
+
+	// Padded to a cache line rather than aligned: over-aligned types need
+	// C++17 to get their alignment from new.
+	struct Stripe {
+		std::atomic<size_t> count{ 0 };
+		char pad[64 - sizeof(std::atomic<size_t>)];
+	};
+
+	bool drained() const {
+		for (const auto& s : _readers) {
+			if (s.count.load()) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// The last reader out of a stripe may be the one a writer waits for.
+	void leave(std::atomic<size_t>& c) {
+		if (c.fetch_sub(1) == 1 && _writer.load()) {
+			wake();
+		}
+	}
+
+	// Sleepers count themselves before checking ready, and wakers change
+	// the state before checking the count, so one of them sees the other.
+	template <typename F>
+	void park(F ready) {
+		std::unique_lock<std::mutex> lock(_park);
+		_sleepers.fetch_add(1);
+		while (!ready()) {
+			_parked.wait(lock);
+		}
+		_sleepers.fetch_sub(1);
+	}
+
+	void wake() {
+		if (_sleepers.load()) {
+			{
+				std::unique_lock<std::mutex> lock(_park);
+			}
+			_parked.notify_all();
+		}
+	}
+
+	static size_t stripe() {
+		static thread_local size_t s = std::hash<std::thread::id>()(std::this_thread::get_id()) % Stripes;
+		return s;
+	}
+
+	Stripe _readers[Stripes];
+	std::atomic<bool> _writer{ false };
+	std::mutex _writers;
+
+	std::atomic<size_t> _sleepers{ 0 };
+	std::mutex _park;
+	std::condition_variable _parked;
+
+	ReaderBiasedMutex(ReaderBiasedMutex const&) = delete;
+	ReaderBiasedMutex& operator=(ReaderBiasedMutex const&) = delete;
+};
+
+}
+
+#endif
@@ -0,0 +1,408 @@
+#ifndef U_CONCURRENT_SHM_HPP
+#define U_CONCURRENT_SHM_HPP
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <new>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <climits>
+#include <cerrno>
+#include <cstdint>
+#include <type_traits>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <ctime>
+#endif
+
+#include "queue.hpp"
+
+namespace concurrent {
+
+namespace {
+
+	// Sleeps while *word == expected, at most ms milliseconds. Spurious
+	// returns are fine, callers check their condition again.
+	inline void _futexWait(std::atomic<uint32_t>* word, uint32_t expected, uint64_t ms) {
+#ifdef __linux__
+		struct timespec ts;
+		ts.tv_sec = ms / 1000;
+		ts.tv_nsec = (ms % 1000) * 1000000;
+		::syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+#else
+		if (word->load() == expected) {
+			std::this_thread::sleep_for(std::chrono::microseconds(std::min<uint64_t>(ms * 1000, 100)));
+		}
+#endif
+	}
+
+	inline void _futexWake(std::atomic<uint32_t>* word) {
+#ifdef __linux__
+		::syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+	}
+
+}
+
+// Bounded queue of trivially copyable elements in a POSIX shared memory
+// segment, so processes on one host can hand elements to each other. The
+// ring is lock-free for any number of producers and consumers; blocked
+// callers sleep on futexes, woken only when someone waits. Same Push, Pop
+// and Close semantics as SyncQueue. The creating side removes the name when
+// destroyed, mappings already open stay valid.
+template <typename T>
+class ShmQueue {
+public:
+	static_assert(std::is_trivially_copyable<T>::value, "ShmQueue: trivially copyable types only");
+	static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "ShmQueue: needs address-free atomics");
+
+	typedef std::shared_ptr<ShmQueue> Ptr;
+
+	typedef size_t KeyType;
+	typedef T ValueType;
+	typedef T Type;
+
+	typedef std::function<size_t(const T&)> SizeFunc;
+
+	// Creates the segment name holding at least capacity elements. Throws
+	// std::system_error with EEXIST when name is taken, see Unlink.
+	ShmQueue(const std::string& name, size_t capacity) : _name(name), _owner(true) {
+		size_t n = 1;
+		while (n < capacity) {
+			n <<= 1;
+		}
+
+		int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd < 0) {
+			throw std::system_error(errno, std::generic_category(), "ShmQueue: shm_open " + name);
+		}
+
+		_size = bytes(n);
+		if (::ftruncate(fd, _size) < 0) {
+			int err = errno;
+			::close(fd);
+			::shm_unlink(name.c_str());
+			throw std::system_error(err, std::generic_category(), "ShmQueue: ftruncate " + name);
+		}
+		map(fd);
+
+		_header->mask = n - 1;
+		for (size_t i = 0; i < n; i++) {
+			new (&_slots[i]) Slot();
+			_slots[i].seq.store(i, std::memory_order_relaxed);
+		}
+		_header->ready.store(Magic, std::memory_order_release);
+	}
+
+	// Opens a segment created by another ShmQueue, waiting up to ms for it.
+	static Ptr Open(const std::string& name, uint64_t ms = 1000) {
+		Ptr q(new ShmQueue(name));
+		q->attach(ms);
+		return q;
+	}
+
+	// Removes the segment name, left behind by a creator that died, so it
+	// can be created again. False when there was none. Mappings already
+	// open stay valid, new Opens no longer find it.
+	static bool Unlink(const std::string& name) {
+		if (::shm_unlink(name.c_str()) == 0) {
+			return true;
+		}
+		if (errno == ENOENT) {
+			return false;
+		}
+		throw std::system_error(errno, std::generic_category(), "ShmQueue: shm_unlink " + name);
+	}
+
+	~ShmQueue() {
+		if (_header) {
+			::munmap(_header, _size);
+		}
+		if (_owner) {
+			::shm_unlink(_name.c_str());
+		}
+	}
+
+	const std::string& Name() const { return _name; }
+
+	inline size_t Capacity() const { return _header->mask + 1; }
+	SizeFunc Sizer() const { return SizeFunc(); }
+
+	void Push(const T& v) {
+		while (!tryPush(v)) {
+			wait(_header->pops, _header->pushWaiters, [this] { return !IsFull(); }, 100);
+		}
+		wake(_header->pushes, _header->popWaiters);
+	}
+
+	bool Push(const T& v, uint64_t ms) {
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+		while (!tryPush(v)) {
+			auto now = std::chrono::steady_clock::now();
+			if (now >= deadline) {
+				return false;
+			}
+			wait(_header->pops, _header->pushWaiters, [this] { return !IsFull(); }, left(now, deadline));
+		}
+		wake(_header->pushes, _header->popWaiters);
+		return true;
+	}
+
+	T Pop() {
+		T v;
+		while (!tryPop(v)) {
+			if (IsClosed() && IsEmpty()) {
+				throw ex::ClosedQueueException("Pop: closed queue");
+			}
+			wait(_header->pushes, _header->popWaiters, [this] { return !IsEmpty() || IsClosed(); }, 100);
+		}
+		wake(_header->pops, _header->pushWaiters);
+		return v;
+	}
+
+	T Pop(uint64_t ms) {
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+
+		T v;
+		while (!tryPop(v)) {
+			if (IsClosed() && IsEmpty()) {
+				throw ex::ClosedQueueException("Pop: closed queue");
+			}
+
+			auto now = std::chrono::steady_clock::now();
+			if (now >= deadline) {
+				throw ex::TimeoutQueueException("Pop: timeout");
+			}
+			wait(_header->pushes, _header->popWaiters, [this] { return !IsEmpty() || IsClosed(); }, left(now, deadline));
+		}
+		wake(_header->pops, _header->pushWaiters);
+		return v;
+	}
+
+	inline void Close() {
+		_header->closed.store(1);
+		_futexWake(&_header->closed);
+		bump(_header->pushes);
+		bump(_header->pops);
+	}
+
+	inline bool IsClosed() const { return _header->closed.load() != 0; }
+	inline bool IsOpen() const { return !IsClosed(); }
+
+	inline size_t Size() const {
+		uint64_t head = _header->head.load(), tail = _header->tail.load();
+		return tail > head ? tail - head : 0;
+	}
+
+	inline bool IsEmpty() const { return Size() == 0; }
+	inline bool IsFull() const { return Size() >= Capacity(); }
+	inline bool CanReceive() const { return !IsClosed() || !IsEmpty(); }
+
+	void Wait() {
+		while (!IsClosed()) {
+			_futexWait(&_header->closed, 0, 100);
+		}
+	}
+
+	void WaitForEmpty() {
+		while (CanReceive()) {
+			uint32_t seen = _header->pops.load();
+			if (!CanReceive()) {
+				break;
+			}
+			_futexWait(&_header->pops, seen, 100);
+		}
+	}
+
+	void ForEach(const std::function<void(const Type&)>& fn) {
+		Drain(fn);
+	}
+
+	// Hands every element over until the queue is closed and empty.
+	template <typename F>
+	void Drain(F&& fn) {
+		try {
+			while (CanReceive()) {
+				fn(Pop());
+			}
+		} catch (const ex::ClosedQueueException&) {
+		}
+	}
+
+	void Clear() {}
+
+private:
+	static constexpr uint64_t Magic = 0x75436F6E63536851ull;
+
+	// Vyukov's bounded queue: a slot is free for the push at position p when
+	// its sequence is p, and holds the element of that push at p + 1.
+	struct Slot {
+		std::atomic<uint64_t> seq;
+		T value;
+	};
+
+	struct Header {
+		std::atomic<uint64_t> ready;
+		uint64_t mask;
+
+		alignas(64) std::atomic<uint64_t> tail;
+		alignas(64) std::atomic<uint64_t> head;
+
+		// Futex words, bumped by every push and pop, and the number of
+		// callers sleeping on them.
+		alignas(64) std::atomic<uint32_t> pushes;
+		std::atomic<uint32_t> popWaiters;
+		alignas(64) std::atomic<uint32_t> pops;
+		std::atomic<uint32_t> pushWaiters;
+
+		std::atomic<uint32_t> closed;
+	};
+
+	explicit ShmQueue(const std::string& name) : _name(name), _owner(false) {}
+
+	static size_t bytes(size_t n) {
+		return sizeof(Header) + n * sizeof(Slot);
+	}
+
+	void attach(uint64_t ms) {
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+
+		int fd;
+		struct stat st;
+		for (;;) {
+			fd = ::shm_open(_name.c_str(), O_RDWR, 0600);
+			if (fd >= 0 && ::fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(Header)) {
+				break;
+			}
+			int err = errno;
+			if (fd >= 0) {
+				::close(fd);
+			}
+			if (std::chrono::steady_clock::now() > deadline) {
+				throw std::system_error(err, std::generic_category(), "ShmQueue: shm_open " + _name);
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		_size = st.st_size;
+		map(fd);
+
+		while (_header->ready.load(std::memory_order_acquire) != Magic) {
+			if (std::chrono::steady_clock::now() > deadline) {
+				throw std::runtime_error("ShmQueue: " + _name + " never initialized");
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+	void map(int fd) {
+		void* p = ::mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		int err = errno;
+		::close(fd);
+		if (p == MAP_FAILED) {
+			if (_owner) {
+				::shm_unlink(_name.c_str());
+			}
+			throw std::system_error(err, std::generic_category(), "ShmQueue: mmap " + _name);
+		}
+
+		_header = static_cast<Header*>(p);
+		_slots = reinterpret_cast<Slot*>(static_cast<char*>(p) + sizeof(Header));
+	}
+
+	bool tryPush(const T& v) {
+		uint64_t pos = _header->tail.load(std::memory_order_relaxed);
+		for (;;) {
+			Slot& s = _slots[pos & _header->mask];
+			int64_t dif = int64_t(s.seq.load(std::memory_order_acquire)) - int64_t(pos);
+			if (dif == 0) {
+				if (_header->tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					s.value = v;
+					s.seq.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (dif < 0) {
+				return false;
+			} else {
+				pos = _header->tail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool tryPop(T& v) {
+		uint64_t pos = _header->head.load(std::memory_order_relaxed);
+		for (;;) {
+			Slot& s = _slots[pos & _header->mask];
+			int64_t dif = int64_t(s.seq.load(std::memory_order_acquire)) - int64_t(pos + 1);
+			if (dif == 0) {
+				if (_header->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					v = s.value;
+					s.seq.store(pos + _header->mask + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (dif < 0) {
+				return false;
+			} else {
+				pos = _header->head.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Registers as a waiter before the last check, so a wake cannot fall
+	// between the check and the sleep.
+	template <typename F>
+	void wait(std::atomic<uint32_t>& word, std::atomic<uint32_t>& waiters, F ready, uint64_t ms) {
+		waiters.fetch_add(1);
+		uint32_t seen = word.load();
+		if (!ready()) {
+			_futexWait(&word, seen, std::max<uint64_t>(ms, 1));
+		}
+		waiters.fetch_sub(1);
+	}
+
+	void wake(std::atomic<uint32_t>& word, std::atomic<uint32_t>& waiters) {
+		word.fetch_add(1);
+		if (waiters.load()) {
+			_futexWake(&word);
+		}
+	}
+
+	void bump(std::atomic<uint32_t>& word) {
+		word.fetch_add(1);
+		_futexWake(&word);
+	}
+
+	static uint64_t left(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point deadline) {
+		return std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1;
+	}
+
+	std::string _name;
+	bool _owner;
+	size_t _size = 0;
+
+	Header* _header = nullptr;
+	Slot* _slots = nullptr;
+
+	ShmQueue(ShmQueue const&) = delete;
+	ShmQueue& operator=(ShmQueue const&) = delete;
+};
+
+template <typename T>
+constexpr uint64_t ShmQueue<T>::Magic;
+
+}
+
+#endif
+#endif
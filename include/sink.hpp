@@ -0,0 +1,120 @@
+#ifndef U_CONCURRENT_SINK_HPP
+#define U_CONCURRENT_SINK_HPP
+
+#include <cstdio>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <system_error>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <climits>
+#include <sys/uio.h>
+#define U_CONCURRENT_WRITEV
+#endif
+
+namespace concurrent {
+
+// Truncated file written in batches of buffers. Each batch is gathered in
+// writev calls where available, stdio is used otherwise.
+class FileSink {
+public:
+	typedef std::shared_ptr<FileSink> Ptr;
+	typedef std::shared_ptr<std::string> Buffer;
+
+	FileSink(const std::string& path) {
+#ifdef U_CONCURRENT_WRITEV
+		_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (_fd < 0) {
+			throw std::system_error(errno, std::generic_category(), "FileSink: open " + path);
+		}
+#else
+		_file = std::fopen(path.c_str(), "wb");
+		if (_file == nullptr) {
+			throw std::system_error(errno, std::generic_category(), "FileSink: open " + path);
+		}
+#endif
+	}
+
+	~FileSink() { Close(); }
+
+	size_t Written() const { return _written; }
+
+	size_t Write(const std::vector<Buffer>& buffers) {
+		size_t bytes = 0;
+#ifdef U_CONCURRENT_WRITEV
+		std::vector<struct iovec> iov;
+		for (const auto& b : buffers) {
+			if (b->size()) {
+				iov.push_back({ const_cast<char*>(b->data()), b->size() });
+			}
+		}
+
+		size_t first = 0;
+		while (first < iov.size()) {
+			int count = static_cast<int>(std::min<size_t>(iov.size() - first, IOV_MAX));
+			ssize_t n = ::writev(_fd, &iov[first], count);
+			if (n < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				throw std::system_error(errno, std::generic_category(), "FileSink: writev");
+			}
+
+			bytes += n;
+			// Skip what went out, a short write resumes inside a buffer.
+			size_t done = n;
+			while (first < iov.size() && done >= iov[first].iov_len) {
+				done -= iov[first].iov_len;
+				first++;
+			}
+			if (done) {
+				iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + done;
+				iov[first].iov_len -= done;
+			}
+		}
+#else
+		for (const auto& b : buffers) {
+			if (std::fwrite(b->data(), 1, b->size(), _file) != b->size()) {
+				throw std::system_error(errno, std::generic_category(), "FileSink: fwrite");
+			}
+			bytes += b->size();
+		}
+#endif
+		_written += bytes;
+		return bytes;
+	}
+
+	void Close() {
+#ifdef U_CONCURRENT_WRITEV
+		if (_fd >= 0) {
+			::close(_fd);
+			_fd = -1;
+		}
+#else
+		if (_file) {
+			std::fclose(_file);
+			_file = nullptr;
+		}
+#endif
+	}
+
+private:
+#ifdef U_CONCURRENT_WRITEV
+	int _fd = -1;
+#else
+	std::FILE* _file = nullptr;
+#endif
+	size_t _written = 0;
+
+	FileSink(FileSink const&) = delete;
+	FileSink& operator=(FileSink const&) = delete;
+};
+
+}
+
+#endif
@@ -0,0 +1,270 @@
+#ifndef U_CONCURRENT_SKETCH_HPP
+#define U_CONCURRENT_SKETCH_HPP
+
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+
+namespace concurrent {
+
+namespace {
+
+	// std::hash is the identity for integers, spread it over all 64 bits.
+	inline uint64_t _mix(uint64_t h) {
+		h ^= h >> 33;
+		h *= 0xFF51AFD7ED558CCDull;
+		h ^= h >> 33;
+		h *= 0xC4CEB9FE1A85EC53ull;
+		h ^= h >> 33;
+		return h;
+	}
+
+	inline unsigned _leading(uint64_t v) {
+#if defined(__GNUC__)
+		return v ? __builtin_clzll(v) : 64;
+#else
+		unsigned n = 0;
+		for (uint64_t b = 1ull << 63; b && !(v & b); b >>= 1) {
+			n++;
+		}
+		return n;
+#endif
+	}
+
+}
+
+// Distinct count estimate in 2^precision bytes, with a standard error of
+// about 1.04 / sqrt(2^precision).
+class HyperLogLog {
+public:
+	HyperLogLog(unsigned precision = 14) : _precision(precision), _registers(size_t(1) << precision, 0) {
+		if (precision < 4 || precision > 18) {
+			throw std::invalid_argument("HyperLogLog: precision out of [4, 18]");
+		}
+	}
+
+	template <typename T>
+	void Add(const T& v) {
+		AddHash(std::hash<T>()(v));
+	}
+
+	void AddHash(uint64_t hash) {
+		uint64_t h = _mix(hash);
+		size_t i = h >> (64 - _precision);
+		uint8_t rank = _leading((h << _precision) | (1ull << (_precision - 1))) + 1;
+		_registers[i] = std::max(_registers[i], rank);
+	}
+
+	void Merge(const HyperLogLog& o) {
+		if (o._precision != _precision) {
+			throw std::invalid_argument("HyperLogLog: merging different precisions");
+		}
+		for (size_t i = 0; i < _registers.size(); i++) {
+			_registers[i] = std::max(_registers[i], o._registers[i]);
+		}
+	}
+
+	double Estimate() const {
+		const double m = double(_registers.size());
+
+		double sum = 0;
+		size_t zeros = 0;
+		for (auto r : _registers) {
+			sum += std::ldexp(1.0, -int(r));
+			zeros += r == 0;
+		}
+
+		double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+		// Linear counting is more accurate while registers are still empty.
+		if (e <= 2.5 * m && zeros) {
+			e = m * std::log(m / zeros);
+		}
+		return e;
+	}
+
+private:
+	unsigned _precision;
+	std::vector<uint8_t> _registers;
+};
+
+// Frequency estimate of every key in width * depth counters. Estimates never
+// undercount, and overcount by at most 2N / width with probability
+// 1 - 2^-depth on a stream of N additions.
+class CountMinSketch {
+public:
+	CountMinSketch(size_t width = 1 << 11, size_t depth = 4) : _width(std::max<size_t>(width, 1)), _depth(std::max<size_t>(depth, 1)), _counters(_width * _depth, 0) {}
+
+	template <typename T>
+	void Add(const T& v, uint64_t count = 1) {
+		AddHash(std::hash<T>()(v), count);
+	}
+
+	void AddHash(uint64_t hash, uint64_t count = 1) {
+		uint64_t h = _mix(hash);
+		for (size_t d = 0; d < _depth; d++) {
+			_counters[d * _width + index(h, d)] += count;
+		}
+		_total += count;
+	}
+
+	template <typename T>
+	uint64_t Estimate(const T& v) const {
+		return EstimateHash(std::hash<T>()(v));
+	}
+
+	uint64_t EstimateHash(uint64_t hash) const {
+		uint64_t h = _mix(hash);
+		uint64_t e = std::numeric_limits<uint64_t>::max();
+		for (size_t d = 0; d < _depth; d++) {
+			e = std::min(e, _counters[d * _width + index(h, d)]);
+		}
+		return e;
+	}
+
+	uint64_t Total() const { return _total; }
+
+	void Merge(const CountMinSketch& o) {
+		if (o._width != _width || o._depth != _depth) {
+			throw std::invalid_argument("CountMinSketch: merging different dimensions");
+		}
+		for (size_t i = 0; i < _counters.size(); i++) {
+			_counters[i] += o._counters[i];
+		}
+		_total += o._total;
+	}
+
+private:
+	// Row d hashes with h1 + d * h2, both halves of the mixed hash.
+	size_t index(uint64_t h, size_t d) const {
+		uint64_t h1 = h & 0xFFFFFFFF, h2 = (h >> 32) | 1;
+		return (h1 + d * h2) % _width;
+	}
+
+	size_t _width;
+	size_t _depth;
+	std::vector<uint64_t> _counters;
+	uint64_t _total = 0;
+};
+
+// KLL quantile sketch. Level h holds items of weight 2^h; a full level is
+// sorted and every other item is promoted, so memory stays around 3k items
+// and ranks are off by about 1.7 / k of the stream length.
+class QuantileSketch {
+public:
+	QuantileSketch(size_t k = 200) : _k(std::max<size_t>(k, 8)), _levels(1) {
+		shape();
+	}
+
+	void Add(double v) {
+		_levels[0].push_back(v);
+		_count++;
+		compress();
+	}
+
+	void Merge(const QuantileSketch& o) {
+		if (o._levels.size() > _levels.size()) {
+			_levels.resize(o._levels.size());
+			shape();
+		}
+		for (size_t h = 0; h < o._levels.size(); h++) {
+			_levels[h].insert(_levels[h].end(), o._levels[h].begin(), o._levels[h].end());
+		}
+		_count += o._count;
+		compress();
+	}
+
+	uint64_t Count() const { return _count; }
+
+	// Value with about q * Count() values below it, NaN when empty.
+	double Quantile(double q) const {
+		std::vector<std::pair<double, uint64_t>> items;
+		uint64_t total = 0;
+		for (size_t h = 0; h < _levels.size(); h++) {
+			for (auto v : _levels[h]) {
+				items.emplace_back(v, uint64_t(1) << h);
+				total += uint64_t(1) << h;
+			}
+		}
+		if (items.empty()) {
+			return std::numeric_limits<double>::quiet_NaN();
+		}
+
+		std::sort(items.begin(), items.end());
+
+		double target = std::min(std::max(q, 0.0), 1.0) * total;
+		uint64_t seen = 0;
+		for (const auto& i : items) {
+			seen += i.second;
+			if (seen >= target) {
+				return i.first;
+			}
+		}
+		return items.back().first;
+	}
+
+private:
+	// Capacities shrink by 2/3 per level below the top one, so they only
+	// change when a level is added: kept in _capacity and _room until then.
+	void shape() {
+		_capacity.resize(_levels.size());
+		_room = 0;
+		for (size_t h = 0; h < _levels.size(); h++) {
+			size_t depth = _levels.size() - 1 - h;
+			_capacity[h] = std::max<size_t>(2, size_t(std::ceil(_k * std::pow(2.0 / 3.0, double(depth)))));
+			_room += _capacity[h];
+		}
+	}
+
+	void compress() {
+		for (;;) {
+			size_t size = 0;
+			for (const auto& level : _levels) {
+				size += level.size();
+			}
+			if (size <= _room) {
+				return;
+			}
+
+			for (size_t h = 0; h < _levels.size(); h++) {
+				if (_levels[h].size() >= _capacity[h]) {
+					compact(h);
+					break;
+				}
+			}
+		}
+	}
+
+	void compact(size_t h) {
+		if (h + 1 == _levels.size()) {
+			_levels.emplace_back();
+			shape();
+		}
+
+		auto& level = _levels[h];
+		std::sort(level.begin(), level.end());
+
+		// An odd item out stays, the others pair up and one of each moves up.
+		size_t even = level.size() & ~size_t(1);
+		_coin ^= 1;
+		for (size_t i = _coin; i < even; i += 2) {
+			_levels[h + 1].push_back(level[i]);
+		}
+		level.erase(level.begin(), level.begin() + even);
+	}
+
+	size_t _k;
+	std::vector<std::vector<double>> _levels;
+	std::vector<size_t> _capacity;
+	size_t _room = 0;
+	uint64_t _count = 0;
+	size_t _coin = 0;
+};
+
+}
+
+#endif
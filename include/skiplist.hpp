@@ -0,0 +1,377 @@
+#ifndef U_CONCURRENT_SKIPLIST_HPP
+#define U_CONCURRENT_SKIPLIST_HPP
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <cstdint>
+#include <functional>
+#include <unordered_set>
+#include <condition_variable>
+
+#include "epoch.hpp"
+
+namespace concurrent {
+
+// Ordered map as a lock-free skip list (Herlihy and Shavit). A node is
+// removed by marking its next pointers, top level down, then unlinked by
+// whichever traversal meets it. Lookups and scans never write: they step
+// over marked nodes, so scans run alongside writers and see a weakly
+// consistent view. Values are immutable once inserted. Each node counts
+// the levels linking it, plus a hold by its inserter, and is retired to
+// an EpochDomain when the count drops to zero.
+template <typename _K, typename _V, typename _Compare = std::less<_K>>
+class SkipListMap {
+public:
+	typedef std::shared_ptr<SkipListMap> Ptr;
+
+	typedef _K KeyType;
+	typedef _V ValueType;
+
+	typedef std::pair<const _K, _V> PairType;
+	typedef std::pair<_K, _V> Type;
+
+	SkipListMap() : _head(MaxLevel) {}
+
+	~SkipListMap() {
+		Close();
+
+		// Nodes still linked somewhere; retired ones belong to _epoch.
+		std::unordered_set<Node*> nodes;
+		for (int l = 0; l < MaxLevel; l++) {
+			for (Node* n = ptr(_head.next[l].load()); n; n = ptr(n->next[l].load())) {
+				nodes.insert(n);
+			}
+		}
+		for (Node* n : nodes) {
+			delete static_cast<Entry*>(n);
+		}
+	}
+
+	// Keeps the value already there, as _SyncMap does.
+	void Insert(const KeyType& k, const ValueType& v) { insert(new Entry(MaxLevel, k, v)); }
+	void Insert(const Type& t) { insert(new Entry(MaxLevel, t.first, t.second)); }
+	void Insert(Type&& t) { insert(new Entry(MaxLevel, std::move(t.first), std::move(t.second))); }
+	void Insert(PairType&& t) { insert(new Entry(MaxLevel, t.first, std::move(t.second))); }
+
+	bool Remove(const KeyType& k) {
+		auto guard = _epoch.Enter();
+
+		Node* preds[MaxLevel];
+		Node* succs[MaxLevel];
+		if (!find(k, preds, succs)) {
+			return false;
+		}
+
+		Node* victim = succs[0];
+		for (int l = victim->levels - 1; l > 0; l--) {
+			uintptr_t s = victim->next[l].load();
+			while (!(s & Mark)) {
+				victim->next[l].compare_exchange_weak(s, s | Mark);
+			}
+		}
+
+		// Whoever marks level 0 removed the key.
+		uintptr_t s = victim->next[0].load();
+		while (!(s & Mark)) {
+			if (victim->next[0].compare_exchange_strong(s, s | Mark)) {
+				_size.fetch_sub(1);
+				find(k, preds, succs);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Copies the value out, false when k is missing.
+	bool Find(const KeyType& k, ValueType& v) const {
+		auto guard = _epoch.Enter();
+		const Entry* e = exact(k);
+		if (!e) {
+			return false;
+		}
+		v = e->pair.second;
+		return true;
+	}
+
+	bool Contains(const KeyType& k) const {
+		auto guard = _epoch.Enter();
+		return exact(k) != nullptr;
+	}
+
+	ValueType GetOr(const KeyType& k, const ValueType& def) const {
+		auto guard = _epoch.Enter();
+		const Entry* e = exact(k);
+		return e ? e->pair.second : def;
+	}
+
+	template <typename F>
+	bool Visit(const KeyType& k, F fn) const {
+		auto guard = _epoch.Enter();
+		const Entry* e = exact(k);
+		if (!e) {
+			return false;
+		}
+		fn(e->pair.second);
+		return true;
+	}
+
+	// First entry not ordered before k, false when there is none.
+	bool LowerBound(const KeyType& k, Type& out) const {
+		auto guard = _epoch.Enter();
+		const Entry* e = seek(k);
+		if (!e) {
+			return false;
+		}
+		out = Type(e->pair.first, e->pair.second);
+		return true;
+	}
+
+	// Entries in [from, to), in order, without blocking writers.
+	void Range(const KeyType& from, const KeyType& to, const std::function<void(const Type&)>& fn) const {
+		auto guard = _epoch.Enter();
+		for (const Entry* e = seek(from); e && _less(e->pair.first, to); e = after(e)) {
+			fn(Type(e->pair.first, e->pair.second));
+		}
+	}
+
+	void ForEach(const std::function<void(const Type&)>& fn) const {
+		auto guard = _epoch.Enter();
+		for (const Entry* e = after(&_head); e; e = after(e)) {
+			fn(Type(e->pair.first, e->pair.second));
+		}
+	}
+
+	// Keys are unique, each group holds one value, in key order.
+	template <typename Storage>
+	void Aggregate(const std::function<void(const KeyType&, std::shared_ptr<Storage>)>& fn) const {
+		ForEach([&fn](const Type& t) {
+			std::shared_ptr<Storage> s(new Storage());
+			s->push_back(t.second);
+			fn(t.first, s);
+		});
+	}
+
+	// Not atomic with writers running at the same time.
+	void Clear() {
+		auto guard = _epoch.Enter();
+		for (const Entry* e = after(&_head); e; e = after(e)) {
+			Remove(e->pair.first);
+		}
+	}
+
+	size_t Size() const { return _size.load(); }
+
+	void Close() {
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_opened = false;
+		}
+		_waiter.notify_all();
+	}
+
+	void Wait() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		while (_opened) {
+			_waiter.wait(lock);
+		}
+	}
+
+	void WaitForEmpty() {
+		Wait();
+	}
+
+private:
+	static constexpr int MaxLevel = 24;
+	static constexpr uintptr_t Mark = 1;
+
+	struct Node {
+		Node(int l) : levels(l), next(new std::atomic<uintptr_t>[l]) {
+			for (int i = 0; i < l; i++) {
+				next[i].store(0, std::memory_order_relaxed);
+			}
+		}
+		~Node() { delete[] next; }
+
+		const int levels;
+		std::atomic<uintptr_t>* next;
+		std::atomic<int> links{ 0 };
+	};
+
+	struct Entry : Node {
+		template <typename K, typename V>
+		Entry(int max, K&& k, V&& v) : Node(level(max)), pair(std::forward<K>(k), std::forward<V>(v)) {}
+
+		PairType pair;
+	};
+
+	static Node* ptr(uintptr_t p) { return reinterpret_cast<Node*>(p & ~Mark); }
+	static uintptr_t raw(const Node* n) { return reinterpret_cast<uintptr_t>(n); }
+	static const KeyType& key(const Node* n) { return static_cast<const Entry*>(n)->pair.first; }
+
+	// Geometric with p = 1/2, from a per-thread xorshift.
+	static int level(int max) {
+		static thread_local uint64_t state = std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+
+		int l = 1;
+		for (uint64_t r = state; (r & 1) && l < max; r >>= 1) {
+			l++;
+		}
+		return l;
+	}
+
+	// Drops one reference; the last one retires the node.
+	void release(Node* n) {
+		if (n->links.fetch_sub(1) == 1) {
+			_epoch.Retire(static_cast<Entry*>(n));
+		}
+	}
+
+	// Predecessors and successors of k on every level, unlinking the marked
+	// nodes on the way. True when succs[0] holds k.
+	bool find(const KeyType& k, Node** preds, Node** succs) {
+	retry:
+		Node* pred = &_head;
+		for (int l = MaxLevel - 1; l >= 0; l--) {
+			Node* curr = ptr(pred->next[l].load());
+			while (curr) {
+				uintptr_t succ = curr->next[l].load();
+				if (succ & Mark) {
+					uintptr_t expected = raw(curr);
+					if (!pred->next[l].compare_exchange_strong(expected, succ & ~Mark)) {
+						goto retry;
+					}
+					release(curr);
+					curr = ptr(succ);
+					continue;
+				}
+				if (!_less(key(curr), k)) {
+					break;
+				}
+				pred = curr;
+				curr = ptr(succ);
+			}
+			preds[l] = pred;
+			succs[l] = curr;
+		}
+		return succs[0] && !_less(k, key(succs[0]));
+	}
+
+	// First live entry not ordered before k; reads only.
+	const Entry* seek(const KeyType& k) const {
+		const Node* pred = &_head;
+		const Node* curr = nullptr;
+		for (int l = MaxLevel - 1; l >= 0; l--) {
+			curr = ptr(pred->next[l].load());
+			while (curr) {
+				uintptr_t succ = curr->next[l].load();
+				if (!(succ & Mark)) {
+					if (!_less(key(curr), k)) {
+						break;
+					}
+					pred = curr;
+				}
+				curr = ptr(succ);
+			}
+		}
+		return static_cast<const Entry*>(curr);
+	}
+
+	const Entry* exact(const KeyType& k) const {
+		const Entry* e = seek(k);
+		return e && !_less(k, e->pair.first) ? e : nullptr;
+	}
+
+	// Next live entry on level 0.
+	const Entry* after(const Node* n) const {
+		const Node* curr = ptr(n->next[0].load());
+		while (curr && (curr->next[0].load() & Mark)) {
+			curr = ptr(curr->next[0].load());
+		}
+		return static_cast<const Entry*>(curr);
+	}
+
+	bool insert(Entry* fresh) {
+		auto guard = _epoch.Enter();
+		const KeyType& k = fresh->pair.first;
+
+		Node* preds[MaxLevel];
+		Node* succs[MaxLevel];
+		for (;;) {
+			if (find(k, preds, succs)) {
+				delete fresh;
+				return false;
+			}
+
+			for (int l = 0; l < fresh->levels; l++) {
+				fresh->next[l].store(raw(succs[l]), std::memory_order_relaxed);
+			}
+			// The level 0 link and the hold kept while linking the others.
+			fresh->links.store(2);
+
+			uintptr_t expected = raw(succs[0]);
+			if (preds[0]->next[0].compare_exchange_strong(expected, raw(fresh))) {
+				break;
+			}
+		}
+		_size.fetch_add(1);
+
+		for (int l = 1; l < fresh->levels; l++) {
+			bool linked = false;
+			while (!linked) {
+				uintptr_t nx = fresh->next[l].load();
+				if (nx & Mark) {
+					break;
+				}
+				if (ptr(nx) != succs[l] && !fresh->next[l].compare_exchange_strong(nx, raw(succs[l]))) {
+					continue;
+				}
+
+				fresh->links.fetch_add(1);
+				uintptr_t expected = raw(succs[l]);
+				if (preds[l]->next[l].compare_exchange_strong(expected, raw(fresh))) {
+					linked = true;
+					break;
+				}
+				fresh->links.fetch_sub(1);
+
+				// Removed meanwhile: the upper levels are not needed.
+				if (!find(k, preds, succs) || succs[0] != fresh) {
+					break;
+				}
+			}
+			if (!linked) {
+				break;
+			}
+		}
+
+		release(fresh);
+		return true;
+	}
+
+	mutable EpochDomain _epoch;
+	Node _head;
+	std::atomic<size_t> _size{ 0 };
+	_Compare _less;
+
+	bool _opened = true;
+	mutable std::mutex _mutex;
+	std::condition_variable _waiter;
+
+	SkipListMap(SkipListMap const&) = delete;
+	SkipListMap& operator=(SkipListMap const&) = delete;
+};
+
+template <typename _K, typename _V, typename _Compare>
+constexpr int SkipListMap<_K, _V, _Compare>::MaxLevel;
+
+template <typename _K, typename _V, typename _Compare>
+constexpr uintptr_t SkipListMap<_K, _V, _Compare>::Mark;
+
+}
+
+#endif
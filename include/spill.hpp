@@ -0,0 +1,176 @@
+#ifndef U_CONCURRENT_SPILL_HPP
+#define U_CONCURRENT_SPILL_HPP
+
+#include <cstdio>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+#include <system_error>
+
+namespace concurrent {
+
+namespace {
+
+	// Reads n bytes of a record from f. False on a clean end of file when the
+	// record starts there; an I/O error or a partial record throws.
+	inline bool _spillRead(std::FILE* f, void* p, size_t n, bool start) {
+		size_t got = std::fread(p, 1, n, f);
+		if (got == n) {
+			return true;
+		}
+		if (std::ferror(f)) {
+			throw std::system_error(errno, std::generic_category(), "Spill: read");
+		}
+		if (got == 0 && start) {
+			return false;
+		}
+		throw std::system_error(static_cast<int>(std::errc::io_error), std::generic_category(), "Spill: truncated record");
+	}
+
+}
+
+// Binary encoding of elements written to spill files. Provided for trivially
+// copyable types, std::string and pairs of those; specialize it for others.
+// Read returns false only at a clean end of file, and throws
+// std::system_error on an I/O error or a partial record.
+template <typename T, typename = void>
+struct Spill;
+
+template <typename T>
+struct Spill<T, typename std::enable_if<std::is_trivially_copyable<T>::value>::type> {
+	static bool Write(std::FILE* f, const T& v) {
+		return std::fwrite(&v, sizeof(T), 1, f) == 1;
+	}
+
+	static bool Read(std::FILE* f, T& v) {
+		return _spillRead(f, &v, sizeof(T), true);
+	}
+};
+
+template <>
+struct Spill<std::string> {
+	static bool Write(std::FILE* f, const std::string& v) {
+		size_t n = v.size();
+		return std::fwrite(&n, sizeof(n), 1, f) == 1 && std::fwrite(v.data(), 1, n, f) == n;
+	}
+
+	static bool Read(std::FILE* f, std::string& v) {
+		size_t n;
+		if (!_spillRead(f, &n, sizeof(n), true)) {
+			return false;
+		}
+		v.resize(n);
+		return _spillRead(f, &v[0], n, false);
+	}
+};
+
+template <typename A, typename B>
+struct Spill<std::pair<A, B>, typename std::enable_if<!std::is_trivially_copyable<std::pair<A, B>>::value>::type> {
+	static bool Write(std::FILE* f, const std::pair<A, B>& v) {
+		return Spill<A>::Write(f, v.first) && Spill<B>::Write(f, v.second);
+	}
+
+	static bool Read(std::FILE* f, std::pair<A, B>& v) {
+		if (!Spill<A>::Read(f, v.first)) {
+			return false;
+		}
+		if (!Spill<B>::Read(f, v.second)) {
+			throw std::system_error(static_cast<int>(std::errc::io_error), std::generic_category(), "Spill: truncated record");
+		}
+		return true;
+	}
+};
+
+// Anonymous temporary file holding a run of elements. It is written once,
+// then read back from the start; the file is removed when closed.
+template <typename T>
+class SpillFile {
+public:
+	typedef std::shared_ptr<SpillFile<T>> Ptr;
+
+	// Most runs merged at once: each one holds a descriptor and a buffer.
+	static constexpr size_t FanIn = 16;
+
+	SpillFile() : _file(std::tmpfile()) {
+		if (_file == nullptr) {
+			throw std::system_error(errno, std::generic_category(), "SpillFile: tmpfile");
+		}
+		std::setvbuf(_file, nullptr, _IOFBF, 1 << 16);
+	}
+
+	~SpillFile() { std::fclose(_file); }
+
+	void Write(const T& v) {
+		if (!Spill<T>::Write(_file, v)) {
+			throw std::system_error(errno, std::generic_category(), "SpillFile: write");
+		}
+	}
+
+	void Rewind() {
+		if (std::fflush(_file) != 0) {
+			throw std::system_error(errno, std::generic_category(), "SpillFile: flush");
+		}
+		std::rewind(_file);
+	}
+
+	// False once the run is exhausted; throws std::system_error when it
+	// cannot be read back whole.
+	bool Read(T& v) {
+		return Spill<T>::Read(_file, v);
+	}
+
+	// Merges runs sorted per cmp, from where they were read up to, into a
+	// new run ready to be read.
+	template <typename C>
+	static Ptr Merge(const std::vector<Ptr>& runs, C cmp) {
+		struct Head {
+			T value;
+			size_t run;
+		};
+
+		auto later = [&cmp](const Head& a, const Head& b) {
+			return cmp(b.value, a.value);
+		};
+
+		std::vector<Head> heads;
+		for (size_t r = 0; r < runs.size(); r++) {
+			T v;
+			if (runs[r]->Read(v)) {
+				heads.push_back(Head{ std::move(v), r });
+				std::push_heap(heads.begin(), heads.end(), later);
+			}
+		}
+
+		Ptr out(new SpillFile<T>());
+		while (!heads.empty()) {
+			std::pop_heap(heads.begin(), heads.end(), later);
+			Head& h = heads.back();
+			out->Write(h.value);
+
+			if (runs[h.run]->Read(h.value)) {
+				std::push_heap(heads.begin(), heads.end(), later);
+			} else {
+				heads.pop_back();
+			}
+		}
+		out->Rewind();
+		return out;
+	}
+
+private:
+	std::FILE* _file;
+
+	SpillFile(SpillFile const&) = delete;
+	SpillFile& operator=(SpillFile const&) = delete;
+};
+
+template <typename T>
+constexpr size_t SpillFile<T>::FanIn;
+
+}
+
+#endif
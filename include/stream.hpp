@@ -1,10 +1,233 @@
 #ifndef U_CONCURRENT_STREAM
 #define U_CONCURRENT_STREAM
 
+#include <iterator>
+#include <algorithm>
+#include <mutex>
+#include <type_traits>
+
 #include "pool.hpp"
+#include "sink.hpp"
+#include "spill.hpp"
+#include "sketch.hpp"
+#include "autoscale.hpp"
+#include "shm.hpp"
 
 namespace concurrent {
 
+namespace {
+
+	// Queues are consumed while they fill, so producers see backpressure;
+	// maps only hand out their content once the producing stage closed them.
+	template <typename T>
+	void _await(SyncQueue<T>&) { }
+
+	template <typename M>
+	void _await(M& m) { m.Wait(); }
+
+#if defined(__unix__) || defined(__APPLE__)
+	template <typename T>
+	void _await(ShmQueue<T>&) { }
+
+	template <typename T, typename F>
+	void _consume(ShmQueue<T>& q, F&& fn) {
+		q.Drain(std::forward<F>(fn));
+	}
+#endif
+
+	// Queued elements are moved into fn, map entries are copied out.
+	template <typename T, typename F>
+	void _consume(SyncQueue<T>& q, F&& fn) {
+		q.Drain(std::forward<F>(fn));
+	}
+
+	template <typename M, typename F>
+	void _consume(M& m, F&& fn) {
+		m.ForEach([&fn](const typename M::Type& v) { fn(typename M::Type(v)); });
+	}
+
+	// Bytes held by an element, from the queue sizer when one is set.
+	template <typename C>
+	std::function<size_t(const typename C::Type&)> _sizer(const C&) {
+		return [](const typename C::Type&) { return sizeof(typename C::Type); };
+	}
+
+	template <typename T>
+	std::function<size_t(const T&)> _sizer(const SyncQueue<T>& q) {
+		auto f = q.Sizer();
+		if (f) {
+			return f;
+		}
+		return [](const T&) { return sizeof(T); };
+	}
+
+	// Runs a pulled stage into its queue, see _StreamItem::materialize.
+	template <typename T, typename P>
+	void _fill(const std::shared_ptr<SyncQueue<T>>& q, const P& pull) {
+		while (T* v = pull()) {
+			q->Push(std::move(*v));
+		}
+		q->Close();
+	}
+
+	template <typename C, typename P>
+	void _fill(const std::shared_ptr<C>&, const P&) { }
+
+	template <typename T>
+	struct _is_function : std::false_type {};
+
+	template <typename S>
+	struct _is_function<std::function<S>> : std::true_type {};
+
+	// Result of calling a const F with Args. Only defined for callables other
+	// than std::function, which keep their own overloads.
+	template <typename F, typename ...Args>
+	using _invoke_t = typename std::enable_if<
+		!_is_function<typename std::decay<F>::type>::value,
+		decltype(std::declval<const typename std::decay<F>::type&>()(std::declval<Args>()...))
+	>::type;
+
+	// _O when given explicitly, what F returns otherwise.
+	template <typename _O, typename F, typename ...Args>
+	using _result_t = typename std::conditional<
+		std::is_void<_O>::value,
+		typename std::decay<_invoke_t<F, Args...>>::type,
+		_O
+	>::type;
+
+	// Decayed result of calling a const F with Args, for any callable.
+	template <typename F, typename ...Args>
+	using _return_t = typename std::decay<decltype(std::declval<const typename std::decay<F>::type&>()(std::declval<Args>()...))>::type;
+
+	// Partitions leave their input map as it is. Consuming ones, tagged with
+	// std::true_type, move the values of locked maps into the groups and
+	// leave them empty; other maps are read either way.
+	template <typename Storage, typename M, typename Consume>
+	void _gather(const std::shared_ptr<M>& m, const std::function<void(const typename M::KeyType&, std::shared_ptr<Storage>)>& fn, Consume) {
+		m->Aggregate(fn);
+	}
+
+	template <typename Storage, typename M, typename L>
+	void _gather(const std::shared_ptr<_SyncMap<M, L>>& m, const std::function<void(const typename M::key_type&, std::shared_ptr<Storage>)>& fn, std::true_type) {
+		m->template Extract<Storage>(fn);
+	}
+
+	template <typename Storage, typename K, typename V, size_t S>
+	void _gather(const std::shared_ptr<SyncGroupMap<K, V, S>>& m, const std::function<void(const K&, std::shared_ptr<Storage>)>& fn, std::true_type) {
+		m->template Extract<Storage>(fn);
+	}
+
+	// Locked maps hand out one task per key.
+	template <typename Storage, typename M, typename Consume>
+	void _scatter(const std::shared_ptr<M>& m, Pool<void>::Ptr p, WaitGroup::Ptr group, const std::function<void(const typename M::KeyType&, std::shared_ptr<Storage>)>& fn, Consume consume) {
+		std::function<void(const typename M::KeyType&, std::shared_ptr<Storage>)> main = [group, p, fn](const auto& k, auto s) {
+			group->Add();
+			p->Send([group, fn, k, s] {
+				fn(k, s);
+				group->Finish();
+			});
+		};
+
+		_gather<Storage>(m, main, consume);
+	}
+
+	// Shards share no keys, each one is grouped by its own task.
+	template <typename Storage, typename M, typename Consume>
+	void _scatter(const std::shared_ptr<_ShardedMap<M>>& m, Pool<void>::Ptr p, WaitGroup::Ptr group, const std::function<void(const typename M::key_type&, std::shared_ptr<Storage>)>& fn, Consume) {
+		for (size_t i = 0; i < m->Shards(); i++) {
+			group->Add();
+			p->Send([m, i, group, fn] {
+				m->template Aggregate<Storage>(i, fn);
+				group->Finish();
+			});
+		}
+	}
+
+	template <typename Storage, typename K, typename V, size_t S, typename Consume>
+	void _scatter(const std::shared_ptr<SyncShardedHashMap<K, V, S>>& m, Pool<void>::Ptr p, WaitGroup::Ptr group, const std::function<void(const K&, std::shared_ptr<Storage>)>& fn, Consume) {
+		for (size_t i = 0; i < m->Shards(); i++) {
+			group->Add();
+			p->Send([m, i, group, fn] {
+				m->template Aggregate<Storage>(i, fn);
+				group->Finish();
+			});
+		}
+	}
+
+	template <typename Storage, typename K, typename V, size_t S>
+	void _scatter(const std::shared_ptr<SyncGroupMap<K, V, S>>& m, Pool<void>::Ptr p, WaitGroup::Ptr group, const std::function<void(const K&, std::shared_ptr<Storage>)>& fn, std::false_type) {
+		for (size_t i = 0; i < m->Shards(); i++) {
+			group->Add();
+			p->Send([m, i, group, fn] {
+				m->template Aggregate<Storage>(i, fn);
+				group->Finish();
+			});
+		}
+	}
+
+	template <typename Storage, typename K, typename V, size_t S>
+	void _scatter(const std::shared_ptr<SyncGroupMap<K, V, S>>& m, Pool<void>::Ptr p, WaitGroup::Ptr group, const std::function<void(const K&, std::shared_ptr<Storage>)>& fn, std::true_type) {
+		for (size_t i = 0; i < m->Shards(); i++) {
+			group->Add();
+			p->Send([m, i, group, fn] {
+				m->template Extract<Storage>(i, fn);
+				group->Finish();
+			});
+		}
+	}
+
+}
+
+// Handed to FlatMap callbacks to push any number of outputs per input. With
+// a batch size above 1 outputs are queued batch at a time, see PushAll.
+template <typename T>
+class Emitter {
+public:
+	Emitter(typename SyncQueue<T>::Ptr q, size_t batch = 1) : _queue(q), _batch(batch) {
+		if (_batch > 1) {
+			_pending.reserve(_batch);
+		}
+	}
+
+	// Collects into local instead, for pulled stages.
+	Emitter(std::vector<T>* local) : _batch(1), _local(local) {}
+
+	void operator()(const T& v) { Emit(T(v)); }
+	void operator()(T&& v) { Emit(std::move(v)); }
+
+	void Emit(T&& v) {
+		if (_local) {
+			_local->push_back(std::move(v));
+			return;
+		}
+
+		if (_batch <= 1) {
+			_queue->Push(std::move(v));
+			return;
+		}
+
+		_pending.push_back(std::move(v));
+		if (_pending.size() >= _batch) {
+			_queue->PushAll(_pending);
+		}
+	}
+
+	void Flush() {
+		if (!_pending.empty()) {
+			_queue->PushAll(_pending);
+		}
+	}
+
+private:
+	typename SyncQueue<T>::Ptr _queue;
+	size_t _batch;
+	std::vector<T> _pending;
+	std::vector<T>* _local = nullptr;
+
+	Emitter(Emitter const&) = delete;
+	Emitter& operator=(Emitter const&) = delete;
+};
+
 template <typename I, typename O>
 class _StreamItem {
 public:
@@ -14,32 +237,415 @@ public:
 	_StreamItem(Pool<void>::Ptr p) : _pool(p), _in(new O()), _out(_in) {}
 
 	template <typename Iter>
-	_StreamItem(Iter begin, Iter end, size_t th = std::thread::hardware_concurrency()) : _StreamItem(th) {
-		_pool->Send([this, begin, end] {
-			this->Stream(begin, end);
-		});
+	_StreamItem(Iter begin, Iter end, size_t th = std::thread::hardware_concurrency()) : _StreamItem(Pool<void>::Ptr(new Pool<void>(th))) {
+		feed(begin, end);
 	}
 
 	template <typename Iter>
 	_StreamItem(Iter begin, Iter end, Pool<void>::Ptr p) : _StreamItem(p) {
-		_pool->Send([this, begin, end] {
-			this->Stream(begin, end);
-		});
+		feed(begin, end);
 	}
 
 	_StreamItem(typename I::Ptr i, typename Pool<void>::Ptr p) : _in(i), _out(new O()), _pool(p) { }
+	_StreamItem(typename I::Ptr i, typename O::Ptr o, typename Pool<void>::Ptr p, MemoryBudget::Ptr b, Autoscaler::Ptr a = nullptr, std::shared_ptr<void> src = nullptr) : _pool(p), _in(i), _out(o), _budget(b), _scaler(a), _source(src) { }
 
 	~_StreamItem() { }
 
+	// Stream over [begin, end) evaluated on demand: Filter, Transform and
+	// FlatMap fuse into the next one, and Reduce, ForEach or Sketch pull the
+	// elements through them in the calling thread, with no queue or thread.
+	// Once they did, the stage is spent and reads as an empty stream. Any
+	// other stage first runs the pulled elements into the output queue from
+	// a pool task, which grows from no threads when needed.
+	template <typename Iter>
+	static Ptr Lazy(Iter begin, Iter end) {
+		Ptr item(new _StreamItem(Pool<void>::Ptr(new Pool<void>(0))));
+		item->pull(begin, end);
+		return item;
+	}
+
+	bool IsLazy() const { return bool(_pull); }
+
+	// Stream over [begin, end) pushed by up to one pool task per thread, each
+	// over its own range of at least 16K elements. Elements of different
+	// ranges reach the stages interleaved, so order is only kept within a
+	// range. Iterators that are not random access are fed by one task.
+	template <typename Iter>
+	static Ptr Parallel(Iter begin, Iter end, Pool<void>::Ptr p) {
+		Ptr item(new _StreamItem(p));
+		item->feedRanges(begin, end, p->Size());
+		return item;
+	}
+
 	typename I::Ptr Input() { return _in; }
-	typename O::Ptr Output() { return _out; }
+	typename O::Ptr Output() {
+		materialize();
+		return _out;
+	}
+
+	// Charges the output queue of this stage, and the queues of every stage
+	// built from it afterwards, against b. Stages keeping the element type
+	// reuse sizer; stages changing it charge sizeof() of their output type
+	// unless Budget() is called again on them with a sizer of their own.
+	void Budget(MemoryBudget::Ptr b, const std::function<size_t(const typename O::ValueType&)>& sizer = nullptr) {
+		_budget = b;
+		_out->Limit(b, sizer);
+	}
+
+	// Lets a, for the stages built from this one on, move workers between
+	// the Filter, Transform, FlatMap and KV stages reading a queue.
+	// Their s is then the initial worker count; see Autoscaler::Stats.
+	void Autoscale(Autoscaler::Ptr a) {
+		_scaler = a;
+	}
+
+	// _M is a container wrapped in a _SyncMap, or a concurrent map such as
+	// SyncShardedHashMap used as is.
+	template <typename _I, typename _M>
+	using _Mapper = _StreamItem<SyncQueue<_I>, _sync_t<_M>>;
+
+	// Every stage takes either a std::function or any other callable. The
+	// latter is kept as its own type so the call inlines into the stage loop;
+	// callables that cannot be invoked as const go through std::function.
+	template <typename _M>
+	typename _Mapper<typename O::ValueType, _M>::Ptr KV(const std::function<typename _sync_t<_M>::PairType(typename O::ValueType)>& fn) {
+		return kv<_M>(fn);
+	}
+
+	template <typename _M, typename F, typename = _invoke_t<F, typename O::ValueType>>
+	typename _Mapper<typename O::ValueType, _M>::Ptr KV(F&& fn) {
+		return kv<_M>(std::forward<F>(fn));
+	}
+
+	template <typename _M>
+	typename _Mapper<typename O::ValueType, _M>::Ptr KV(const std::function<typename _sync_t<_M>::PairType (typename O::ValueType)>& fn, size_t s) {
+		return kv<_M>(fn, s);
+	}
+
+	template <typename _M, typename F, typename = _invoke_t<F, typename O::ValueType>>
+	typename _Mapper<typename O::ValueType, _M>::Ptr KV(F&& fn, size_t s) {
+		return kv<_M>(std::forward<F>(fn), s);
+	}
 
 	template <typename _I, typename _M>
-	using _Mapper = _StreamItem<SyncQueue<_I>, _SyncMap<_M>>;
+	using _Shuffler = _StreamItem<SyncQueue<_I>, _ShardedMap<_M>>;
 
+	// Hash partitioned KV: s workers map the input and route each pair to
+	// the shard owning its key, s more workers fill one shard each without
+	// locking. PartitionMT on the result groups every shard in parallel.
 	template <typename _M>
-	typename _Mapper<typename O::ValueType, _M>::Ptr KV(const std::function<typename _SyncMap<_M>::PairType(typename O::ValueType)>& fn) {
-		typename _Mapper<typename O::ValueType, _M>::Ptr item(new _Mapper<typename O::ValueType, _M>(_out, _pool));
+	typename _Shuffler<typename O::ValueType, _M>::Ptr Shuffle(const std::function<typename _ShardedMap<_M>::PairType(typename O::ValueType)>& fn, size_t s, size_t capacity = SyncQueue<typename _ShardedMap<_M>::Type>::DefaultCapacity) {
+		return shuffle<_M>(fn, s, capacity);
+	}
+
+	template <typename _M, typename F, typename = _invoke_t<F, typename O::ValueType>>
+	typename _Shuffler<typename O::ValueType, _M>::Ptr Shuffle(F&& fn, size_t s, size_t capacity = SyncQueue<typename _ShardedMap<_M>::Type>::DefaultCapacity) {
+		return shuffle<_M>(std::forward<F>(fn), s, capacity);
+	}
+
+	using Bouncer = _StreamItem<O, SyncQueue<typename O::ValueType>>;
+
+	typename Bouncer::Ptr Filter(const std::function<bool(const typename O::ValueType&)>& fn) {
+		return filter(fn, SyncQueue<typename O::ValueType>::DefaultCapacity);
+	}
+
+	template <typename F, typename = _invoke_t<F, const typename O::ValueType&>>
+	typename Bouncer::Ptr Filter(F&& fn) {
+		return filter(std::forward<F>(fn), SyncQueue<typename O::ValueType>::DefaultCapacity);
+	}
+
+	// With s == 1 this is the single worker stage above, with its output
+	// queue holding at most capacity elements.
+
+	typename Bouncer::Ptr Filter(const std::function<bool(const typename O::ValueType&)>& fn, size_t s, size_t capacity = SyncQueue<typename O::ValueType>::DefaultCapacity) {
+		return filter(fn, s, capacity);
+	}
+
+	template <typename F, typename = _invoke_t<F, const typename O::ValueType&>>
+	typename Bouncer::Ptr Filter(F&& fn, size_t s, size_t capacity = SyncQueue<typename O::ValueType>::DefaultCapacity) {
+		return filter(std::forward<F>(fn), s, capacity);
+	}
+
+	template <typename _O>
+	using _Collector = _StreamItem<O, SyncQueue<_O>>;
+
+	template <typename _O >
+	typename _Collector<_O>::Ptr Transform(const std::function < _O(typename O::Type&&) > & fn) {
+		return transform<_O>(fn, SyncQueue<_O>::DefaultCapacity);
+	}
+
+	// The output type is deduced from fn unless given explicitly.
+	template <typename _O = void, typename F, typename Out = _result_t<_O, F, typename O::Type&&>>
+	typename _Collector<Out>::Ptr Transform(F&& fn) {
+		return transform<Out>(std::forward<F>(fn), SyncQueue<Out>::DefaultCapacity);
+	}
+
+	// Single worker stage when s == 1, as for Filter.
+
+	template <typename _O >
+	typename _Collector<_O>::Ptr Transform(const std::function < _O(typename O::Type&&) > & fn, size_t s, size_t capacity = SyncQueue<_O>::DefaultCapacity) {
+		return transform<_O>(fn, s, capacity);
+	}
+
+	template <typename _O = void, typename F, typename Out = _result_t<_O, F, typename O::Type&&>>
+	typename _Collector<Out>::Ptr Transform(F&& fn, size_t s, size_t capacity = SyncQueue<Out>::DefaultCapacity) {
+		return transform<Out>(std::forward<F>(fn), s, capacity);
+	}
+
+	// Like Transform, but fn emits zero or more outputs per input through an
+	// Emitter writing into the output queue. The s worker variant can queue
+	// the outputs of each worker batch elements at a time.
+	template <typename _O>
+	typename _Collector<_O>::Ptr FlatMap(const std::function<void(typename O::Type&&, Emitter<_O>&)>& fn) {
+		return flatMap<_O>(fn, 1, SyncQueue<_O>::DefaultCapacity, 1);
+	}
+
+	template <typename _O, typename F, typename = _invoke_t<F, typename O::Type&&, Emitter<_O>&>>
+	typename _Collector<_O>::Ptr FlatMap(F&& fn) {
+		return flatMap<_O>(std::forward<F>(fn), 1, SyncQueue<_O>::DefaultCapacity, 1);
+	}
+
+	template <typename _O>
+	typename _Collector<_O>::Ptr FlatMap(const std::function<void(typename O::Type&&, Emitter<_O>&)>& fn, size_t s, size_t capacity = SyncQueue<_O>::DefaultCapacity, size_t batch = 1) {
+		return flatMap<_O>(fn, s, capacity, batch);
+	}
+
+	template <typename _O, typename F, typename = _invoke_t<F, typename O::Type&&, Emitter<_O>&>>
+	typename _Collector<_O>::Ptr FlatMap(F&& fn, size_t s, size_t capacity = SyncQueue<_O>::DefaultCapacity, size_t batch = 1) {
+		return flatMap<_O>(std::forward<F>(fn), s, capacity, batch);
+	}
+
+	using Branches = std::vector<typename _Collector<typename O::Type>::Ptr>;
+
+	// n branches each receiving a copy of every element. Every branch has its
+	// own queue of capacity, the slowest one paces the others.
+	Branches Broadcast(size_t n, size_t capacity = SyncQueue<typename O::Type>::DefaultCapacity) {
+		return broadcast(n, capacity);
+	}
+
+	// n branches, each element going to branch fn(v) % n only; a predicate
+	// sends true to branch 1 and false to branch 0. Routed by s workers.
+	Branches Split(size_t n, const std::function<size_t(const typename O::Type&)>& fn, size_t s = 1, size_t capacity = SyncQueue<typename O::Type>::DefaultCapacity) {
+		return split(n, fn, s, capacity);
+	}
+
+	template <typename F, typename = _invoke_t<F, const typename O::Type&>>
+	Branches Split(size_t n, F&& fn, size_t s = 1, size_t capacity = SyncQueue<typename O::Type>::DefaultCapacity) {
+		return split(n, std::forward<F>(fn), s, capacity);
+	}
+
+	// Union of this output with the outputs of others, in arrival order. The
+	// result closes once every input is closed and drained.
+	template <typename ...Items>
+	typename _Collector<typename O::Type>::Ptr Merge(const Items&... others) {
+		WaitGroup::Ptr wg(new WaitGroup(1 + sizeof...(others)));
+		auto item = merged(wg);
+
+		pump(item, wg, _out);
+		int expand[] = { 0, (pump(item, wg, others->Output()), 0)... };
+		(void)expand;
+		return item;
+	}
+
+	template <typename _I2, typename _O2>
+	typename _Collector<typename O::Type>::Ptr Merge(const std::vector<std::shared_ptr<_StreamItem<_I2, _O2>>>& others) {
+		WaitGroup::Ptr wg(new WaitGroup(1 + others.size()));
+		auto item = merged(wg);
+
+		pump(item, wg, _out);
+		for (const auto& o : others) {
+			pump(item, wg, o->Output());
+		}
+		return item;
+	}
+
+	template <typename Out>
+	using Partitioner = _StreamItem<O, SyncQueue<Out>>;
+
+	// Groups copy the values out of the input map, which keeps its content.
+	template <typename Storage, typename Out>
+	typename Partitioner<Out>::Ptr Partition(const std::function<Out (const typename O::KeyType&, std::shared_ptr<Storage>)>& fn, size_t capacity = SyncQueue<Out>::DefaultCapacity) {
+		return partition<Storage, Out, std::false_type>(fn, capacity);
+	}
+
+	template <typename Storage, typename _O = void, typename F, typename Out = _result_t<_O, F, const typename O::KeyType&, std::shared_ptr<Storage>>>
+	typename Partitioner<Out>::Ptr Partition(F&& fn, size_t capacity = SyncQueue<Out>::DefaultCapacity) {
+		return partition<Storage, Out, std::false_type>(std::forward<F>(fn), capacity);
+	}
+
+	template <typename Storage, typename Out>
+	typename Partitioner<Out>::Ptr PartitionMT(const std::function<Out(const typename O::KeyType&, std::shared_ptr<Storage>)>& fn, size_t capacity = SyncQueue<Out>::DefaultCapacity) {
+		return partitionMT<Storage, Out, std::false_type>(fn, capacity);
+	}
+
+	template <typename Storage, typename _O = void, typename F, typename Out = _result_t<_O, F, const typename O::KeyType&, std::shared_ptr<Storage>>>
+	typename Partitioner<Out>::Ptr PartitionMT(F&& fn, size_t capacity = SyncQueue<Out>::DefaultCapacity) {
+		return partitionMT<Storage, Out, std::false_type>(std::forward<F>(fn), capacity);
+	}
+
+	// Partition that consumes its input map like other stages consume their
+	// queue: KV maps and SyncGroupMap move their values into the groups and
+	// are left empty. Sharded and lock-free maps are read as by Partition.
+	template <typename Storage, typename Out>
+	typename Partitioner<Out>::Ptr ExtractPartition(const std::function<Out (const typename O::KeyType&, std::shared_ptr<Storage>)>& fn, size_t capacity = SyncQueue<Out>::DefaultCapacity) {
+		return partition<Storage, Out, std::true_type>(fn, capacity);
+	}
+
+	template <typename Storage, typename _O = void, typename F, typename Out = _result_t<_O, F, const typename O::KeyType&, std::shared_ptr<Storage>>>
+	typename Partitioner<Out>::Ptr ExtractPartition(F&& fn, size_t capacity = SyncQueue<Out>::DefaultCapacity) {
+		return partition<Storage, Out, std::true_type>(std::forward<F>(fn), capacity);
+	}
+
+	template <typename Storage, typename Out>
+	typename Partitioner<Out>::Ptr ExtractPartitionMT(const std::function<Out(const typename O::KeyType&, std::shared_ptr<Storage>)>& fn, size_t capacity = SyncQueue<Out>::DefaultCapacity) {
+		return partitionMT<Storage, Out, std::true_type>(fn, capacity);
+	}
+
+	template <typename Storage, typename _O = void, typename F, typename Out = _result_t<_O, F, const typename O::KeyType&, std::shared_ptr<Storage>>>
+	typename Partitioner<Out>::Ptr ExtractPartitionMT(F&& fn, size_t capacity = SyncQueue<Out>::DefaultCapacity) {
+		return partitionMT<Storage, Out, std::true_type>(std::forward<F>(fn), capacity);
+	}
+
+	// Hash join with the output of build. The build side is hashed by buildKey
+	// into s partitions, each filled by its own task without locking. Once it
+	// is complete s workers look up the output of this stage by probeKey, the
+	// partitions are only read then so probes take no lock. fn is called with
+	// every matching pair, and with nullptr for unmatched rows in LeftJoin.
+	template <typename _I2, typename _O2, typename PK, typename BK, typename F,
+		typename Key = _return_t<PK, const typename O::Type&>,
+		typename Out = _return_t<F, const typename O::Type&, const typename _O2::Type&>>
+	typename _Collector<Out>::Ptr Join(std::shared_ptr<_StreamItem<_I2, _O2>> build, PK probeKey, BK buildKey, F fn, size_t s = std::thread::hardware_concurrency(), size_t capacity = SyncQueue<Out>::DefaultCapacity) {
+		return join<Out, Key>(build->Output(), probeKey, buildKey, [fn](const typename O::Type& p, const typename _O2::Type* b) {
+			return fn(p, *b);
+		}, false, s, capacity);
+	}
+
+	template <typename _I2, typename _O2, typename PK, typename BK, typename F,
+		typename Key = _return_t<PK, const typename O::Type&>,
+		typename Out = _return_t<F, const typename O::Type&, const typename _O2::Type*>>
+	typename _Collector<Out>::Ptr LeftJoin(std::shared_ptr<_StreamItem<_I2, _O2>> build, PK probeKey, BK buildKey, F fn, size_t s = std::thread::hardware_concurrency(), size_t capacity = SyncQueue<Out>::DefaultCapacity) {
+		return join<Out, Key>(build->Output(), probeKey, buildKey, fn, true, s, capacity);
+	}
+
+	// Sorted output, first per cmp first. s workers sort runs of up to
+	// memory / s bytes and spill each full run to a temporary file, see Spill;
+	// the last run of every worker stays in memory. Spilled runs are merged
+	// SpillFile::FanIn at a time as they pile up, which bounds the open files
+	// and read buffers, and one task merges what is left.
+	template <typename C = std::less<typename O::Type>>
+	typename _Collector<typename O::Type>::Ptr Sort(C cmp = C(), size_t memory = 64 << 20, size_t s = std::thread::hardware_concurrency(), size_t capacity = SyncQueue<typename O::Type>::DefaultCapacity) {
+		return sort(cmp, memory, s, capacity);
+	}
+
+	// The k first elements per cmp, in order. Every worker keeps a heap of
+	// its k best, so nothing else is retained.
+	template <typename C = std::less<typename O::Type>>
+	typename _Collector<typename O::Type>::Ptr TopK(size_t k, C cmp = C(), size_t s = std::thread::hardware_concurrency()) {
+		return topK(k, cmp, s);
+	}
+
+	template <typename _O>
+	_O Reduce(const std::function<void (const typename O::Type&, _O&)>& fn) {
+		return reduce<_O>(fn);
+	}
+
+	template <typename _O, typename F, typename = _invoke_t<F, const typename O::Type&, _O&>>
+	_O Reduce(F&& fn) {
+		return reduce<_O>(fn);
+	}
+
+	// Folds the output into copies of proto, one per worker so updates never
+	// contend, and merges them once the output is drained. S needs a Merge,
+	// see HyperLogLog, QuantileSketch and CountMinSketch.
+	template <typename S>
+	S Sketch(const S& proto, const std::function<void(const typename O::Type&, S&)>& fn, size_t s = std::thread::hardware_concurrency()) {
+		return sketch(proto, fn, s);
+	}
+
+	template <typename S, typename F, typename = _invoke_t<F, const typename O::Type&, S&>>
+	S Sketch(const S& proto, F&& fn, size_t s = std::thread::hardware_concurrency()) {
+		return sketch(proto, std::forward<F>(fn), s);
+	}
+
+	void Close() {
+		discard();
+		_out->Wait();
+		_pool->Close();
+	}
+
+	void Wait() {
+		discard();
+		_out->WaitForEmpty();
+		_pool->Close();
+	}
+
+	template <typename C>
+	void Stream(const C& c) {
+		stream(_in, std::begin(c), std::end(c));
+	}
+
+	// Elements of a container given by rvalue are moved into the pipeline.
+	template <typename C, typename = typename std::enable_if<!std::is_lvalue_reference<C>::value>::type>
+	void Stream(C&& c) {
+		stream(_in, std::make_move_iterator(std::begin(c)), std::make_move_iterator(std::end(c)));
+	}
+
+	template <typename Iter>
+	void Stream(Iter b, Iter e) {
+		stream(_in, b, e);
+	}
+
+	// Serializes the output with s workers into buffers of about buffer bytes.
+	// One task writes the filled buffers while the workers fill the spare ones.
+	// Returns the bytes written once the output is closed and flushed, or
+	// throws the first exception of fn or of the writes.
+	size_t WriteTo(const std::string& path, const std::function<void(const typename O::Type&, std::string&)>& fn, size_t s = 1, size_t buffer = 1 << 20) {
+		return writeTo(path, fn, s, buffer);
+	}
+
+	template <typename F, typename = _invoke_t<F, const typename O::Type&, std::string&>>
+	size_t WriteTo(const std::string& path, F&& fn, size_t s = 1, size_t buffer = 1 << 20) {
+		return writeTo(path, std::forward<F>(fn), s, buffer);
+	}
+
+	// Lets src feed the input with s workers, see MmapSource. The source is
+	// kept alive by this item and every stage built from it afterwards, so
+	// views it hands out stay valid as long as any of them.
+	template <typename Src>
+	void From(std::shared_ptr<Src> src, size_t s = std::thread::hardware_concurrency()) {
+		_source = src;
+		src->Feed(_in, _pool, s);
+	}
+
+	// Pushes the output into q, e.g. a ShmQueue read by another process,
+	// then closes q. Returns once the output is drained.
+	template <typename Q>
+	void To(std::shared_ptr<Q> q) {
+		forEach([&q](const typename O::Type& v) {
+			q->Push(v);
+		});
+		q->Close();
+	}
+
+	void ForEach(const std::function<void(const typename O::Type&)>& fn) {
+		forEach(fn);
+	}
+
+	template <typename F, typename = _invoke_t<F, const typename O::Type&>>
+	void ForEach(F&& fn) {
+		forEach(fn);
+	}
+
+private:
+	template <typename _M, typename F>
+	typename _Mapper<typename O::ValueType, _M>::Ptr kv(F fn) {
+		if (_scaler) {
+			return kv<_M>(fn, 1);
+		}
+
+		materialize();
+
+		typename _Mapper<typename O::ValueType, _M>::Ptr item(new _Mapper<typename O::ValueType, _M>(_out, typename _sync_t<_M>::Ptr(new _sync_t<_M>()), _pool, _budget, _scaler, _source));
 
 		_pool->Send([item, fn] {
 			auto input = item->Input();
@@ -49,7 +655,7 @@ public:
 				while (item->Input()->CanReceive()) {
 					try {
 						auto ret = fn(input->Pop(500));
-						output->Insert(ret.first, ret.second);
+						output->Insert(std::move(ret));
 					} catch (const ex::TimeoutQueueException&) {
 					} catch (const ex::EmptyQueueException&) {
 					}
@@ -65,9 +671,18 @@ public:
 		return item;
 	}
 
-	template <typename _M>
-	typename _Mapper<typename O::ValueType, _M>::Ptr KV(const std::function<typename _SyncMap<_M>::PairType (typename O::ValueType)>& fn, size_t s) {
-		typename _Mapper<typename O::ValueType, _M>::Ptr item(new _Mapper<typename O::ValueType, _M>(_out, _pool));
+	template <typename _M, typename F>
+	typename _Mapper<typename O::ValueType, _M>::Ptr kv(F fn, size_t s) {
+		materialize();
+
+		typename _Mapper<typename O::ValueType, _M>::Ptr item(new _Mapper<typename O::ValueType, _M>(_out, typename _sync_t<_M>::Ptr(new _sync_t<_M>()), _pool, _budget, _scaler, _source));
+
+		auto output = item->Output();
+		if (scaled("kv", _out, s, [output, fn](typename O::ValueType&& val) {
+			output->Insert(fn(std::move(val)));
+		}, output)) {
+			return item;
+		}
 
 		WaitGroup::Ptr wg(new WaitGroup(s));
 
@@ -81,14 +696,726 @@ public:
 					while (item->Input()->CanReceive()) {
 						try {
 							auto ret = fn(input->Pop(500));
-							output->Insert(ret.first, ret.second);
+							output->Insert(std::move(ret));
 						} catch (const ex::TimeoutQueueException&) {
 						} catch (const ex::EmptyQueueException&) {
 						}
 
 					}
-				} catch (const ex::ClosedQueueException& ex) {
-					std::cerr << ex.what() << std::endl;
+				} catch (const ex::ClosedQueueException& ex) {
+					std::cerr << ex.what() << std::endl;
+				}
+				wg->Finish();
+			}
+			catch (const std::exception&) {
+				wg->Finish();
+				throw;
+			}
+		}, wg->Size());
+
+		_pool->Send([fn, item, wg] {
+			auto input = item->Input();
+			auto output = item->Output();
+
+			wg->Wait();
+
+			try {
+				while (input->CanReceive()) {
+					try {
+						auto ret = fn(input->Pop(500));
+						output->Insert(std::move(ret));
+					} catch (const ex::TimeoutQueueException&) {
+					} catch (const ex::EmptyQueueException&) {
+					}
+				}
+			} catch (const ex::ClosedQueueException& ex) {
+				std::cerr << ex.what() << std::endl;
+			} 
+
+			output->Close();
+		});
+
+		return item;
+	}
+
+	template <typename _M, typename F>
+	typename _Shuffler<typename O::ValueType, _M>::Ptr shuffle(F fn, size_t s, size_t capacity) {
+		materialize();
+
+		using Pair = typename _ShardedMap<_M>::Type;
+
+		typename _Shuffler<typename O::ValueType, _M>::Ptr item(new _Shuffler<typename O::ValueType, _M>(_out, typename _ShardedMap<_M>::Ptr(new _ShardedMap<_M>(s)), _pool, _budget, _scaler, _source));
+
+		std::vector<typename SyncQueue<Pair>::Ptr> inbox;
+		for (size_t i = 0; i < item->Output()->Shards(); i++) {
+			inbox.push_back(queue<Pair>(capacity));
+		}
+
+		WaitGroup::Ptr mappers(new WaitGroup(s));
+		WaitGroup::Ptr owners(new WaitGroup(inbox.size()));
+
+		_pool->Send([item, fn, inbox, mappers] {
+			try {
+				auto input = item->Input();
+				auto output = item->Output();
+
+				try {
+					while (input->CanReceive()) {
+						try {
+							Pair ret = fn(input->Pop(500));
+							inbox[output->ShardOf(ret.first)]->Push(std::move(ret));
+						} catch (const ex::TimeoutQueueException&) {
+						} catch (const ex::EmptyQueueException&) {
+						}
+					}
+				} catch (const ex::ClosedQueueException& ex) {
+					std::cerr << ex.what() << std::endl;
+				}
+				mappers->Finish();
+			}
+			catch (const std::exception&) {
+				mappers->Finish();
+				throw;
+			}
+		}, mappers->Size());
+
+		for (size_t i = 0; i < inbox.size(); i++) {
+			auto in = inbox[i];
+			_pool->Send([item, in, i, owners] {
+				try {
+					auto& shard = item->Output()->Shard(i);
+					in->Drain([&shard](Pair&& t) {
+						shard.insert(std::move(t));
+					});
+					owners->Finish();
+				}
+				catch (const std::exception&) {
+					owners->Finish();
+					throw;
+				}
+			});
+		}
+
+		_pool->Send([item, inbox, mappers, owners] {
+			mappers->Wait();
+			for (auto& q : inbox) {
+				q->Close();
+			}
+
+			owners->Wait();
+			item->Output()->Close();
+		});
+
+		return item;
+	}
+
+	template <typename F>
+	typename Bouncer::Ptr filter(F fn, size_t capacity) {
+		if (_pull) {
+			return filterLazy(fn);
+		}
+
+		typename Bouncer::Ptr item(new Bouncer(_out, queue<typename O::ValueType>(capacity, _out->Sizer()), _pool, _budget, _scaler, _source));
+
+		_pool->Send([item, fn] {
+			auto input = item->Input();
+			auto output = item->Output();
+
+			while (input->CanReceive()) {
+				try {
+					try {
+						auto val = input->Pop(500);
+						if (fn(val)) {
+							output->Push(std::move(val));
+						}
+					} catch (const ex::TimeoutQueueException&) {
+					} catch (const ex::EmptyQueueException&) {
+					}
+
+				}
+				catch (const ex::ClosedQueueException& ex) {
+					std::cerr << ex.what() << std::endl;
+				}
+			}
+			output->Close();
+		});
+
+		return item;
+	}
+
+	template <typename F>
+	typename Bouncer::Ptr filter(F fn, size_t s, size_t capacity) {
+		if (_pull) {
+			return filterLazy(fn);
+		}
+		if (s <= 1 && !_scaler) {
+			return filter(fn, capacity);
+		}
+
+		typename Bouncer::Ptr item(new Bouncer(_out, queue<typename O::ValueType>(capacity, _out->Sizer()), _pool, _budget, _scaler, _source));
+
+		auto output = item->Output();
+		if (scaled("filter", _out, s, [output, fn](typename O::ValueType&& val) {
+			if (fn(val)) {
+				output->Push(std::move(val));
+			}
+		}, output)) {
+			return item;
+		}
+
+		WaitGroup::Ptr wg(new WaitGroup(s));
+
+		_pool->Send([item, fn, wg] {
+			try {
+				auto input = item->Input();
+				auto output = item->Output();
+
+				try {
+					while (input->CanReceive()) {
+						try {
+							auto val = input->Pop(500);
+							if (fn(val)) {
+								output->Push(std::move(val));
+							}
+						} catch (const ex::TimeoutQueueException&) {
+						} catch (const ex::EmptyQueueException&) {
+						}
+					}
+				} catch (const ex::ClosedQueueException& ex) {
+					std::cerr << ex.what() << std::endl;
+				}
+				wg->Finish();
+			}
+			catch (const std::exception&) {
+				wg->Finish();
+				throw;
+			}
+		}, wg->Size());
+
+		_pool->Send([fn, item, wg] {
+			auto input = item->Input();
+			auto output = item->Output();
+
+			wg->Wait();
+
+			try {
+				while (input->CanReceive()) {
+					try {
+						auto val = input->Pop(500);
+						if (fn(val)) {
+							output->Push(std::move(val));
+						}
+					} catch (const ex::TimeoutQueueException&) {
+					} catch (const ex::EmptyQueueException&) {
+					}
+				}
+			} catch (const ex::ClosedQueueException& ex) {
+				std::cerr << ex.what() << std::endl;
+			}
+
+			output->Close();
+		});
+
+		return item;
+	}
+
+	template <typename _O, typename F>
+	typename _Collector<_O>::Ptr transform(F fn, size_t capacity) {
+		if (_pull) {
+			return transformLazy<_O>(fn);
+		}
+
+		typename _Collector<_O>::Ptr item(new _Collector<_O>(_out, queue<_O>(capacity), _pool, _budget, _scaler, _source));
+
+		_pool->Send([item, fn] {
+			auto input = item->Input();
+			auto output = item->Output();
+
+			_await(*input);
+
+			_consume(*input, [output, fn](typename O::Type&& v) {
+				output->Push(fn(std::move(v)));
+			});
+
+			item->Output()->Close();
+			item->Input()->Clear();
+
+		});
+		return item; 
+	}
+
+	template <typename _O, typename F>
+	typename _Collector<_O>::Ptr transform(F fn, size_t s, size_t capacity) {
+		if (_pull) {
+			return transformLazy<_O>(fn);
+		}
+		if (s <= 1 && !_scaler) {
+			return transform<_O>(fn, capacity);
+		}
+
+		typename _Collector<_O>::Ptr item(new _Collector<_O>(_out, queue<_O>(capacity), _pool, _budget, _scaler, _source));
+
+		auto output = item->Output();
+		if (scaled("transform", _out, s, [output, fn](typename O::Type&& v) {
+			output->Push(fn(std::move(v)));
+		}, output)) {
+			return item;
+		}
+
+		WaitGroup::Ptr wg(new WaitGroup(s));
+
+		_pool->Send([item, fn, wg] {
+			try {
+				auto input = item->Input();
+				auto output = item->Output();
+
+				_await(*input);
+
+				_consume(*input, [output, fn](typename O::Type&& v) {
+					output->Push(fn(std::move(v)));
+				});
+
+				wg->Finish();
+			}
+			catch (const std::exception& e) {
+				wg->Finish();
+				throw;
+			}
+		}, wg->Size());
+
+		_pool->Send([item, wg] {
+			wg->Wait();
+
+			item->Input()->Clear();
+			item->Output()->Close();
+		});
+
+		return item;
+	}
+
+	template <typename _O, typename F>
+	typename _Collector<_O>::Ptr flatMap(F fn, size_t s, size_t capacity, size_t batch) {
+		if (_pull) {
+			return flatMapLazy<_O>(fn);
+		}
+
+		typename _Collector<_O>::Ptr item(new _Collector<_O>(_out, queue<_O>(capacity), _pool, _budget, _scaler, _source));
+
+		// Emitters belong to one worker, so scaled workers do not batch.
+		auto output = item->Output();
+		if (scaled("flatmap", _out, s, [output, fn](typename O::Type&& v) {
+			Emitter<_O> emit(output);
+			fn(std::move(v), emit);
+		}, output)) {
+			return item;
+		}
+
+		WaitGroup::Ptr wg(new WaitGroup(std::max<size_t>(s, 1)));
+
+		_pool->Send([item, fn, batch, wg] {
+			try {
+				auto input = item->Input();
+				Emitter<_O> emit(item->Output(), batch);
+
+				_await(*input);
+				_consume(*input, [&emit, &fn](typename O::Type&& v) {
+					fn(std::move(v), emit);
+				});
+
+				emit.Flush();
+				wg->Finish();
+			}
+			catch (const std::exception&) {
+				wg->Finish();
+				throw;
+			}
+		}, wg->Size());
+
+		_pool->Send([item, wg] {
+			wg->Wait();
+			item->Output()->Close();
+		});
+
+		return item;
+	}
+
+	// Hands the input of an s worker stage to the autoscaler, which calls
+	// body on every element from a varying number of workers and closes out
+	// when the input is drained. Map inputs keep their fixed workers.
+	template <typename C, typename F, typename Out>
+	bool scaled(const std::string&, std::shared_ptr<C>, size_t, F, Out) {
+		return false;
+	}
+
+	template <typename T, typename F, typename Out>
+	bool scaled(const std::string& name, std::shared_ptr<SyncQueue<T>> input, size_t s, F body, Out out) {
+		if (!_scaler) {
+			return false;
+		}
+
+		auto pool = _pool;
+		auto send = [pool](const std::function<void()>& task) {
+			pool->Send(task);
+		};
+		auto run = [input, body](Autoscaler::Stage& stage) {
+			try {
+				while (input->CanReceive()) {
+					if (stage.Retire()) {
+						return true;
+					}
+
+					try {
+						body(input->Pop(500));
+						stage.Processed();
+					} catch (const ex::TimeoutQueueException&) {
+					} catch (const ex::EmptyQueueException&) {
+					}
+				}
+			} catch (const ex::ClosedQueueException&) {
+			}
+			return false;
+		};
+
+		_scaler->Register(name, input->Capacity(), [input] { return input->Size(); }, send, run, [out] { out->Close(); }, s);
+		return true;
+	}
+
+	Branches broadcast(size_t n, size_t capacity) {
+		materialize();
+
+		using T = typename O::Type;
+
+		Branches branches;
+		std::vector<typename SyncQueue<T>::Ptr> outputs;
+		for (size_t i = 0; i < n; i++) {
+			outputs.push_back(queue<T>(capacity));
+			branches.emplace_back(new _Collector<T>(_out, outputs.back(), _pool, _budget, _scaler, _source));
+		}
+
+		auto input = _out;
+		_pool->Send([input, outputs] {
+			try {
+				_await(*input);
+				_consume(*input, [&outputs](T&& v) {
+					// The last branch takes the element itself, the others a copy.
+					for (size_t i = 0; i + 1 < outputs.size(); i++) {
+						outputs[i]->Push(v);
+					}
+					if (!outputs.empty()) {
+						outputs.back()->Push(std::move(v));
+					}
+				});
+			}
+			catch (const std::exception&) {
+				for (auto& o : outputs) {
+					o->Close();
+				}
+				throw;
+			}
+
+			for (auto& o : outputs) {
+				o->Close();
+			}
+		});
+
+		return branches;
+	}
+
+	template <typename F>
+	Branches split(size_t n, F fn, size_t s, size_t capacity) {
+		materialize();
+
+		using T = typename O::Type;
+
+		Branches branches;
+		std::vector<typename SyncQueue<T>::Ptr> outputs;
+		for (size_t i = 0; i < std::max<size_t>(n, 1); i++) {
+			outputs.push_back(queue<T>(capacity));
+			branches.emplace_back(new _Collector<T>(_out, outputs.back(), _pool, _budget, _scaler, _source));
+		}
+
+		auto input = _out;
+		WaitGroup::Ptr wg(new WaitGroup(std::max<size_t>(s, 1)));
+
+		_pool->Send([input, outputs, fn, wg] {
+			try {
+				_await(*input);
+				_consume(*input, [&outputs, &fn](T&& v) {
+					size_t i = size_t(fn(v)) % outputs.size();
+					outputs[i]->Push(std::move(v));
+				});
+				wg->Finish();
+			}
+			catch (const std::exception&) {
+				wg->Finish();
+				throw;
+			}
+		}, wg->Size());
+
+		_pool->Send([outputs, wg] {
+			wg->Wait();
+			for (auto& o : outputs) {
+				o->Close();
+			}
+		});
+
+		return branches;
+	}
+
+	typename _Collector<typename O::Type>::Ptr merged(WaitGroup::Ptr wg) {
+		materialize();
+
+		using T = typename O::Type;
+
+		typename _Collector<T>::Ptr item(new _Collector<T>(_out, queue<T>(SyncQueue<T>::DefaultCapacity), _pool, _budget, _scaler, _source));
+
+		_pool->Send([item, wg] {
+			wg->Wait();
+			item->Output()->Close();
+		});
+
+		return item;
+	}
+
+	// Moves everything from src straight into the merged output.
+	template <typename Src>
+	void pump(typename _Collector<typename O::Type>::Ptr item, WaitGroup::Ptr wg, std::shared_ptr<Src> src) {
+		auto output = item->Output();
+
+		_pool->Send([src, output, wg] {
+			try {
+				_await(*src);
+				_consume(*src, [&output](typename Src::Type&& v) {
+					output->Push(std::move(v));
+				});
+				wg->Finish();
+			}
+			catch (const std::exception&) {
+				wg->Finish();
+				throw;
+			}
+		});
+	}
+
+	template <typename Storage, typename Out, typename Consume, typename F>
+	typename Partitioner<Out>::Ptr partition(F fn, size_t capacity) {
+		typename Partitioner<Out>::Ptr item(new Partitioner<Out>(_out, queue<Out>(capacity), _pool, _budget, _scaler, _source));
+
+		_pool->Send([item, fn] {
+			auto input = item->Input();
+			input->Wait();
+
+			auto output = item->Output();
+
+			std::function<void(const typename O::KeyType&, std::shared_ptr<Storage>)> f = [output, fn](const auto& k, auto s) {
+				output->Push(fn(k, s));
+			};
+
+			_gather<Storage>(input, f, Consume());
+			output->Close();
+
+		});
+		return item;
+	}
+
+	template <typename Storage, typename Out, typename Consume, typename F>
+	typename Partitioner<Out>::Ptr partitionMT(F fn, size_t capacity) {
+		typename Partitioner<Out>::Ptr item(new Partitioner<Out>(_out, queue<Out>(capacity), _pool, _budget, _scaler, _source));
+
+		auto p = _pool;
+		_pool->Send([p, item, fn] {
+			auto input = item->Input();
+			input->Wait();
+
+			auto output = item->Output();
+			WaitGroup::Ptr group(new WaitGroup(0));
+
+			std::function<void(const typename O::KeyType&, std::shared_ptr<Storage>)> f = [output, fn](const auto& k, auto s) {
+				output->Push(fn(k, s));
+			};
+
+			_scatter<Storage>(input, p, group, f, Consume());
+			p->Send([group, output] {
+				group->Wait();
+				output->Close();
+			});
+
+		});
+		return item;
+	}
+
+	template <typename Out, typename Key, typename _B, typename PK, typename BK, typename F>
+	typename _Collector<Out>::Ptr join(std::shared_ptr<_B> build, PK probeKey, BK buildKey, F fn, bool left, size_t s, size_t capacity) {
+		materialize();
+
+		using Table = _ShardedMap<std::unordered_multimap<Key, typename _B::Type>>;
+		using Pair = typename Table::Type;
+
+		s = std::max<size_t>(s, 1);
+		typename Table::Ptr table(new Table(s));
+		typename _Collector<Out>::Ptr item(new _Collector<Out>(_out, queue<Out>(capacity), _pool, _budget, _scaler, _source));
+
+		std::vector<typename SyncQueue<Pair>::Ptr> inbox;
+		for (size_t i = 0; i < table->Shards(); i++) {
+			inbox.push_back(queue<Pair>(capacity));
+		}
+
+		WaitGroup::Ptr builders(new WaitGroup(s));
+		WaitGroup::Ptr owners(new WaitGroup(inbox.size()));
+		WaitGroup::Ptr probers(new WaitGroup(s));
+
+		_pool->Send([build, buildKey, table, inbox, builders] {
+			try {
+				_await(*build);
+				_consume(*build, [&buildKey, &table, &inbox](typename _B::Type&& v) {
+					Key k = buildKey(v);
+					size_t i = table->ShardOf(k);
+					inbox[i]->Push(Pair(std::move(k), std::move(v)));
+				});
+				builders->Finish();
+			}
+			catch (const std::exception&) {
+				builders->Finish();
+				throw;
+			}
+		}, builders->Size());
+
+		for (size_t i = 0; i < inbox.size(); i++) {
+			auto in = inbox[i];
+			_pool->Send([table, in, i, owners] {
+				try {
+					auto& shard = table->Shard(i);
+					in->Drain([&shard](Pair&& t) {
+						shard.insert(std::move(t));
+					});
+					owners->Finish();
+				}
+				catch (const std::exception&) {
+					owners->Finish();
+					throw;
+				}
+			});
+		}
+
+		_pool->Send([table, inbox, builders, owners] {
+			builders->Wait();
+			for (auto& q : inbox) {
+				q->Close();
+			}
+
+			owners->Wait();
+			table->Close();
+		});
+
+		_pool->Send([item, table, probeKey, fn, left, probers] {
+			try {
+				auto input = item->Input();
+				auto output = item->Output();
+
+				table->Wait();
+				_await(*input);
+
+				const Table& t = *table;
+				_consume(*input, [&t, &probeKey, &fn, left, &output](typename O::Type&& v) {
+					Key k = probeKey(v);
+					const auto& shard = t.Shard(t.ShardOf(k));
+
+					auto range = shard.equal_range(k);
+					if (range.first == range.second) {
+						if (left) {
+							output->Push(fn(v, nullptr));
+						}
+						return;
+					}
+
+					for (auto it = range.first; it != range.second; ++it) {
+						output->Push(fn(v, &it->second));
+					}
+				});
+				probers->Finish();
+			}
+			catch (const std::exception&) {
+				probers->Finish();
+				throw;
+			}
+		}, probers->Size());
+
+		_pool->Send([item, probers] {
+			probers->Wait();
+			item->Output()->Close();
+		});
+
+		return item;
+	}
+
+	template <typename C>
+	typename _Collector<typename O::Type>::Ptr sort(C cmp, size_t memory, size_t s, size_t capacity) {
+		materialize();
+
+		using T = typename O::Type;
+		using Run = std::vector<T>;
+
+		struct Runs {
+			std::mutex mutex;
+			std::vector<std::shared_ptr<Run>> memory;
+			std::vector<typename SpillFile<T>::Ptr> files;
+		};
+
+		s = std::max<size_t>(s, 1);
+		typename _Collector<T>::Ptr item(new _Collector<T>(_out, queue<T>(capacity), _pool, _budget, _scaler, _source));
+
+		std::shared_ptr<Runs> runs(new Runs());
+		WaitGroup::Ptr wg(new WaitGroup(s));
+
+		size_t limit = std::max<size_t>(memory / s, 1);
+		auto sizer = _sizer(*_out);
+
+		_pool->Send([item, cmp, limit, sizer, runs, wg] {
+			try {
+				auto input = item->Input();
+
+				std::shared_ptr<Run> run(new Run());
+				size_t bytes = 0;
+
+				_await(*input);
+				_consume(*input, [&](T&& v) {
+					bytes += sizer(v);
+					run->push_back(std::move(v));
+					if (bytes < limit) {
+						return;
+					}
+
+					std::sort(run->begin(), run->end(), cmp);
+					typename SpillFile<T>::Ptr file(new SpillFile<T>());
+					for (const auto& e : *run) {
+						file->Write(e);
+					}
+					file->Rewind();
+
+					run->clear();
+					bytes = 0;
+
+					std::vector<typename SpillFile<T>::Ptr> full;
+					{
+						std::unique_lock<std::mutex> lock(runs->mutex);
+						runs->files.push_back(file);
+						if (runs->files.size() >= SpillFile<T>::FanIn) {
+							full.swap(runs->files);
+						}
+					}
+					if (!full.empty()) {
+						file = SpillFile<T>::Merge(full, cmp);
+						full.clear();
+
+						std::unique_lock<std::mutex> lock(runs->mutex);
+						runs->files.push_back(file);
+					}
+				});
+
+				std::sort(run->begin(), run->end(), cmp);
+				{
+					std::unique_lock<std::mutex> lock(runs->mutex);
+					runs->memory.push_back(run);
 				}
 				wg->Finish();
 			}
@@ -98,87 +1425,121 @@ public:
 			}
 		}, wg->Size());
 
-		_pool->Send([fn, item, wg] {
-			auto input = item->Input();
-			auto output = item->Output();
-
+		_pool->Send([item, cmp, runs, wg] {
 			wg->Wait();
 
+			auto output = item->Output();
 			try {
-				while (input->CanReceive()) {
-					try {
-						auto ret = fn(input->Pop(500));
-						output->Insert(ret.first, ret.second);
-					} catch (const ex::TimeoutQueueException&) {
-					} catch (const ex::EmptyQueueException&) {
-					}
+				// Runs merged while workers finished may leave a few too many.
+				auto& files = runs->files;
+				while (files.size() > SpillFile<T>::FanIn) {
+					std::vector<typename SpillFile<T>::Ptr> group(files.end() - SpillFile<T>::FanIn, files.end());
+					files.resize(files.size() - SpillFile<T>::FanIn);
+					files.push_back(SpillFile<T>::Merge(group, cmp));
 				}
-			} catch (const ex::ClosedQueueException& ex) {
-				std::cerr << ex.what() << std::endl;
-			} 
 
-			output->Close();
-		});
+				// Heads of runs [0, memory) come from memory, the rest from files.
+				struct Head {
+					T value;
+					size_t run;
+				};
+
+				const size_t inMemory = runs->memory.size();
+				std::vector<size_t> next(inMemory, 0);
+
+				auto pull = [&](size_t r, std::vector<Head>& heads) {
+					if (r < inMemory) {
+						auto& run = *runs->memory[r];
+						if (next[r] < run.size()) {
+							heads.push_back(Head{ std::move(run[next[r]++]), r });
+							return true;
+						}
+						return false;
+					}
 
-		return item;
-	}
+					T v;
+					if (runs->files[r - inMemory]->Read(v)) {
+						heads.push_back(Head{ std::move(v), r });
+						return true;
+					}
+					return false;
+				};
 
-	using Bouncer = _StreamItem<SyncQueue<typename O::ValueType>, SyncQueue<typename O::ValueType>>;
+				auto later = [&cmp](const Head& a, const Head& b) {
+					return cmp(b.value, a.value);
+				};
 
-	typename Bouncer::Ptr Filter(const std::function<bool(typename O::ValueType)>& fn) {
-		typename Bouncer::Ptr item(new Bouncer(_out, _pool));
+				std::vector<Head> heads;
+				for (size_t r = 0; r < inMemory + runs->files.size(); r++) {
+					if (pull(r, heads)) {
+						std::push_heap(heads.begin(), heads.end(), later);
+					}
+				}
 
-		_pool->Send([item, fn] {
-			auto input = item->Input();
-			auto output = item->Output();
+				while (!heads.empty()) {
+					std::pop_heap(heads.begin(), heads.end(), later);
+					Head h = std::move(heads.back());
+					heads.pop_back();
 
-			while (input->CanReceive()) {
-				try {
-					try {
-						auto val = input->Pop(500);
-						auto ret = fn(val);
-						if (ret) {
-							output->Push(val);
-						}
-					} catch (const ex::TimeoutQueueException&) {
-					} catch (const ex::EmptyQueueException&) {
+					output->Push(std::move(h.value));
+					if (pull(h.run, heads)) {
+						std::push_heap(heads.begin(), heads.end(), later);
 					}
-
-				}
-				catch (const ex::ClosedQueueException& ex) {
-					std::cerr << ex.what() << std::endl;
 				}
 			}
+			catch (const std::exception&) {
+				output->Close();
+				throw;
+			}
+
+			runs->memory.clear();
+			runs->files.clear();
 			output->Close();
 		});
 
 		return item;
 	}
 
-	typename Bouncer::Ptr Filter(const std::function<bool(typename O::ValueType)>& fn, size_t s) {
-		typename Bouncer::Ptr item(new Bouncer(_out, _pool));
+	template <typename C>
+	typename _Collector<typename O::Type>::Ptr topK(size_t k, C cmp, size_t s) {
+		materialize();
+
+		using T = typename O::Type;
+
+		struct Best {
+			std::mutex mutex;
+			std::vector<T> values;
+		};
 
+		s = std::max<size_t>(s, 1);
+		typename _Collector<T>::Ptr item(new _Collector<T>(_out, queue<T>(std::max<size_t>(k, 1)), _pool, _budget, _scaler, _source));
+
+		std::shared_ptr<Best> best(new Best());
 		WaitGroup::Ptr wg(new WaitGroup(s));
 
-		_pool->Send([item, fn, wg] {
+		_pool->Send([item, k, cmp, best, wg] {
 			try {
 				auto input = item->Input();
-				auto output = item->Output();
 
-				try {
-					while (input->CanReceive()) {
-						try {
-							auto val = input->Pop(500);
-							auto ret = fn(val);
-							if (ret) {
-								output->Push(val);
-							}
-						} catch (const ex::TimeoutQueueException&) {
-						} catch (const ex::EmptyQueueException&) {
-						}
+				// Heap ordered by cmp, its front is the worst element kept.
+				std::vector<T> heap;
+				heap.reserve(k);
+
+				_await(*input);
+				_consume(*input, [&](T&& v) {
+					if (heap.size() < k) {
+						heap.push_back(std::move(v));
+						std::push_heap(heap.begin(), heap.end(), cmp);
+					} else if (k && cmp(v, heap.front())) {
+						std::pop_heap(heap.begin(), heap.end(), cmp);
+						heap.back() = std::move(v);
+						std::push_heap(heap.begin(), heap.end(), cmp);
 					}
-				} catch (const ex::ClosedQueueException& ex) {
-					std::cerr << ex.what() << std::endl;
+				});
+
+				{
+					std::unique_lock<std::mutex> lock(best->mutex);
+					std::move(heap.begin(), heap.end(), std::back_inserter(best->values));
 				}
 				wg->Finish();
 			}
@@ -188,210 +1549,437 @@ public:
 			}
 		}, wg->Size());
 
-		_pool->Send([fn, item, wg] {
-			auto input = item->Input();
-			auto output = item->Output();
-
+		_pool->Send([item, k, cmp, best, wg] {
 			wg->Wait();
 
-			try {
-				while (input->CanReceive()) {
-					try {
-						auto val = input->Pop(500);
-						auto ret = fn(val);
-						if (ret) {
-							output->Push(val);
-						}
-					} catch (const ex::TimeoutQueueException&) {
-					} catch (const ex::EmptyQueueException&) {
-					}
-				}
-			} catch (const ex::ClosedQueueException& ex) {
-				std::cerr << ex.what() << std::endl;
+			auto& values = best->values;
+			std::sort(values.begin(), values.end(), cmp);
+			if (values.size() > k) {
+				values.resize(k);
 			}
 
+			auto output = item->Output();
+			for (auto& v : values) {
+				output->Push(std::move(v));
+			}
+			values.clear();
 			output->Close();
 		});
 
 		return item;
 	}
 
-	template <typename _O>
-	using _Collector = _StreamItem<O, SyncQueue<_O>>;
+	template <typename S, typename F>
+	S sketch(const S& proto, F fn, size_t s) {
+		if (_pull) {
+			S local(proto);
+			while (auto v = _pull()) {
+				fn(*v, local);
+			}
+			discard();
+			return local;
+		}
 
-	template <typename _O >
-	typename _Collector<_O>::Ptr Transform(const std::function < _O(const typename O::Type&) > & fn) {
-		typename _Collector<_O>::Ptr item(new _Collector<_O>(_out, _pool));
+		struct Parts {
+			std::mutex mutex;
+			std::vector<S> done;
+		};
 
-		_pool->Send([item, fn] {
-			auto input = item->Input();
-			auto output = item->Output();
+		std::shared_ptr<Parts> parts(new Parts());
+		WaitGroup::Ptr wg(new WaitGroup(std::max<size_t>(s, 1)));
 
-			input->Wait();
+		auto output = _out;
+		_pool->Send([output, proto, fn, parts, wg] {
+			try {
+				S local(proto);
+
+				_await(*output);
+				_consume(*output, [&local, &fn](typename O::Type&& v) {
+					fn(v, local);
+				});
+
+				{
+					std::unique_lock<std::mutex> lock(parts->mutex);
+					parts->done.push_back(std::move(local));
+				}
+				wg->Finish();
+			}
+			catch (const std::exception&) {
+				wg->Finish();
+				throw;
+			}
+		}, wg->Size());
+
+		wg->Wait();
+
+		S merged(proto);
+		for (const auto& p : parts->done) {
+			merged.Merge(p);
+		}
+		return merged;
+	}
+
+	template <typename _O, typename F>
+	_O reduce(const F& fn) {
+		if (_pull) {
+			_O o = _O();
+			while (auto v = _pull()) {
+				fn(*v, o);
+			}
+			discard();
+			return o;
+		}
+
+		std::promise<_O> promise;
+		auto result = promise.get_future();
 
-			input->ForEach([output, item, fn](const typename O::Type& v) {
-				auto o = fn(v);
-				output->Push(o);
+		_pool->Send([this, &promise, &fn] {
+			_await(*Output());
+			_O o = _O();
+			_consume(*Output(), [&o, &fn](typename O::Type&& v) {
+				fn(v, o);
 			});
 
-			item->Output()->Close();
-			item->Input()->Clear();
+			promise.set_value(o);
+		});
 
+		return std::move(result.get());
+	}
+
+	template <typename F>
+	void forEach(const F& fn) {
+		if (_pull) {
+			while (auto v = _pull()) {
+				fn(*v);
+			}
+			discard();
+			return;
+		}
+
+		_await(*Output());
+		_consume(*Output(), [&fn](typename O::Type&& v) {
+			fn(v);
 		});
-		return item; 
 	}
 
+	template <typename F>
+	size_t writeTo(const std::string& path, F fn, size_t s, size_t buffer) {
+		materialize();
 
-	template <typename _O >
-	typename _Collector<_O>::Ptr Transform(const std::function < _O(const typename O::Type&) > & fn, size_t s) {
-		typename _Collector<_O>::Ptr item(new _Collector<_O>(_out, _pool));
+		typedef FileSink::Buffer Buffer;
 
-		WaitGroup::Ptr wg(new WaitGroup(s));
+		FileSink::Ptr sink(new FileSink(path));
 
-		_pool->Send([item, fn, wg] {
-			try {
-				auto input = item->Input();
-				auto output = item->Output();
+		s = std::max<size_t>(s, 1);
+		typename SyncQueue<Buffer>::Ptr full(new SyncQueue<Buffer>(2 * s));
+		typename SyncQueue<Buffer>::Ptr spare(new SyncQueue<Buffer>(2 * s));
+		for (size_t i = 0; i < 2 * s; i++) {
+			Buffer b(new std::string());
+			b->reserve(buffer);
+			spare->Push(b);
+		}
+
+		auto output = _out;
+		WaitGroup::Ptr wg(new WaitGroup(s));
 
-				input->Wait();
+		// First exception of a worker. The pool swallows what its tasks
+		// throw, so it goes back to the caller through the promise.
+		std::shared_ptr<std::exception_ptr> failure(new std::exception_ptr());
+		std::shared_ptr<std::atomic<bool>> failed(new std::atomic<bool>(false));
+		auto fail = [failure, failed](std::exception_ptr e) {
+			bool expected = false;
+			if (failed->compare_exchange_strong(expected, true)) {
+				*failure = e;
+			}
+		};
 
-				input->ForEach([output, item, fn] (const typename O::Type& v) {
-					auto o = fn(v);
-					output->Push(o);
+		_pool->Send([output, fn, full, spare, wg, buffer, failed, fail] {
+			try {
+				Buffer b = spare->Pop();
+
+				_await(*output);
+				// After a failure the output is still drained, so upstream
+				// stages are not left blocked on it.
+				_consume(*output, [&fn, &b, full, spare, buffer, failed, fail](typename O::Type&& v) {
+					if (failed->load()) {
+						return;
+					}
+					try {
+						fn(v, *b);
+					} catch (...) {
+						fail(std::current_exception());
+						return;
+					}
+					if (b->size() >= buffer) {
+						full->Push(b);
+						b = spare->Pop();
+					}
 				});
 
+				full->Push(b);
 				wg->Finish();
 			}
-			catch (const std::exception& e) {
+			catch (const std::exception&) {
+				fail(std::current_exception());
 				wg->Finish();
 				throw;
 			}
 		}, wg->Size());
 
-		_pool->Send([item, wg] {
+		_pool->Send([full, wg] {
 			wg->Wait();
-
-			item->Input()->Clear();
-			item->Output()->Close();
+			full->Close();
 		});
 
-		return item;
-	}
+		std::promise<size_t> promise;
+		auto result = promise.get_future();
 
-	template <typename Out>
-	using Partitioner = _StreamItem<O, SyncQueue<Out>>;
+		_pool->Send([sink, full, spare, failure, failed, &promise] {
+			std::exception_ptr error;
+			std::vector<Buffer> batch;
 
-	template <typename Storage, typename Out>
-	typename Partitioner<Out>::Ptr Partition(const std::function<Out (const typename O::KeyType&, std::shared_ptr<Storage>)>& fn) {
-		typename Partitioner<Out>::Ptr item(new Partitioner<Out>(_out, _pool));
+			full->Drain([&error, &batch, sink, full, spare, failed](Buffer&& b) {
+				batch.push_back(std::move(b));
+				while (!full->IsEmpty()) {
+					batch.push_back(full->Pop());
+				}
 
-		_pool->Send([item, fn] {
-			auto input = item->Input();
-			input->Wait();
+				// After a failure keep recycling, so workers do not stall.
+				if (!error && !failed->load()) {
+					try {
+						sink->Write(batch);
+					} catch (...) {
+						error = std::current_exception();
+					}
+				}
 
-			auto output = item->Output();
+				for (auto& r : batch) {
+					r->clear();
+					spare->Push(r);
+				}
+				batch.clear();
+			});
 
-			std::function<void(const typename O::KeyType&, std::shared_ptr<Storage>)> f = [output, fn](const auto& k, auto s) {
-				output->Push(std::move(fn(k, s)));
-			};
+			sink->Close();
+			// The workers are done: wg was waited before full was closed.
+			if (failed->load()) {
+				error = *failure;
+			}
+			if (error) {
+				promise.set_exception(error);
+			} else {
+				promise.set_value(sink->Written());
+			}
+		});
 
-			input->Aggregate(f);
-			output->Close();
+		return result.get();
+	}
 
-		});
+	// Stage pulling from p instead of from a queue.
+	template <typename _O>
+	typename _Collector<_O>::Ptr lazy(const std::function<_O*()>& p) {
+		typename _Collector<_O>::Ptr item(new _Collector<_O>(_out, typename SyncQueue<_O>::Ptr(new SyncQueue<_O>()), _pool, _budget, _scaler, _source));
+		item->_pull = p;
 		return item;
 	}
 
-	template <typename Storage, typename Out>
-	typename Partitioner<Out>::Ptr PartitionMT(const std::function<Out(const typename O::KeyType&, std::shared_ptr<Storage>)>& fn) {
-		typename Partitioner<Out>::Ptr item(new Partitioner<Out>(_out, _pool));
+	template <typename F>
+	typename _Collector<typename O::Type>::Ptr filterLazy(F fn) {
+		using T = typename O::Type;
 
-		auto p = _pool;
-		_pool->Send([p, item, fn] {
-			auto input = item->Input();
-			input->Wait();
+		auto src = _pull;
+		return lazy<T>([src, fn]() -> T* {
+			while (T* v = src()) {
+				if (fn(*v)) {
+					return v;
+				}
+			}
+			return nullptr;
+		});
+	}
 
-			auto output = item->Output();
-			WaitGroup::Ptr group(new WaitGroup(0));
+	// Pulled outputs live in a slot owned by the stage until the next pull.
+	template <typename _O, typename F>
+	typename _Collector<_O>::Ptr transformLazy(F fn) {
+		auto src = _pull;
+		std::shared_ptr<std::vector<_O>> slot(new std::vector<_O>());
 
-			std::function<void(const typename O::KeyType&, std::shared_ptr<Storage>)> f = [group, output, fn](const auto& k, auto s) {
-				output->Push(fn(k, s));
-				group->Finish();
-			};
+		return lazy<_O>([src, fn, slot]() -> _O* {
+			auto v = src();
+			if (!v) {
+				return nullptr;
+			}
 
-			std::function<void(const typename O::KeyType&, std::shared_ptr<Storage>)> main = [group, p, f](const auto& k, auto s) {
-				group->Add();
+			slot->clear();
+			slot->push_back(fn(std::move(*v)));
+			return &slot->back();
+		});
+	}
 
-				auto fun = std::bind(f, k, s);
-				p->Send(fun);
-			};
+	template <typename _O, typename F>
+	typename _Collector<_O>::Ptr flatMapLazy(F fn) {
+		struct Pending {
+			std::vector<_O> values;
+			size_t next = 0;
+		};
 
-			input->Aggregate(main);
-			p->Send([group, output] {
-				group->Wait();
-				output->Close();
-			});
+		auto src = _pull;
+		std::shared_ptr<Pending> pending(new Pending());
+
+		return lazy<_O>([src, fn, pending]() -> _O* {
+			while (pending->next == pending->values.size()) {
+				pending->values.clear();
+				pending->next = 0;
 
+				auto v = src();
+				if (!v) {
+					return nullptr;
+				}
+
+				Emitter<_O> emit(&pending->values);
+				fn(std::move(*v), emit);
+			}
+			return &pending->values[pending->next++];
 		});
-		return item;
 	}
 
+	template <typename Iter>
+	void pull(Iter begin, Iter end) {
+		using T = typename O::Type;
+
+		struct Source {
+			Iter it;
+			Iter end;
+			std::vector<T> slot;
+		};
+
+		std::shared_ptr<Source> src(new Source{ begin, end, std::vector<T>() });
+		_pull = [src]() -> T* {
+			if (src->it == src->end) {
+				return nullptr;
+			}
 
-	template <typename _O>
-	_O Reduce(const std::function<void (const typename O::Type&, _O&)>& fn) {
-		std::promise<_O> promise;
-		auto result = promise.get_future();
+			src->slot.clear();
+			src->slot.push_back(*src->it);
+			++src->it;
+			return &src->slot.back();
+		};
+	}
 
-		_pool->Send([this, &promise, &fn] {
-			Output()->Wait();
-			_O o = _O();
-			Output()->ForEach([&o, &fn] (const typename O::Type& pair) {
-				fn(pair, o);
-			});
+	// Hands a pulled stage over to the pool, for stages reading its queue.
+	void materialize() {
+		if (!_pull) {
+			return;
+		}
 
-			promise.set_value(o);
+		auto p = std::move(_pull);
+		auto out = _out;
+		_pull = nullptr;
+
+		_pool->Send([p, out] {
+			_fill(out, p);
 		});
+	}
 
-		return std::move(result.get());
+	// A pulled stage nobody consumed only needs its queue closed.
+	void discard() {
+		if (_pull) {
+			_pull = nullptr;
+			_out->Close();
+		}
 	}
 
-	void Close() {
-		_out->Wait();
-		_pool->Close();
+	template <typename _O>
+	typename SyncQueue<_O>::Ptr queue(size_t capacity, const typename SyncQueue<_O>::SizeFunc& sizer = nullptr) const {
+		typename SyncQueue<_O>::Ptr q(new SyncQueue<_O>(capacity));
+		if (_budget) {
+			q->Limit(_budget, sizer, false);
+		}
+		return q;
 	}
 
-	void Wait() {
-		_out->WaitForEmpty();
-		_pool->Close();
+	template <typename Iter>
+	void feed(Iter begin, Iter end) {
+		auto in = _in;
+		_pool->Send([in, begin, end] {
+			stream(in, begin, end);
+		});
 	}
 
-	template <typename C>
-	void Stream(const C& c) {
-		for (const auto& item : c) {
-			_in->Push(item);
-		}
-		_in->Close();
+	template <typename Iter>
+	void feedRanges(Iter begin, Iter end, size_t n) {
+		typedef typename std::iterator_traits<Iter>::iterator_category Category;
+		feedRanges(begin, end, n, typename std::is_base_of<std::random_access_iterator_tag, Category>::type());
 	}
 
 	template <typename Iter>
-	void Stream(Iter b, Iter e) {
-		for (; b != e; b++) {
-			_in->Push(*b);
+	void feedRanges(Iter begin, Iter end, size_t, std::false_type) {
+		feed(begin, end);
+	}
+
+	// Random access sources are cut in up to n ranges pushed concurrently,
+	// so elements of different ranges reach the input queue interleaved.
+	template <typename Iter>
+	void feedRanges(Iter begin, Iter end, size_t n, std::true_type) {
+		const size_t grain = 1 << 14;
+
+		size_t size = std::distance(begin, end);
+		size_t ranges = std::min(n, size / grain);
+		if (ranges < 2) {
+			feed(begin, end);
+			return;
+		}
+
+		auto in = _in;
+		WaitGroup::Ptr wg(new WaitGroup(ranges));
+
+		for (size_t i = 0; i < ranges; i++) {
+			Iter b = begin + size * i / ranges;
+			Iter e = begin + size * (i + 1) / ranges;
+
+			_pool->Send([in, b, e, wg] {
+				try {
+					for (Iter it = b; it != e; ++it) {
+						in->Push(*it);
+					}
+					wg->Finish();
+				}
+				catch (const std::exception&) {
+					wg->Finish();
+					throw;
+				}
+			});
 		}
-		_in->Close();
+
+		_pool->Send([in, wg] {
+			wg->Wait();
+			in->Close();
+		});
 	}
 
-	void ForEach(const std::function<void(const typename O::Type&)>& fn) {
-		Output()->Wait();
-		Output()->ForEach(fn);
+	template <typename Iter>
+	static void stream(typename I::Ptr in, Iter b, Iter e) {
+		for (; b != e; ++b) {
+			in->Push(*b);
+		}
+		in->Close();
 	}
 
-private:
 	typename Pool<void>::Ptr _pool;
 
 	typename I::Ptr _in;
 	typename O::Ptr _out;
 
+	MemoryBudget::Ptr _budget;
+	Autoscaler::Ptr _scaler;
+	std::shared_ptr<void> _source;
+
+	// Set while this stage is evaluated on demand, see Lazy.
+	std::function<typename O::Type*()> _pull;
+
+	template <typename, typename>
+	friend class _StreamItem;
+
 	_StreamItem(_StreamItem const&) = delete;
 	_StreamItem& operator=(_StreamItem const&) = delete;
 };
@@ -405,6 +1993,12 @@ using Bouncer = _StreamItem<SyncQueue<_I>, SyncQueue<_I>>;
 
 template <typename _I, typename _O>
 using Reducer = _StreamItem<SyncQueue<_I>, _O>;
+
+#if defined(__unix__) || defined(__APPLE__)
+// Stream reading a ShmQueue filled by another process.
+template <typename _I>
+using ShmStreamer = _StreamItem<ShmQueue<_I>, ShmQueue<_I>>;
+#endif
 }
 
 #endif
@@ -0,0 +1,107 @@
+#include "catch.hpp"
+
+#include "columnar.hpp"
+#include "stream.hpp"
+
+#include <cmath>
+#include <numeric>
+#include <iostream>
+
+TEST_CASE("TestColumnarKernels") {
+	std::cout << "TestColumnarKernels -> " << std::endl;
+	using namespace concurrent;
+
+	std::vector<double> d;
+	std::vector<int64_t> l;
+	for (int i = 0; i < 1003; i++) {
+		d.push_back((i * 37) % 101 - 50.5);
+		l.push_back((i * 37) % 101 - 50);
+	}
+
+	const Cmp ops[] = { Cmp::Less, Cmp::LessEqual, Cmp::Greater, Cmp::GreaterEqual, Cmp::Equal, Cmp::NotEqual };
+	auto test = [](Cmp op, double x, double v) {
+		switch (op) {
+		case Cmp::Less: return x < v;
+		case Cmp::LessEqual: return x <= v;
+		case Cmp::Greater: return x > v;
+		case Cmp::GreaterEqual: return x >= v;
+		case Cmp::Equal: return x == v;
+		default: return x != v;
+		}
+	};
+
+	// Every level the CPU has must match the scalar loops.
+	for (auto level : { simd::Level::Scalar, simd::Level::SSE2, simd::Level::AVX2 }) {
+		simd::Use(level);
+
+		for (auto op : ops) {
+			std::vector<uint32_t> sel(d.size()), expected;
+			for (uint32_t i = 0; i < d.size(); i++) {
+				if (test(op, d[i], 0.5)) {
+					expected.push_back(i);
+				}
+			}
+			sel.resize(simd::Select(d.data(), d.size(), op, 0.5, sel.data()));
+			REQUIRE(sel == expected);
+
+			expected.clear();
+			for (uint32_t i = 0; i < l.size(); i++) {
+				if (test(op, double(l[i]), 7.0)) {
+					expected.push_back(i);
+				}
+			}
+			sel.resize(l.size());
+			sel.resize(simd::Select(l.data(), l.size(), op, int64_t(7), sel.data()));
+			REQUIRE(sel == expected);
+		}
+
+		double sum, lo, hi;
+		simd::Fold(d.data(), d.size(), sum, lo, hi);
+		REQUIRE(std::abs(sum - std::accumulate(d.begin(), d.end(), 0.0)) < 1e-6);
+		REQUIRE(lo == -50.5);
+		REQUIRE(hi == 49.5);
+
+		int64_t lsum, llo, lhi;
+		simd::Fold(l.data(), l.size(), lsum, llo, lhi);
+		REQUIRE(lsum == std::accumulate(l.begin(), l.end(), int64_t(0)));
+		REQUIRE(llo == -50);
+		REQUIRE(lhi == 50);
+
+		std::vector<double> out(d.size());
+		simd::Affine(d.data(), d.size(), 2.0, 1.0, out.data());
+		REQUIRE(out[1002] == d[1002] * 2.0 + 1.0);
+		REQUIRE(out[3] == d[3] * 2.0 + 1.0);
+	}
+	simd::Use(simd::Detected());
+
+	std::cout << "<- TestColumnarKernels" << std::endl;
+}
+
+TEST_CASE("TestColumnarStream") {
+	std::cout << "TestColumnarStream -> " << std::endl;
+	using namespace concurrent;
+
+	std::vector<double> values;
+	for (int i = 0; i < 100000; i++) {
+		values.push_back(i % 1000);
+	}
+
+	auto batches = Batch<double>::Split(values.begin(), values.end(), 4096);
+	REQUIRE(batches.size() == 25);
+
+	Streamer<Batch<double>> item(batches.begin(), batches.end());
+	auto selected = item.Transform([](Batch<double>&& b) {
+		b.Where(Cmp::GreaterEqual, 500).Affine(2, 0);
+		return std::move(b);
+	}, 2);
+
+	auto total = selected->Reduce<double>([](const Batch<double>& b, double& t) {
+		t += b.Sum();
+	});
+
+	// 100 times every value in [500, 1000), doubled.
+	REQUIRE(total == 100 * 2 * (500.0 + 999.0) * 500 / 2);
+	selected->Close();
+
+	std::cout << "<- TestColumnarStream" << std::endl;
+}
@@ -120,6 +120,9 @@ TEST_CASE("TestFiberQueue") {
 		concurrent::ChannelStatus status = concurrent::ChannelStatus::empty;
 		while (status != concurrent::ChannelStatus::closed) {
 			status = chan.try_pop(i);
+			if (status == concurrent::ChannelStatus::empty) {
+				concurrent::yield();
+			}
 		}
 		std::cout << "Quit receive" << std::endl;
 	});
@@ -153,5 +156,53 @@ TEST_CASE("TestFiberQueue") {
 	std::cout << "<- TestFiberQueue" << std::endl;
 }
 
+TEST_CASE("TestFiberStream") {
+	std::cout << "TestFiberStream -> " << std::endl;
+	using namespace concurrent;
+
+	FiberScheduler::Ptr fibers(new FiberScheduler(2));
+
+	std::vector<int> input;
+	for (int i = 0; i < 10000; i++) {
+		input.push_back(i);
+	}
+
+	FiberStream<int>::Ptr item(new FiberStream<int>(input.begin(), input.end(), fibers, 64));
+	auto even = item->Filter([](const int& v) {
+		return v % 2 == 0;
+	}, 4, 64);
+
+	// 100 stages of 4 fibers each, all on 2 threads.
+	auto last = even;
+	for (int i = 0; i < 100; i++) {
+		last = last->Transform<int>([](int&& v) {
+			return v + 1;
+		}, 4, 64);
+	}
+
+	auto total = last->Reduce<long long>([](const int& v, long long& t) {
+		t += v;
+	});
+	REQUIRE(total == 9998LL * 5000 / 2 + 100LL * 5000);
+
+	fibers->Close();
+	REQUIRE(fibers->Active() == 0);
+	std::cout << "<- TestFiberStream" << std::endl;
+}
+
+TEST_CASE("TestFiberChannelCapacity") {
+	std::cout << "TestFiberChannelCapacity -> " << std::endl;
+
+	// Neither a power of two nor one slot short.
+	for (size_t capacity : { 1, 5, 8, 100 }) {
+		concurrent::Channel<int> chan(capacity);
+		for (size_t i = 0; i < capacity; i++) {
+			REQUIRE(chan.try_push(int(i)) == concurrent::ChannelStatus::success);
+		}
+		chan.close();
+	}
+
+	std::cout << "<- TestFiberChannelCapacity" << std::endl;
+}
 
 #endif // U_WITH_FIBER
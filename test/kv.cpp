@@ -1,10 +1,16 @@
 #include "catch.hpp"
 
 #include "kv.hpp"
+#include "lockfree.hpp"
+#include "skiplist.hpp"
 #include "queue.hpp"
 #include "pool.hpp"
 
 #include <assert.h>
+#include <list>
+#include <ctime>
+#include <cctype>
+#include <algorithm>
 
 #include <iostream>
 
@@ -128,3 +134,539 @@ TEST_CASE("TestMultiMap") {
 		REQUIRE(val->size() == 3);
 	});
 }
+
+TEST_CASE("TestShardedMap") {
+	using namespace concurrent;
+
+	ShardedMultiMap<int, int> sharded(4);
+	REQUIRE(sharded.Shards() == 4);
+
+	for (int i = 0; i < 100; i++) {
+		sharded.Shard(sharded.ShardOf(i)).insert(std::make_pair(i, i));
+		sharded.Shard(sharded.ShardOf(i)).insert(std::make_pair(i, i));
+	}
+	sharded.Close();
+	sharded.Wait();
+
+	REQUIRE(sharded.Size() == 200);
+
+	size_t groups = 0;
+	for (size_t i = 0; i < sharded.Shards(); i++) {
+		sharded.Aggregate<std::vector<int>>(i, [&groups, &sharded, i](const int& k, auto val) {
+			REQUIRE(sharded.ShardOf(k) == i);
+			REQUIRE(val->size() == 2);
+			groups++;
+		});
+	}
+	REQUIRE(groups == 100);
+}
+
+TEST_CASE("TestShardedHashMap") {
+	using namespace concurrent;
+
+	SyncShardedHashMap<int, int, 8>::Ptr map(new SyncShardedHashMap<int, int, 8>());
+	Pool<>::Ptr pool(new Pool<>(4));
+	WaitGroup::Ptr wg(new WaitGroup(4));
+
+	for (int w = 0; w < 4; w++) {
+		pool->Send([map, wg, w] {
+			for (int i = w; i < 10000; i += 4) {
+				map->Insert(i, i * 2);
+			}
+			wg->Finish();
+		});
+	}
+	wg->Wait();
+
+	REQUIRE(map->Size() == 10000);
+
+	int v = 0;
+	REQUIRE(map->Find(42, v));
+	REQUIRE(v == 84);
+	REQUIRE_FALSE(map->Find(10000, v));
+
+	REQUIRE(map->Remove(42));
+	REQUIRE_FALSE(map->Contains(42));
+
+	size_t groups = 0;
+	map->Aggregate<std::vector<int>>([&groups] (const int&, auto val) {
+		groups += val->size();
+	});
+	REQUIRE(groups == 9999);
+}
+
+TEST_CASE("TestLockFreeHashMap") {
+	using namespace concurrent;
+
+	// Starts small so the writers resize it while the readers look up.
+	LockFreeHashMap<int, int>::Ptr map(new LockFreeHashMap<int, int>(4));
+	Pool<>::Ptr pool(new Pool<>(6));
+	WaitGroup::Ptr wg(new WaitGroup(6));
+
+	std::atomic<size_t> wrong{ 0 };
+	std::atomic<bool> writing{ true };
+
+	for (int w = 0; w < 3; w++) {
+		pool->Send([map, wg, w] {
+			for (int i = w; i < 30000; i += 3) {
+				map->Insert(i, i * 2);
+				if (i % 10 == 0) {
+					map->Remove(i);
+				}
+			}
+			wg->Finish();
+		});
+	}
+	for (int r = 0; r < 3; r++) {
+		pool->Send([map, wg, &wrong, &writing] {
+			do {
+				for (int i = 0; i < 30000; i += 7) {
+					int v = 0;
+					if (map->Find(i, v) && v != i * 2) {
+						wrong++;
+					}
+				}
+			} while (writing.load());
+			wg->Finish();
+		});
+	}
+
+	while (map->Size() < 27000) {
+		std::this_thread::yield();
+	}
+	writing.store(false);
+	wg->Wait();
+
+	REQUIRE(wrong.load() == 0);
+	REQUIRE(map->Size() == 27000);
+
+	int v = 0;
+	REQUIRE(map->Find(29999, v));
+	REQUIRE(v == 59998);
+	REQUIRE_FALSE(map->Contains(29990));
+
+	map->Put(1, 7);
+	REQUIRE(map->Find(1, v));
+	REQUIRE(v == 7);
+
+	size_t n = 0;
+	map->ForEach([&n] (const std::pair<int, int>&) { n++; });
+	REQUIRE(n == 27000);
+
+	// Keys written while a copy runs only live in the next table.
+	LockFreeHashMap<int, int> copying(256);
+	for (int i = 0; i < 260; i++) {
+		copying.Insert(i, i);
+	}
+	n = 0;
+	copying.ForEach([&n] (const std::pair<int, int>&) { n++; });
+	REQUIRE(n == 260);
+
+	// Writes from the walk grow the table and copy slots behind and ahead
+	// of it; each key still comes up once.
+	LockFreeHashMap<int, int> growing(8);
+	for (int i = 0; i < 15; i++) {
+		growing.Insert(i, i);
+	}
+	std::map<int, int> seen;
+	int next = 1000;
+	growing.ForEach([&] (const std::pair<int, int>& p) {
+		seen[p.first]++;
+		for (int j = 0; j < 4 && next < 1200; j++) {
+			growing.Insert(next++, 0);
+		}
+	});
+	bool once = true;
+	for (const auto& s : seen) {
+		once = once && s.second == 1;
+	}
+	REQUIRE(once);
+	for (int i = 0; i < 15; i++) {
+		REQUIRE(seen.count(i) == 1);
+	}
+
+	map->Clear();
+	REQUIRE(map->Size() == 0);
+	REQUIRE_FALSE(map->Contains(1));
+}
+
+TEST_CASE("TestSkipListMap") {
+	using namespace concurrent;
+
+	SkipListMap<int, int>::Ptr map(new SkipListMap<int, int>());
+	Pool<>::Ptr pool(new Pool<>(6));
+	WaitGroup::Ptr wg(new WaitGroup(6));
+
+	std::atomic<size_t> wrong{ 0 };
+	std::atomic<bool> writing{ true };
+
+	for (int w = 0; w < 3; w++) {
+		pool->Send([map, wg, w] {
+			for (int i = w; i < 30000; i += 3) {
+				map->Insert(i, i * 2);
+				if (i % 10 == 0) {
+					map->Remove(i);
+				}
+			}
+			wg->Finish();
+		});
+	}
+	// Scans run while the writers insert; they must stay ordered.
+	for (int r = 0; r < 3; r++) {
+		pool->Send([map, wg, r, &wrong, &writing] {
+			do {
+				int last = -1;
+				map->Range(r * 10000, r * 10000 + 5000, [&last, &wrong] (const std::pair<int, int>& p) {
+					if (p.first <= last || p.second != p.first * 2) {
+						wrong++;
+					}
+					last = p.first;
+				});
+			} while (writing.load());
+			wg->Finish();
+		});
+	}
+
+	while (map->Size() < 27000) {
+		std::this_thread::yield();
+	}
+	writing.store(false);
+	wg->Wait();
+
+	REQUIRE(wrong.load() == 0);
+	REQUIRE(map->Size() == 27000);
+
+	int v = 0;
+	REQUIRE(map->Find(29999, v));
+	REQUIRE(v == 59998);
+	REQUIRE_FALSE(map->Contains(29990));
+
+	std::pair<int, int> p;
+	REQUIRE(map->LowerBound(29990, p));
+	REQUIRE(p.first == 29991);
+	REQUIRE_FALSE(map->LowerBound(30000, p));
+
+	size_t n = 0;
+	map->Range(100, 200, [&n] (const std::pair<int, int>&) { n++; });
+	REQUIRE(n == 90);
+
+	map->Clear();
+	REQUIRE(map->Size() == 0);
+	REQUIRE_FALSE(map->Contains(1));
+}
+
+TEST_CASE("TestSharedSyncMap") {
+	using namespace concurrent;
+
+	SharedSyncHashMap<int, int>::Ptr map(new SharedSyncHashMap<int, int>());
+	Pool<>::Ptr pool(new Pool<>(6));
+	WaitGroup::Ptr wg(new WaitGroup(6));
+
+	// Keys go in in order, so a reader that finds one finds all before it.
+	std::atomic<size_t> gaps{ 0 };
+	for (int w = 0; w < 6; w++) {
+		pool->Send([map, wg, w, &gaps] {
+			for (int i = 0; i < 5000; i++) {
+				// One writer for five readers.
+				if (w == 0) {
+					map->Insert(i, i);
+				} else if (map->Contains(i) && i > 0 && !map->Contains(i - 1)) {
+					gaps++;
+				}
+			}
+			wg->Finish();
+		});
+	}
+	wg->Wait();
+
+	REQUIRE(map->Size() == 5000);
+	REQUIRE(gaps.load() == 0);
+
+	// Writers exclude each other and the readers.
+	ReaderBiasedMutex mutex;
+	size_t counter = 0;
+	std::atomic<size_t> torn{ 0 };
+
+	WaitGroup::Ptr wg2(new WaitGroup(4));
+	for (int w = 0; w < 4; w++) {
+		pool->Send([&mutex, &counter, &torn, wg2, w] {
+			for (int i = 0; i < 2000; i++) {
+				if (w % 2) {
+					std::unique_lock<ReaderBiasedMutex> lock(mutex);
+					counter++;
+					counter++;
+				} else {
+					std::shared_lock<ReaderBiasedMutex> lock(mutex);
+					if (counter % 2) {
+						torn++;
+					}
+				}
+			}
+			wg2->Finish();
+		});
+	}
+	wg2->Wait();
+
+	REQUIRE(counter == 8000);
+	REQUIRE(torn.load() == 0);
+
+#ifdef __unix__
+	// A writer kept out by a long reader sleeps instead of spinning.
+	auto cpu = [] {
+		struct timespec ts;
+		::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+		return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+	};
+
+	std::atomic<bool> reading{ false };
+	std::thread reader([&mutex, &reading] {
+		std::shared_lock<ReaderBiasedMutex> lock(mutex);
+		reading.store(true);
+		std::this_thread::sleep_for(std::chrono::milliseconds(300));
+	});
+	while (!reading.load()) {
+		std::this_thread::yield();
+	}
+
+	double start = cpu();
+	mutex.lock();
+	double spent = cpu() - start;
+	mutex.unlock();
+	reader.join();
+	REQUIRE(spent < 100);
+#endif
+
+	_SyncMap<std::map<int, int>, std::shared_timed_mutex> timed;
+	timed.Insert(1, 2);
+	REQUIRE(timed.Contains(1));
+}
+
+namespace {
+
+	// Counts 4 x 1000 increments over 100 keys from 4 workers.
+	template <typename M>
+	void countWords(typename M::Ptr map) {
+		concurrent::Pool<>::Ptr pool(new concurrent::Pool<>(4));
+		concurrent::WaitGroup::Ptr wg(new concurrent::WaitGroup(4));
+
+		for (int w = 0; w < 4; w++) {
+			pool->Send([map, wg] {
+				for (int i = 0; i < 1000; i++) {
+					if (i % 2) {
+						map->Upsert(i % 100, 1, [] (int& c, const int& n) { c += n; });
+					} else {
+						map->Compute(i % 100, [] (int& c) { c++; });
+					}
+				}
+				wg->Finish();
+			});
+		}
+		wg->Wait();
+	}
+
+}
+
+TEST_CASE("TestMapUpsert") {
+	using namespace concurrent;
+
+	SyncHashMap<int, int>::Ptr hash(new SyncHashMap<int, int>());
+	countWords<SyncHashMap<int, int>>(hash);
+
+	SyncShardedHashMap<int, int>::Ptr sharded(new SyncShardedHashMap<int, int>());
+	countWords<SyncShardedHashMap<int, int>>(sharded);
+
+	LockFreeHashMap<int, int>::Ptr lockfree(new LockFreeHashMap<int, int>());
+	countWords<LockFreeHashMap<int, int>>(lockfree);
+
+	for (int k = 0; k < 100; k++) {
+		REQUIRE(hash->GetOr(k, 0) == 40);
+		REQUIRE(sharded->GetOr(k, 0) == 40);
+		REQUIRE(lockfree->GetOr(k, 0) == 40);
+	}
+	REQUIRE(hash->GetOr(100, -1) == -1);
+	REQUIRE(lockfree->GetOr(100, -1) == -1);
+
+	int seen = 0;
+	REQUIRE(sharded->Visit(7, [&seen] (const int& v) { seen = v; }));
+	REQUIRE(seen == 40);
+	REQUIRE_FALSE(lockfree->Visit(100, [&seen] (const int& v) { seen = v; }));
+
+	SyncMultiMap<int, int> multi;
+	REQUIRE(multi.Upsert(1, 2, [] (int& c, const int& n) { c += n; }));
+	REQUIRE_FALSE(multi.Upsert(1, 2, [] (int& c, const int& n) { c += n; }));
+	REQUIRE(multi.Size() == 1);
+	REQUIRE(multi.Compute(1, [] (int& c) { c *= 10; }) == 40);
+}
+
+TEST_CASE("TestMapSnapshot") {
+	using namespace concurrent;
+
+	SyncMap<int, int>::Ptr map(new SyncMap<int, int>());
+	for (int i = 0; i < 1000; i++) {
+		map->Insert(i, i);
+	}
+
+	// Writers keep going while the snapshot is read without the lock.
+	auto snap = map->Snapshot();
+	Pool<>::Ptr pool(new Pool<>(2));
+	WaitGroup::Ptr wg(new WaitGroup(1));
+	pool->Send([map, wg] {
+		for (int i = 0; i < 1000; i++) {
+			map->Remove(i);
+			map->Insert(i + 1000, i);
+		}
+		wg->Finish();
+	});
+
+	long sum = 0;
+	int last = -1;
+	bool ordered = true;
+	for (const auto& p : *snap) {
+		ordered = ordered && p.first > last;
+		last = p.first;
+		sum += p.second;
+	}
+	wg->Wait();
+
+	REQUIRE(ordered);
+	REQUIRE(snap->size() == 1000);
+	REQUIRE(sum == 999L * 500);
+	REQUIRE(map->Size() == 1000);
+	REQUIRE_FALSE(map->Contains(0));
+
+	// Released by its last reader.
+	std::weak_ptr<const SyncMap<int, int>::View> old(snap);
+	snap.reset();
+	REQUIRE(old.expired());
+
+	// Find pins the version it points into, so the entry outlives its removal.
+	auto found = map->Find(1500);
+	REQUIRE(found != map->End());
+	REQUIRE(map->Find(0) == map->End());
+	map->Remove(1500);
+	map->Insert(1500, -1);
+	REQUIRE(found->second == 500);
+	REQUIRE(map->GetOr(1500, 0) == -1);
+
+	// Extract copies out a version a snapshot still holds.
+	snap = map->Snapshot();
+	size_t groups = 0;
+	map->Extract<std::vector<int>>([&groups](const int&, std::shared_ptr<std::vector<int>> v) {
+		groups += v->size();
+	});
+	REQUIRE(groups == 1000);
+	REQUIRE(map->Size() == 0);
+	REQUIRE(snap->size() == 1000);
+	REQUIRE(snap->begin()->first == 1000);
+}
+
+namespace {
+
+	std::string lower(std::string s) {
+		std::transform(s.begin(), s.end(), s.begin(), [] (unsigned char c) { return std::tolower(c); });
+		return s;
+	}
+
+	struct CaseLess {
+		bool operator()(const std::string& a, const std::string& b) const { return lower(a) < lower(b); }
+	};
+
+	struct CaseHash {
+		size_t operator()(const std::string& s) const { return std::hash<std::string>()(lower(s)); }
+	};
+
+	struct CaseEqual {
+		bool operator()(const std::string& a, const std::string& b) const { return lower(a) == lower(b); }
+	};
+
+}
+
+TEST_CASE("TestMapCustomKeys") {
+	using namespace concurrent;
+
+	// Shards follow the map's own comparator or hasher, not std::hash.
+	_SyncMap<std::map<std::string, int, CaseLess>> sorted;
+	_SyncMap<std::unordered_map<std::string, int, CaseHash, CaseEqual>> hashed;
+	for (auto k : {"Alpha", "ALPHA", "alpha"}) {
+		sorted.Insert(k, 1);
+		hashed.Insert(k, 1);
+	}
+
+	REQUIRE(sorted.Size() == 1);
+	REQUIRE(hashed.Size() == 1);
+	REQUIRE(sorted.Contains("aLPHA"));
+	REQUIRE(hashed.Contains("aLPHA"));
+	REQUIRE(sorted.Find("aLpHa") != sorted.End());
+	REQUIRE(hashed.GetOr("ALPHa", 0) == 1);
+	REQUIRE(sorted.Remove("alpHA"));
+	REQUIRE(hashed.Remove("alpHA"));
+	REQUIRE(sorted.Size() == 0);
+	REQUIRE(hashed.Size() == 0);
+}
+
+TEST_CASE("TestMapGrouping") {
+	using namespace concurrent;
+
+	_SyncMap<std::unordered_multimap<int, std::string>> hashed;
+	SyncMultiMap<int, std::string> sorted;
+	for (int i = 0; i < 1000; i++) {
+		hashed.Insert(i % 10, std::to_string(i));
+		sorted.Insert(i % 10, std::to_string(i));
+	}
+
+	size_t groups = 0, values = 0;
+	hashed.Aggregate<std::vector<std::string>>([&] (const int& k, std::shared_ptr<std::vector<std::string>> g) {
+		groups++;
+		values += g->size();
+		REQUIRE(g->size() == 100);
+		REQUIRE(std::stoi(g->front()) % 10 == k);
+	});
+	REQUIRE(groups == 10);
+	REQUIRE(values == 1000);
+	REQUIRE(hashed.Size() == 1000);
+
+	std::vector<int> keys;
+	sorted.Extract<std::vector<std::string>>([&keys] (const int& k, std::shared_ptr<std::vector<std::string>> g) {
+		keys.push_back(k);
+		REQUIRE(g->size() == 100);
+		REQUIRE(std::stoi(g->back()) % 10 == k);
+	});
+	REQUIRE(keys.size() == 10);
+	REQUIRE(std::is_sorted(keys.begin(), keys.end()));
+	REQUIRE(sorted.Size() == 0);
+}
+
+TEST_CASE("TestGroupMap") {
+	using namespace concurrent;
+
+	SyncGroupMap<int, std::string, 4> groups;
+	for (int i = 0; i < 1000; i++) {
+		groups.Insert(i % 10, std::to_string(i));
+	}
+	REQUIRE(groups.Size() == 1000);
+	REQUIRE(groups.Groups() == 10);
+
+	size_t n = 0;
+	REQUIRE(groups.Visit(3, [&n] (const std::vector<std::string>& g) {
+		n = g.size();
+		REQUIRE(g[1] == "13");
+	}));
+	REQUIRE(n == 100);
+
+	size_t copied = 0;
+	groups.Aggregate<std::list<std::string>>([&copied] (const int&, std::shared_ptr<std::list<std::string>> g) {
+		copied += g->size();
+	});
+	REQUIRE(copied == 1000);
+
+	REQUIRE(groups.Remove(9));
+	REQUIRE(groups.Size() == 900);
+
+	size_t moved = 0;
+	groups.Extract<std::vector<std::string>>([&moved] (const int& k, std::shared_ptr<std::vector<std::string>> g) {
+		REQUIRE(g->front() == std::to_string(k));
+		moved += g->size();
+	});
+	REQUIRE(moved == 900);
+	REQUIRE(groups.Size() == 0);
+}
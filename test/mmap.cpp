@@ -0,0 +1,83 @@
+#include "catch.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include "mmap.hpp"
+#include "stream.hpp"
+
+#include <cstdio>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+TEST_CASE("TestMmapRanges") {
+	std::cout << "TestMmapRanges -> " << std::endl;
+
+	std::string path = "mmap_ranges.txt";
+	{
+		std::ofstream out(path);
+		out << "a\nbb\n\nccc\nd";
+	}
+
+	concurrent::MmapSource::Ptr source(new concurrent::MmapSource(path));
+	REQUIRE(source->Size() == 11);
+
+	for (size_t n = 1; n < 16; n++) {
+		std::vector<std::string> records;
+		for (auto r : source->Ranges(n)) {
+			source->Scan(r.first, r.second, [&records](concurrent::StringView v) {
+				records.push_back(std::string(v.data(), v.size()));
+			});
+		}
+
+		REQUIRE(records == std::vector<std::string>({ "a", "bb", "", "ccc", "d" }));
+	}
+
+	std::remove(path.c_str());
+	std::cout << "<- TestMmapRanges" << std::endl;
+}
+
+TEST_CASE("TestMmapStream") {
+	std::cout << "TestMmapStream -> " << std::endl;
+	using namespace concurrent;
+
+	std::string path = "mmap_stream.txt";
+	size_t bytes = 0;
+	{
+		std::ofstream out(path);
+		for (int i = 0; i < 100000; i++) {
+			std::string line = std::to_string(i);
+			bytes += line.size();
+			out << line << ';';
+		}
+	}
+
+	Streamer<StringView> item(4);
+	item.From(MmapSource::Ptr(new MmapSource(path, ';')), 4);
+
+	auto total = item.Filter([](StringView v) {
+		return !v.empty();
+	}, 2)->Reduce<size_t>([](StringView v, size_t& s) {
+		s += v.size();
+	});
+	REQUIRE(total == bytes);
+
+	// Later stages keep the mapping alive once the head is gone.
+	Streamer<StringView>::Bouncer::Ptr digits;
+	{
+		Streamer<StringView> head(4);
+		head.From(MmapSource::Ptr(new MmapSource(path, ';')), 4);
+		digits = head.Filter([](StringView v) {
+			return !v.empty();
+		}, 2);
+	}
+	auto counted = digits->Reduce<size_t>([](StringView v, size_t& s) {
+		s += std::count_if(v.begin(), v.end(), [](char c) { return c >= '0' && c <= '9'; });
+	});
+	REQUIRE(counted == bytes);
+
+	std::remove(path.c_str());
+	std::cout << "<- TestMmapStream" << std::endl;
+}
+
+#endif
@@ -111,3 +111,126 @@ TEST_CASE("TestQueuePipeline", "DefaultPool") {
 
 	std::cout << "<- TestQueuePipeline" << std::endl;
 }
+
+TEST_CASE("TestQueueBudget") {
+	std::cout << "TestQueueBudget -> " << std::endl;
+
+	concurrent::MemoryBudget::Ptr budget(new concurrent::MemoryBudget(8));
+	concurrent::SyncQueue<std::string> sync;
+	sync.Limit(budget, [](const std::string& s) { return s.size(); });
+
+	REQUIRE(sync.Push(std::string("1234"), 100));
+	REQUIRE(sync.Push(std::string("5678"), 100));
+	REQUIRE(budget->Used() == 8);
+	REQUIRE_FALSE(sync.Push(std::string("9"), 100));
+
+	REQUIRE(sync.Pop() == "1234");
+	REQUIRE(budget->Used() == 4);
+	REQUIRE(sync.Push(std::string("9"), 100));
+	REQUIRE(sync.Size() == 2);
+
+	// Inside a pipeline a push into an empty queue passes, the next waits.
+	concurrent::SyncQueue<std::string> inner;
+	inner.Limit(budget, [](const std::string& s) { return s.size(); }, false);
+	inner.Push(std::string("abcd"));
+	REQUIRE(budget->Used() == 9);
+
+	std::thread pusher([&inner] { inner.Push(std::string("efgh")); });
+	sync.Pop();
+	sync.Pop();
+	pusher.join();
+	REQUIRE(inner.Size() == 2);
+	REQUIRE(budget->Used() == 8);
+	REQUIRE(budget->Peak() == 9);
+	inner.Pop();
+	inner.Pop();
+
+	concurrent::MemoryBudget::Ptr shed(new concurrent::MemoryBudget(2 * sizeof(int), concurrent::MemoryBudget::Policy::Shed));
+	concurrent::SyncQueue<int> ints;
+	ints.Push(0);
+	ints.Limit(shed);
+	for (int i = 1; i < 10; i++) {
+		ints.Push(i);
+	}
+	REQUIRE(ints.Size() == 3);
+	REQUIRE(shed->Dropped() == 7);
+
+	ints.Pop();
+	REQUIRE(shed->Used() == 2 * sizeof(int));
+	ints.Pop();
+	ints.Pop();
+	REQUIRE(shed->Used() == 0);
+
+	// A source nobody drains fails past the wait limit, or once closed.
+	concurrent::MemoryBudget::Ptr bounded(new concurrent::MemoryBudget(sizeof(int), concurrent::MemoryBudget::Policy::Block, 20));
+	concurrent::SyncQueue<int> stuck;
+	stuck.Limit(bounded);
+	stuck.Push(1);
+	REQUIRE_THROWS_AS(stuck.Push(2), concurrent::ex::TimeoutQueueException);
+
+	concurrent::MemoryBudget::Ptr unbounded(new concurrent::MemoryBudget(sizeof(int)));
+	concurrent::SyncQueue<int> closing;
+	closing.Limit(unbounded);
+	closing.Push(1);
+	std::thread closer([&closing] {
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		closing.Close();
+	});
+	REQUIRE_THROWS_AS(closing.Push(2), concurrent::ex::ClosedQueueException);
+	closer.join();
+	REQUIRE(unbounded->Used() == sizeof(int));
+
+	std::cout << "<- TestQueueBudget" << std::endl;
+}
+
+TEST_CASE("TestQueueMoveOnly") {
+	std::cout << "TestQueueMoveOnly -> " << std::endl;
+
+	concurrent::SyncQueue<std::unique_ptr<int>> sync;
+	sync.Push(std::unique_ptr<int>(new int(1)));
+	REQUIRE(sync.Push(std::unique_ptr<int>(new int(2)), 100));
+
+	REQUIRE(*sync.Pop() == 1);
+	REQUIRE(*sync.Pop(100) == 2);
+
+	sync.Push(std::unique_ptr<int>(new int(3)));
+	sync.Close();
+
+	int sum = 0;
+	sync.Drain([&sum](std::unique_ptr<int>&& p) {
+		sum += *p;
+	});
+	REQUIRE(sum == 3);
+
+	std::cout << "<- TestQueueMoveOnly" << std::endl;
+}
+
+TEST_CASE("TestQueuePushAll") {
+	std::cout << "TestQueuePushAll -> " << std::endl;
+	using namespace concurrent;
+
+	SyncQueue<int>::Ptr q(new SyncQueue<int>(10));
+
+	int expected = 0;
+	std::thread consumer([q, &expected] {
+		q->Drain([&expected](int&& v) {
+			if (v == expected) {
+				expected++;
+			}
+		});
+	});
+
+	// Larger than the capacity, so the batch goes in several stretches.
+	std::vector<int> batch;
+	for (int i = 0; i < 100; i++) {
+		batch.push_back(i);
+	}
+	q->PushAll(batch);
+	REQUIRE(batch.empty());
+
+	q->Close();
+	consumer.join();
+	REQUIRE(expected == 100);
+
+	std::cout << "<- TestQueuePushAll" << std::endl;
+}
@@ -0,0 +1,101 @@
+#include "catch.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include "shm.hpp"
+#include "stream.hpp"
+
+#include <iostream>
+
+#include <sys/wait.h>
+
+TEST_CASE("TestShmQueue") {
+	std::cout << "TestShmQueue -> " << std::endl;
+
+	std::string name = "/concurrent_shm_" + std::to_string(::getpid());
+	concurrent::ShmQueue<int>::Ptr q(new concurrent::ShmQueue<int>(name, 64));
+	REQUIRE(q->Capacity() == 64);
+
+	// The child writes through the mapping it inherited, the parent streams.
+	pid_t pid = ::fork();
+	REQUIRE(pid >= 0);
+	if (pid == 0) {
+		for (int i = 0; i < 10000; i++) {
+			q->Push(i);
+		}
+		q->Close();
+		::_exit(0);
+	}
+
+	concurrent::Pool<void>::Ptr pool(new concurrent::Pool<void>(2));
+	concurrent::ShmStreamer<int> item(q, q, pool, nullptr);
+	auto sum = item.Filter([] (int i) {
+		return i % 2 == 0;
+	})->Reduce<long>([] (int i, long& t) {
+		t += i;
+	});
+
+	int status = 0;
+	::waitpid(pid, &status, 0);
+	REQUIRE(WIFEXITED(status));
+	REQUIRE(sum == 4999L * 5000);
+	REQUIRE(q->IsClosed());
+	REQUIRE_THROWS_AS(q->Pop(10), concurrent::ex::ClosedQueueException);
+
+	std::cout << "<- TestShmQueue" << std::endl;
+}
+
+TEST_CASE("TestShmQueueOutput") {
+	std::cout << "TestShmQueueOutput -> " << std::endl;
+
+	std::string name = "/concurrent_shm_out_" + std::to_string(::getpid());
+	concurrent::ShmQueue<double>::Ptr out(new concurrent::ShmQueue<double>(name, 16));
+	auto in = concurrent::ShmQueue<double>::Open(name);
+
+	REQUIRE(in->Push(1.5, 10));
+	REQUIRE(in->Pop(10) == 1.5);
+	REQUIRE_THROWS_AS(in->Pop(10), concurrent::ex::TimeoutQueueException);
+
+	std::vector<int> v(5000, 2);
+	concurrent::Streamer<int> item(v.begin(), v.end(), concurrent::Pool<void>::Ptr(new concurrent::Pool<void>(2)));
+
+	std::thread reader([in] {
+		double total = 0;
+		in->Drain([&total] (double d) { total += d; });
+		in->Push(total);
+	});
+
+	item.Transform([] (int&& i) { return i * 0.5; })->To(out);
+	reader.join();
+
+	REQUIRE(out->Pop() == 5000.0);
+
+	std::cout << "<- TestShmQueueOutput" << std::endl;
+}
+
+TEST_CASE("TestShmQueueName") {
+	std::cout << "TestShmQueueName -> " << std::endl;
+
+	std::string name = "/concurrent_shm_name_" + std::to_string(::getpid());
+	concurrent::ShmQueue<int>::Ptr q(new concurrent::ShmQueue<int>(name, 16));
+	q->Push(1, 10);
+
+	// A live segment is never replaced behind its users' back.
+	try {
+		concurrent::ShmQueue<int> other(name, 16);
+		FAIL("created over a live segment");
+	} catch (const std::system_error& e) {
+		REQUIRE(e.code().value() == EEXIST);
+	}
+	REQUIRE(q->Pop(10) == 1);
+
+	// A stale one is removed on request.
+	REQUIRE(concurrent::ShmQueue<int>::Unlink(name));
+	REQUIRE_FALSE(concurrent::ShmQueue<int>::Unlink(name));
+	concurrent::ShmQueue<int> fresh(name, 16);
+	REQUIRE(fresh.IsEmpty());
+
+	std::cout << "<- TestShmQueueName" << std::endl;
+}
+
+#endif
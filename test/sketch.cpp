@@ -0,0 +1,59 @@
+#include "catch.hpp"
+
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "stream.hpp"
+
+TEST_CASE("TestSketches") {
+	std::cout << "TestSketches -> " << std::endl;
+	using namespace concurrent;
+
+	// 100000 values, each of the first 20000 appearing 5 times.
+	std::vector<int> input;
+	for (int i = 0; i < 100000; i++) {
+		input.push_back((i * 7919) % 20000);
+	}
+
+	SECTION("hyperloglog") {
+		Streamer<int> item(input.begin(), input.end());
+		auto hll = item.Sketch(HyperLogLog(14), [](int v, HyperLogLog& h) {
+			h.Add(v);
+		}, 3);
+
+		REQUIRE(std::abs(hll.Estimate() - 20000) < 20000 * 0.03);
+		item.Close();
+	}
+
+	SECTION("quantiles") {
+		Streamer<int> item(input.begin(), input.end());
+		auto q = item.Sketch(QuantileSketch(200), [](int v, QuantileSketch& s) {
+			s.Add(v);
+		}, 3);
+
+		REQUIRE(q.Count() == input.size());
+		REQUIRE(std::abs(q.Quantile(0.5) - 10000) < 20000 * 0.03);
+		REQUIRE(std::abs(q.Quantile(0.99) - 19800) < 20000 * 0.03);
+		item.Close();
+	}
+
+	SECTION("count-min") {
+		for (int i = 0; i < 1000; i++) {
+			input.push_back(-1);
+		}
+
+		Streamer<int> item(input.begin(), input.end());
+		auto cm = item.Sketch(CountMinSketch(1 << 11, 4), [](int v, CountMinSketch& s) {
+			s.Add(v);
+		}, 3);
+
+		REQUIRE(cm.Total() == input.size());
+		REQUIRE(cm.Estimate(-1) >= 1000);
+		REQUIRE(cm.Estimate(-1) <= 1000 + 2 * input.size() / (1 << 11));
+		REQUIRE(cm.Estimate(7) >= 5);
+		item.Close();
+	}
+
+	std::cout << "<- TestSketches" << std::endl;
+}
@@ -1,8 +1,13 @@
 #include "catch.hpp"
 
 #include "stream.hpp"
+#include "lockfree.hpp"
+#include "skiplist.hpp"
 
 #include <unordered_map>
+#include <list>
+#include <cstdio>
+#include <fstream>
 
 #include <iostream>
 #include <assert.h>
@@ -174,4 +179,922 @@ TEST_CASE("TestPartition") {
 	std::cout << v1 << " <- TestPartition" << std::endl;
 
 
-}
\ No newline at end of file
+}
+
+TEST_CASE("TestShardedPartition") {
+	std::cout << "TestShardedPartition -> " << std::endl;
+	using namespace concurrent;
+
+	std::vector<int> input;
+	for (int i = 0; i < 1000; i++) {
+		for (int j = 0; j < 1000; j++) {
+			input.push_back(i + 1);
+		}
+	}
+
+	concurrent::Pool<>::Ptr pool(new concurrent::Pool<>);
+
+	size_t total = 0;
+	Streamer<int> item(input.begin(), input.end(), pool);
+	auto sharded = item.KV<SyncShardedHashMap<int, int>>([](int t) {
+		return std::make_pair(t, t);
+	}, 4);
+	sharded->PartitionMT<std::vector<int>, size_t>([](const auto&, auto vec) {
+		return vec->size();
+	})->ForEach([&total](auto v) {
+		total += v;
+	});
+
+	REQUIRE(total == 1000);
+	REQUIRE(sharded->Output()->Size() == 1000);
+
+	std::cout << "<- TestShardedPartition" << std::endl;
+}
+
+TEST_CASE("TestLockFreeKV") {
+	std::cout << "TestLockFreeKV -> " << std::endl;
+	using namespace concurrent;
+
+	std::vector<int> input;
+	for (int i = 0; i < 1000; i++) {
+		for (int j = 0; j < 1000; j++) {
+			input.push_back(i + 1);
+		}
+	}
+
+	concurrent::Pool<>::Ptr pool(new concurrent::Pool<>);
+
+	Streamer<int> item(input.begin(), input.end(), pool);
+	auto lookup = item.KV<LockFreeHashMap<int, int>>([](int t) {
+		return std::make_pair(t, t * 2);
+	}, 4)->Output();
+	lookup->Wait();
+
+	int found = 0;
+	REQUIRE(lookup->Find(500, found));
+	REQUIRE(found == 1000);
+	REQUIRE(lookup->Size() == 1000);
+
+	std::cout << "<- TestLockFreeKV" << std::endl;
+}
+
+TEST_CASE("TestGroupMapPartition") {
+	std::cout << "TestGroupMapPartition -> " << std::endl;
+	using namespace concurrent;
+
+	std::vector<int> input;
+	for (int i = 0; i < 1000; i++) {
+		for (int j = 0; j < 1000; j++) {
+			input.push_back(i + 1);
+		}
+	}
+
+	concurrent::Pool<>::Ptr pool(new concurrent::Pool<>);
+
+	size_t total = 0;
+	int groups = 0;
+	Streamer<int> item(input.begin(), input.end(), pool);
+	item.KV<SyncGroupMap<int, int>>([](int t) {
+		return std::make_pair(t, t);
+	}, 4)->PartitionMT<std::vector<int>, size_t>([](const auto&, auto vec) {
+		return vec->size();
+	})->ForEach([&total, &groups](auto v) {
+		total += v;
+		groups++;
+	});
+
+	REQUIRE(total == 1000*1000);
+	REQUIRE(groups == 1000);
+
+	std::cout << "<- TestGroupMapPartition" << std::endl;
+}
+
+TEST_CASE("TestExtractPartition") {
+	std::cout << "TestExtractPartition -> " << std::endl;
+	using namespace concurrent;
+
+	std::vector<int> input;
+	for (int i = 0; i < 100; i++) {
+		for (int j = 0; j < 10; j++) {
+			input.push_back(i);
+		}
+	}
+
+	concurrent::Pool<>::Ptr pool(new concurrent::Pool<>);
+	auto count = [](const int&, std::shared_ptr<std::vector<int>> vec) {
+		return vec->size();
+	};
+	auto sum = [](size_t v, size_t& t) {
+		t += v;
+	};
+
+	// Partition reads the map, ExtractPartition empties it.
+	Streamer<int> item(input.begin(), input.end(), pool);
+	auto kv = item.KV<std::multimap<int, int>>([](int t) {
+		return std::make_pair(t, t);
+	});
+	REQUIRE(kv->Partition<std::vector<int>>(count)->Reduce<size_t>(sum) == 1000);
+	REQUIRE(kv->Output()->Size() == 1000);
+	REQUIRE(kv->ExtractPartition<std::vector<int>>(count)->Reduce<size_t>(sum) == 1000);
+	REQUIRE(kv->Output()->Size() == 0);
+
+	Streamer<int> item1(input.begin(), input.end(), pool);
+	auto groups = item1.KV<SyncGroupMap<int, int>>([](int t) {
+		return std::make_pair(t, t);
+	}, 4);
+	REQUIRE(groups->PartitionMT<std::vector<int>>(count)->Reduce<size_t>(sum) == 1000);
+	REQUIRE(groups->Output()->Size() == 1000);
+	REQUIRE(groups->ExtractPartitionMT<std::vector<int>>(count)->Reduce<size_t>(sum) == 1000);
+	REQUIRE(groups->Output()->Size() == 0);
+
+	std::cout << "<- TestExtractPartition" << std::endl;
+}
+
+TEST_CASE("TestSkipListKV") {
+	std::cout << "TestSkipListKV -> " << std::endl;
+	using namespace concurrent;
+
+	std::vector<int> input;
+	for (int i = 0; i < 1000; i++) {
+		for (int j = 0; j < 1000; j++) {
+			input.push_back(i + 1);
+		}
+	}
+
+	concurrent::Pool<>::Ptr pool(new concurrent::Pool<>);
+
+	Streamer<int> item(input.begin(), input.end(), pool);
+	auto ordered = item.KV<SkipListMap<int, int>>([](int t) {
+		return std::make_pair(t, t * 2);
+	}, 4)->Output();
+	ordered->Wait();
+
+	std::pair<int, int> first;
+	REQUIRE(ordered->LowerBound(-1, first));
+	REQUIRE(first.first == 1);
+	REQUIRE(ordered->Size() == 1000);
+
+	std::cout << "<- TestSkipListKV" << std::endl;
+}
+
+TEST_CASE("TestStreamBudget") {
+	std::cout << "TestStreamBudget -> " << std::endl;
+	using namespace concurrent;
+
+	MemoryBudget::Ptr budget(new MemoryBudget(1 << 12));
+
+	Streamer<std::string> item;
+	item.Budget(budget, [](const std::string& s) { return sizeof(s) + s.capacity(); });
+
+	size_t count = 0;
+	auto result = item.Filter([](const std::string& s) {
+		return s.size() % 2 == 0;
+	}, 2, 16)->Transform<size_t>([](const std::string& s) {
+		return s.size();
+	}, 2, 16);
+
+	REQUIRE(result->Output()->Capacity() == 16);
+
+	std::thread producer([&item] {
+		auto input = item.Input();
+		for (int i = 0; i < 100000; i++) {
+			input->Push(std::string(i % 64, 'x'));
+		}
+		input->Close();
+	});
+
+	result->ForEach([&count](size_t) {
+		count++;
+	});
+	producer.join();
+	result->Close();
+
+	REQUIRE(count == 50000);
+	// Past the limit only by one element per worker pushing into an empty queue.
+	REQUIRE(budget->Peak() <= budget->Limit() + 4 * (sizeof(std::string) + 64));
+	REQUIRE(budget->Used() == 0);
+
+	// One worker per stage, still with its own capacity.
+	Streamer<int> single;
+	auto narrow = single.Filter([](int) { return true; }, 1, 8)->Transform([](int&& i) { return i; }, 1, 4);
+	REQUIRE(narrow->Input()->Capacity() == 8);
+	REQUIRE(narrow->Output()->Capacity() == 4);
+	single.Input()->Close();
+	narrow->Output()->Wait();
+
+	std::cout << "<- TestStreamBudget" << std::endl;
+}
+
+TEST_CASE("TestShuffle") {
+	std::cout << "TestShuffle -> " << std::endl;
+	using namespace concurrent;
+
+	std::vector<int> input;
+	for (int i = 0; i < 1000; i++) {
+		for (int j = 0; j < 100; j++) {
+			input.push_back(i + 1);
+		}
+	}
+
+	size_t total = 0;
+	int groups = 0;
+
+	Streamer<int> item(input.begin(), input.end());
+	auto result = item.Shuffle<std::unordered_multimap<int, int>>([](int t) {
+		return std::make_pair(t, t);
+	}, 4)->PartitionMT<std::vector<int>, size_t>([](const auto&, auto vec) {
+		return vec->size();
+	});
+
+	result->ForEach([&total, &groups](auto v) {
+		total += v;
+		groups++;
+	});
+	result->Close();
+
+	REQUIRE(total == input.size());
+	REQUIRE(groups == 1000);
+
+	std::cout << "<- TestShuffle" << std::endl;
+}
+
+TEST_CASE("TestShuffleMoveOnly") {
+	std::cout << "TestShuffleMoveOnly -> " << std::endl;
+	using namespace concurrent;
+
+	std::vector<int> input;
+	for (int i = 0; i < 1000; i++) {
+		input.push_back(i);
+	}
+
+	Streamer<int> item(input.begin(), input.end());
+	auto result = item.Shuffle<std::unordered_map<int, std::unique_ptr<int>>>([](int t) {
+		return std::make_pair(t, std::unique_ptr<int>(new int(t)));
+	}, 4);
+	result->Output()->Wait();
+
+	long sum = 0;
+	auto output = result->Output();
+	for (size_t i = 0; i < output->Shards(); i++) {
+		for (const auto& p : output->Shard(i)) {
+			REQUIRE(p.first == *p.second);
+			sum += *p.second;
+		}
+	}
+
+	REQUIRE(output->Size() == input.size());
+	REQUIRE(sum == 999L * 500);
+
+	std::cout << "<- TestShuffleMoveOnly" << std::endl;
+}
+
+TEST_CASE("TestStreamMoveOnly") {
+	std::cout << "TestStreamMoveOnly -> " << std::endl;
+	using namespace concurrent;
+
+	std::vector<std::unique_ptr<int>> input;
+	for (int i = 0; i < 1000; i++) {
+		input.emplace_back(new int(i));
+	}
+
+	Streamer<std::unique_ptr<int>> item(std::make_move_iterator(input.begin()), std::make_move_iterator(input.end()));
+	auto result = item.Filter([](const std::unique_ptr<int>& p) {
+		return *p % 2 == 0;
+	}, 2)->Transform<std::unique_ptr<int>>([](std::unique_ptr<int>&& p) {
+		*p += 1;
+		return std::move(p);
+	}, 2)->KV<std::map<int, std::unique_ptr<int>>>([](std::unique_ptr<int> p) {
+		int k = *p;
+		return std::make_pair(k, std::move(p));
+	});
+
+	result->Close();
+	REQUIRE(result->Output()->Size() == 500);
+	REQUIRE(result->Output()->Contains(1));
+	REQUIRE_FALSE(result->Output()->Contains(2));
+
+	std::cout << "<- TestStreamMoveOnly" << std::endl;
+}
+
+TEST_CASE("TestStreamCallables") {
+	std::cout << "TestStreamCallables -> " << std::endl;
+	using namespace concurrent;
+
+	std::vector<int> input;
+	for (int i = 0; i < 1000; i++) {
+		input.push_back(i);
+	}
+
+	int limit = 100;
+	Streamer<int> item(input.begin(), input.end());
+	auto result = item.Filter([limit](int k) {
+		return k < limit;
+	}, 2)->Transform([](int k) {
+		return std::to_string(k);
+	}, 2);
+
+	static_assert(std::is_same<decltype(result->Output()), SyncQueue<std::string>::Ptr>::value, "deduced output type");
+
+	std::function<bool(const std::string&)> odd = [](const std::string& s) {
+		return (s.back() - '0') % 2 == 1;
+	};
+
+	int calls = 0;
+	auto count = result->Filter(odd)->Transform<size_t>([calls](std::string&& s) mutable {
+		calls++;
+		return s.size();
+	})->Reduce<size_t>([](size_t n, size_t& total) {
+		total += n;
+	});
+
+	// 5 one digit and 45 two digit odd numbers below 100.
+	REQUIRE(count == 5 + 45 * 2);
+
+	std::cout << "<- TestStreamCallables" << std::endl;
+}
+
+TEST_CASE("TestStreamSplitSource") {
+	std::cout << "TestStreamSplitSource -> " << std::endl;
+	using namespace concurrent;
+
+	std::vector<int64_t> input;
+	for (int64_t i = 0; i < 1000000; i++) {
+		input.push_back(i);
+	}
+
+	auto item = Streamer<int64_t>::Parallel(input.begin(), input.end(), Pool<void>::Ptr(new Pool<void>(4)));
+	auto sum = item->Filter([](int64_t k) {
+		return k % 2 == 0;
+	}, 2)->Reduce<int64_t>([](int64_t k, int64_t& s) {
+		s += k;
+	});
+
+	REQUIRE(sum == 249999500000);
+
+	// Only opted in: the constructors keep the source order.
+	Streamer<int64_t> ordered(input.begin(), input.end(), 4);
+	int64_t next = 0;
+	bool inOrder = true;
+	ordered.ForEach([&next, &inOrder](int64_t k) {
+		inOrder = inOrder && k == next++;
+	});
+	REQUIRE(inOrder);
+	REQUIRE(next == 1000000);
+
+	std::list<int64_t> list(input.begin(), input.begin() + 1000);
+	Streamer<int64_t> single(list.begin(), list.end(), 2);
+	auto count = single.Reduce<size_t>([](int64_t, size_t& c) {
+		c++;
+	});
+	REQUIRE(count == 1000);
+
+	std::cout << "<- TestStreamSplitSource" << std::endl;
+}
+
+TEST_CASE("TestStreamWriteTo") {
+	std::cout << "TestStreamWriteTo -> " << std::endl;
+	using namespace concurrent;
+
+	std::vector<int> input;
+	size_t expected = 0;
+	for (int i = 0; i < 100000; i++) {
+		input.push_back(i);
+		expected += std::to_string(i).size() + 1;
+	}
+
+	std::string path = "stream_write_to.txt";
+
+	Streamer<int> item(input.begin(), input.end());
+	auto written = item.Filter([](int) {
+		return true;
+	}, 2)->WriteTo(path, [](int i, std::string& out) {
+		out += std::to_string(i);
+		out += '\n';
+	}, 2, 1 << 12);
+
+	REQUIRE(written == expected);
+
+	std::ifstream in(path);
+	size_t lines = 0, sum = 0;
+	std::string line;
+	while (std::getline(in, line)) {
+		sum += std::stoul(line);
+		lines++;
+	}
+	REQUIRE(lines == input.size());
+	REQUIRE(sum == size_t(99999) * 100000 / 2);
+
+	// A failing serializer fails the call instead of truncating the file.
+	Streamer<int> failing(input.begin(), input.end());
+	REQUIRE_THROWS_AS(failing.WriteTo(path, [](int i, std::string& out) {
+		if (i == 5000) {
+			throw std::runtime_error("bad record");
+		}
+		out += std::to_string(i);
+	}, 2, 1 << 12), std::runtime_error);
+
+	std::remove(path.c_str());
+	std::cout << "<- TestStreamWriteTo" << std::endl;
+}
+
+TEST_CASE("TestStreamJoin") {
+	std::cout << "TestStreamJoin -> " << std::endl;
+	using namespace concurrent;
+
+	Pool<void>::Ptr pool(new Pool<void>(4));
+
+	// Every customer id below 100 has i % 3 orders, odd ids have no customer.
+	std::vector<std::pair<int, std::string>> customers;
+	for (int i = 0; i < 100; i += 2) {
+		customers.emplace_back(i, "c" + std::to_string(i));
+	}
+
+	std::vector<std::pair<int, int>> orders;
+	size_t matched = 0, unmatched = 0;
+	for (int i = 0; i < 100; i++) {
+		for (int j = 0; j < i % 3; j++) {
+			orders.emplace_back(i, j);
+		}
+		if (i % 3) {
+			(i % 2 ? unmatched : matched) += i % 3;
+		}
+	}
+
+	SECTION("inner") {
+		Streamer<std::pair<int, std::string>>::Ptr build(new Streamer<std::pair<int, std::string>>(customers.begin(), customers.end(), pool));
+		Streamer<std::pair<int, int>>::Ptr probe(new Streamer<std::pair<int, int>>(orders.begin(), orders.end(), pool));
+
+		auto result = probe->Join(build, [](const std::pair<int, int>& o) {
+			return o.first;
+		}, [](const std::pair<int, std::string>& c) {
+			return c.first;
+		}, [](const std::pair<int, int>& o, const std::pair<int, std::string>& c) {
+			return o.first == c.first ? c.second : std::string();
+		}, 3);
+
+		auto rows = result->Reduce<size_t>([](const std::string& name, size_t& n) {
+			n += name.empty() ? 0 : 1;
+		});
+		REQUIRE(rows == matched);
+		result->Close();
+	}
+
+	SECTION("left") {
+		Streamer<std::pair<int, std::string>>::Ptr build(new Streamer<std::pair<int, std::string>>(customers.begin(), customers.end(), pool));
+		Streamer<std::pair<int, int>>::Ptr probe(new Streamer<std::pair<int, int>>(orders.begin(), orders.end(), pool));
+
+		auto result = probe->LeftJoin(build, [](const std::pair<int, int>& o) {
+			return o.first;
+		}, [](const std::pair<int, std::string>& c) {
+			return c.first;
+		}, [](const std::pair<int, int>&, const std::pair<int, std::string>* c) {
+			return c ? 1 : 0;
+		}, 2);
+
+		auto hits = result->Reduce<std::pair<size_t, size_t>>([](int hit, std::pair<size_t, size_t>& n) {
+			(hit ? n.first : n.second)++;
+		});
+		REQUIRE(hits.first == matched);
+		REQUIRE(hits.second == unmatched);
+		result->Close();
+	}
+
+	std::cout << "<- TestStreamJoin" << std::endl;
+}
+
+TEST_CASE("TestSpillRead") {
+	using namespace concurrent;
+
+	std::FILE* f = std::tmpfile();
+	REQUIRE(f != nullptr);
+
+	int v = 7;
+	REQUIRE(Spill<int>::Write(f, v));
+	REQUIRE(Spill<std::string>::Write(f, "spill"));
+	std::fwrite(&v, 1, 2, f);
+	std::rewind(f);
+
+	// A whole record, then a partial one: the latter is not an end of file.
+	int i = 0;
+	std::string s;
+	REQUIRE(Spill<int>::Read(f, i));
+	REQUIRE(i == 7);
+	REQUIRE(Spill<std::string>::Read(f, s));
+	REQUIRE(s == "spill");
+	REQUIRE_THROWS_AS(Spill<int>::Read(f, i), std::system_error);
+	REQUIRE_FALSE(Spill<int>::Read(f, i));
+	std::fclose(f);
+
+	// A string cut in its body.
+	f = std::tmpfile();
+	size_t n = 10;
+	std::fwrite(&n, sizeof(n), 1, f);
+	std::fwrite("abc", 1, 3, f);
+	std::rewind(f);
+	REQUIRE_THROWS_AS(Spill<std::string>::Read(f, s), std::system_error);
+	std::fclose(f);
+
+	// Reading a stream opened for writing only fails.
+	f = std::fopen("/dev/null", "w");
+	REQUIRE(f != nullptr);
+	REQUIRE_THROWS_AS(Spill<int>::Read(f, i), std::system_error);
+	std::fclose(f);
+}
+
+TEST_CASE("TestStreamSort") {
+	std::cout << "TestStreamSort -> " << std::endl;
+	using namespace concurrent;
+
+	std::vector<int> input;
+	for (int i = 0; i < 50000; i++) {
+		input.push_back((i * 7919) % 50000);
+	}
+
+	SECTION("spill") {
+		// 16KB per worker spills runs of about 4096 ints.
+		Streamer<int> item(input.begin(), input.end());
+		auto result = item.Sort(std::greater<int>(), 32 << 10, 2);
+
+		std::vector<int> sorted;
+		result->ForEach([&sorted](int v) {
+			sorted.push_back(v);
+		});
+
+		std::sort(input.begin(), input.end(), std::greater<int>());
+		REQUIRE(sorted == input);
+		result->Close();
+	}
+
+	SECTION("merge passes") {
+		// About 200 runs of 512 ints, merged SpillFile::FanIn at a time.
+		std::vector<int> many;
+		for (int i = 0; i < 100000; i++) {
+			many.push_back((i * 7919) % 100000);
+		}
+
+		Streamer<int> item(many.begin(), many.end());
+		auto result = item.Sort(std::less<int>(), 4 << 10, 2);
+
+		std::vector<int> sorted;
+		result->ForEach([&sorted](int v) {
+			sorted.push_back(v);
+		});
+
+		std::sort(many.begin(), many.end());
+		REQUIRE(sorted == many);
+		result->Close();
+	}
+
+	SECTION("strings") {
+		std::vector<std::string> words;
+		for (int i = 0; i < 1000; i++) {
+			words.push_back(std::to_string((i * 37) % 1000));
+		}
+
+		Streamer<std::string> item(words.begin(), words.end());
+		auto result = item.Sort(std::less<std::string>(), 1 << 12, 3);
+
+		std::vector<std::string> sorted;
+		result->ForEach([&sorted](const std::string& v) {
+			sorted.push_back(v);
+		});
+
+		std::sort(words.begin(), words.end());
+		REQUIRE(sorted == words);
+		result->Close();
+	}
+
+	SECTION("topk") {
+		Streamer<int> item(input.begin(), input.end());
+		auto result = item.TopK(10, std::greater<int>(), 3);
+
+		std::vector<int> top;
+		result->ForEach([&top](int v) {
+			top.push_back(v);
+		});
+
+		std::sort(input.begin(), input.end(), std::greater<int>());
+		REQUIRE(top == std::vector<int>(input.begin(), input.begin() + 10));
+		result->Close();
+	}
+
+	std::cout << "<- TestStreamSort" << std::endl;
+}
+
+TEST_CASE("TestStreamTopology") {
+	std::cout << "TestStreamTopology -> " << std::endl;
+	using namespace concurrent;
+
+	std::vector<int> input;
+	for (int i = 0; i < 10000; i++) {
+		input.push_back(i);
+	}
+	const long long sum = 9999LL * 10000 / 2;
+
+	SECTION("broadcast") {
+		Streamer<int> item(input.begin(), input.end());
+		auto branches = item.Broadcast(3);
+
+		auto twice = branches[0]->Transform([](int&& v) { return 2 * v; });
+		auto negated = branches[1]->Transform([](int&& v) { return -v; });
+
+		auto result = twice->Merge(negated, branches[2]);
+		auto total = result->Reduce<long long>([](int v, long long& t) {
+			t += v;
+		});
+
+		REQUIRE(total == 2 * sum - sum + sum);
+		result->Close();
+	}
+
+	SECTION("split") {
+		Streamer<int> item(input.begin(), input.end());
+		auto parity = item.Split(2, [](int v) {
+			return v % 2 == 1;
+		}, 2);
+
+		auto odd = parity[1]->Filter([](int v) {
+			return v % 2 == 1;
+		});
+		auto even = parity[0]->Filter([](int v) {
+			return v % 2 == 0;
+		});
+
+		std::vector<Streamer<int>::Ptr> rest = { even };
+		auto result = odd->Merge(rest);
+		auto count = result->Reduce<size_t>([](int, size_t& n) {
+			n++;
+		});
+
+		REQUIRE(count == input.size());
+		result->Close();
+	}
+
+	std::cout << "<- TestStreamTopology" << std::endl;
+}
+
+TEST_CASE("TestStreamFlatMap") {
+	std::cout << "TestStreamFlatMap -> " << std::endl;
+	using namespace concurrent;
+
+	// Line i holds i % 5 words.
+	std::vector<std::string> lines;
+	size_t words = 0;
+	for (int i = 0; i < 10000; i++) {
+		std::string line;
+		for (int j = 0; j < i % 5; j++) {
+			line += (j ? " w" : "w") + std::to_string(j);
+		}
+		lines.push_back(line);
+		words += i % 5;
+	}
+
+	auto tokenize = [](std::string&& line, Emitter<std::string>& emit) {
+		size_t b = 0;
+		while (b < line.size()) {
+			size_t e = line.find(' ', b);
+			if (e == std::string::npos) {
+				e = line.size();
+			}
+			emit(line.substr(b, e - b));
+			b = e + 1;
+		}
+	};
+
+	SECTION("single") {
+		Streamer<std::string> item(lines.begin(), lines.end());
+		auto result = item.FlatMap<std::string>(tokenize);
+
+		auto count = result->Reduce<size_t>([](const std::string& w, size_t& n) {
+			n += w[0] == 'w' ? 1 : 0;
+		});
+		REQUIRE(count == words);
+		result->Close();
+	}
+
+	SECTION("batched") {
+		Streamer<std::string> item(lines.begin(), lines.end());
+		auto result = item.FlatMap<std::string>(tokenize, 3, 1024, 64);
+
+		auto count = result->Reduce<size_t>([](const std::string& w, size_t& n) {
+			n += w[0] == 'w' ? 1 : 0;
+		});
+		REQUIRE(count == words);
+		result->Close();
+	}
+
+	std::cout << "<- TestStreamFlatMap" << std::endl;
+}
+
+TEST_CASE("TestStreamAutoscale") {
+	std::cout << "TestStreamAutoscale -> " << std::endl;
+	using namespace concurrent;
+
+	std::vector<int> input;
+	for (int i = 0; i < 20000; i++) {
+		input.push_back(i);
+	}
+
+	Autoscaler::Ptr scaler(new Autoscaler(4, 5));
+
+	Streamer<int> item(input.begin(), input.end());
+	item.Autoscale(scaler);
+
+	// The slow stage backs its input up, so it should get more workers.
+	auto slow = item.Filter([](int v) {
+		std::this_thread::sleep_for(std::chrono::microseconds(50));
+		return v % 2 == 0;
+	}, 1, 1024);
+	auto fast = slow->Transform([](int&& v) {
+		return v / 2;
+	}, 1, 1024);
+
+	auto total = fast->Reduce<long long>([](int v, long long& t) {
+		t += v;
+	});
+	REQUIRE(total == 9999LL * 10000 / 2);
+
+	auto stats = scaler->Stats();
+	REQUIRE(stats.size() == 2);
+	REQUIRE(stats[0].name == "filter");
+	REQUIRE(stats[0].processed == input.size());
+	REQUIRE(stats[0].peak > 1);
+	REQUIRE(stats[1].processed == input.size() / 2);
+	REQUIRE(scaler->Workers() == 0);
+
+	fast->Close();
+	std::cout << "<- TestStreamAutoscale" << std::endl;
+}
+
+TEST_CASE("TestStreamAutoscaleKV") {
+	std::cout << "TestStreamAutoscaleKV -> " << std::endl;
+	using namespace concurrent;
+
+	std::vector<int> input;
+	for (int i = 0; i < 20000; i++) {
+		input.push_back(i);
+	}
+
+	Autoscaler::Ptr scaler(new Autoscaler(4, 5));
+
+	Streamer<int> item(input.begin(), input.end());
+	item.Autoscale(scaler);
+
+	// KV pops its input while upstream still produces, like other stages.
+	auto result = item.KV<std::unordered_map<int, int>>([](int v) {
+		std::this_thread::sleep_for(std::chrono::microseconds(50));
+		return std::make_pair(v, v * 2);
+	});
+	result->Output()->Wait();
+
+	REQUIRE(result->Output()->Size() == input.size());
+	REQUIRE(result->Output()->GetOr(9999, 0) == 19998);
+
+	auto stats = scaler->Stats();
+	REQUIRE(stats.size() == 1);
+	REQUIRE(stats[0].name == "kv");
+	REQUIRE(stats[0].processed == input.size());
+	REQUIRE(stats[0].peak > 1);
+	REQUIRE(scaler->Workers() == 0);
+
+	std::cout << "<- TestStreamAutoscaleKV" << std::endl;
+}
+
+TEST_CASE("TestAutoscalerMoves") {
+	std::cout << "TestAutoscalerMoves -> " << std::endl;
+	using namespace concurrent;
+
+	Pool<void>::Ptr pool(new Pool<void>(3));
+	Autoscaler::Ptr scaler(new Autoscaler(2, 5));
+
+	auto idle = std::make_shared<SyncQueue<int>>(64);
+	auto busy = std::make_shared<SyncQueue<int>>(64);
+	for (int i = 0; i < 64; i++) {
+		busy->Push(i);
+	}
+
+	auto send = [pool](const std::function<void()>& task) {
+		pool->Send(task);
+	};
+	auto loop = [](std::shared_ptr<SyncQueue<int>> q) {
+		return [q](Autoscaler::Stage& stage) {
+			try {
+				while (q->CanReceive()) {
+					if (stage.Retire()) {
+						return true;
+					}
+					try {
+						q->Pop(50);
+						std::this_thread::sleep_for(std::chrono::milliseconds(2));
+						stage.Processed();
+					} catch (const ex::TimeoutQueueException&) {
+					} catch (const ex::EmptyQueueException&) {
+					}
+				}
+			} catch (const ex::ClosedQueueException&) {
+			}
+			return false;
+		};
+	};
+
+	std::atomic<int> finished{ 0 };
+	auto a = scaler->Register("idle", 64, [idle] { return idle->Size(); }, send, loop(idle), [&finished] { finished++; }, 2);
+	auto b = scaler->Register("busy", 64, [busy] { return busy->Size(); }, send, loop(busy), [&finished] { finished++; }, 1);
+	busy->Close();
+
+	// The budget is used up, so the backed up stage can only grow by taking
+	// the spare worker of the idle one.
+	while (!b->Done()) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	idle->Close();
+	while (!a->Done()) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+
+	auto stats = scaler->Stats();
+	REQUIRE(stats.size() == 2);
+	REQUIRE(stats[0].name == "idle");
+	REQUIRE(stats[1].name == "busy");
+	REQUIRE(stats[1].processed == 64);
+	REQUIRE(stats[1].peak == 2);
+	REQUIRE(finished.load() == 2);
+	REQUIRE(scaler->Workers() == 0);
+
+	// Finished stages are dropped, along with their queues.
+	a.reset();
+	b.reset();
+	for (int i = 0; i < 200 && (idle.use_count() > 1 || busy.use_count() > 1); i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	REQUIRE(idle.use_count() == 1);
+	REQUIRE(busy.use_count() == 1);
+	REQUIRE(scaler->Stats().size() == 2);
+
+	std::cout << "<- TestAutoscalerMoves" << std::endl;
+}
+
+TEST_CASE("TestStreamLazy") {
+	std::cout << "TestStreamLazy -> " << std::endl;
+	using namespace concurrent;
+
+	std::vector<int> input;
+	for (int i = 0; i < 100; i++) {
+		input.push_back(i);
+	}
+
+	SECTION("fused") {
+		auto item = Streamer<int>::Lazy(input.begin(), input.end());
+		REQUIRE(item->IsLazy());
+
+		auto even = item->Filter([](int v) {
+			return v % 2 == 0;
+		});
+		auto pairs = even->FlatMap<int>([](int&& v, Emitter<int>& emit) {
+			emit(v);
+			emit(v + 1);
+		}, 4);
+		auto squares = pairs->Transform([](int&& v) {
+			return (long long)v * v;
+		});
+		REQUIRE(squares->IsLazy());
+
+		auto total = squares->Reduce<long long>([](long long v, long long& t) {
+			t += v;
+		});
+		REQUIRE(total == 99LL * 100 * 199 / 6);
+
+		// The terminal used up the pulled stages.
+		REQUIRE_FALSE(squares->IsLazy());
+		REQUIRE(squares->Reduce<long long>([](long long v, long long& t) {
+			t += v;
+		}) == 0);
+		squares->Close();
+	}
+
+	SECTION("materialized") {
+		// Stages without a pulled variant read the queue filled on demand.
+		auto item = Streamer<int>::Lazy(input.rbegin(), input.rend());
+		auto sorted = item->Filter([](int v) {
+			return v < 50;
+		})->Sort();
+
+		std::vector<int> out;
+		sorted->ForEach([&out](int v) {
+			out.push_back(v);
+		});
+		REQUIRE(out == std::vector<int>(input.begin(), input.begin() + 50));
+		sorted->Close();
+	}
+
+	SECTION("eager by default") {
+		Streamer<int> item(input.begin(), input.end());
+		REQUIRE_FALSE(item.IsLazy());
+		REQUIRE(item.Reduce<long long>([](int v, long long& t) {
+			t += v;
+		}) == 99LL * 100 / 2);
+		item.Close();
+	}
+
+	std::cout << "<- TestStreamLazy" << std::endl;
+}